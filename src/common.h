@@ -32,6 +32,8 @@
 
 #include <vector>
 #include <queue>
+#include <deque>
+#include <set>
 #include <mutex>
 #include <shared_mutex>
 #include <map>
@@ -40,7 +42,12 @@
 #include <stdexcept>
 #include <atomic>
 #include <algorithm>
+#include <memory>
 #include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <condition_variable>
+#include <functional>
 
 #include <cstdio>
 #include <cstdlib>
@@ -28,12 +28,15 @@
 extern "C" {
 #endif
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <stdint.h>
 
 #define VERIFS2_IOC_CODE    '1'
 #define VERIFS2_IOC_NO(x)   (VERIFS2_IOC_CODE + (x))
 #define VERIFS2_IOC(n)      _IO(VERIFS2_IOC_CODE, VERIFS2_IOC_NO(n))
 #define VERIFS2_GET_IOC(n, type)  _IOR(VERIFS2_IOC_CODE, VERIFS2_IOC_NO(n), type)
 #define VERIFS2_SET_IOC(n, type)  _IOW(VERIFS2_IOC_CODE, VERIFS2_IOC_NO(n), type)
+#define VERIFS2_GETSET_IOC(n, type)  _IOWR(VERIFS2_IOC_CODE, VERIFS2_IOC_NO(n), type)
 
 #define VERIFS_CHECKPOINT  VERIFS2_IOC(1)
 #define VERIFS_RESTORE     VERIFS2_IOC(2)
@@ -45,6 +48,285 @@ extern "C" {
 #define VERIFS_PICKLE_CFG  "/tmp/pickle.cfg"
 #define VERIFS_LOAD_CFG    "/tmp/pickle.cfg"
 
+// Memory usage statistics of the state pool
+struct verifs_stats {
+    uint64_t num_states;        /* Number of states in the state pool */
+    uint64_t unique_pages;      /* Distinct pages in the dedup page store */
+    uint64_t page_refs;         /* References to these pages */
+    uint64_t page_size;
+    uint64_t bytes_saved;       /* (page_refs - unique_pages) * page_size */
+    uint64_t dedup_ratio_milli; /* page_refs / unique_pages, times 1000 */
+    uint64_t spilled_states;    /* States spilled to disk (state_budget) */
+    uint64_t compressed_states; /* States compressed in memory */
+    uint64_t compressed_bytes;  /* Memory used by them */
+};
+
+#define VERIFS_GET_STATS   VERIFS2_GET_IOC(5, struct verifs_stats)
+
+// Discard the state with the key given as argument without restoring it
+#define VERIFS_DROP        VERIFS2_IOC(6)
+
+// Discard all states with first <= key <= last; returns how many were found
+struct verifs_key_range {
+    uint64_t first;
+    uint64_t last;
+};
+
+#define VERIFS_DROP_RANGE  VERIFS2_SET_IOC(7, struct verifs_key_range)
+
+// Restore the state with the key given as argument, but keep it stored
+#define VERIFS_RESTORE_KEEP VERIFS2_IOC(8)
+
+// List the stored states in increasing key order, VERIFS_LIST_MAX at a
+// time. Set start_key to the last key returned plus one for the next batch.
+#define VERIFS_LIST_MAX    64
+
+#define VERIFS_STATE_JOURNALED  1   /* Kept in the undo journal */
+#define VERIFS_STATE_SPILLED    2   /* Spilled to disk; counts are from
+                                       the time it was spilled */
+#define VERIFS_STATE_COMPRESSED 4   /* Compressed in memory; likewise */
+#define VERIFS_STATE_DELTA      8   /* Stored as changes to another state;
+                                       counts are of the changes only */
+
+struct verifs_state_info {
+    uint64_t key;
+    uint64_t flags;
+    uint64_t num_inodes;        /* Inodes in the state */
+    uint64_t num_pages;         /* File pages they reference */
+    uint64_t private_inodes;    /* Inodes not shared with the file system */
+    uint64_t private_pages;     /* or other states, freed by dropping it */
+    uint64_t parent;            /* See VERIFS_GC */
+};
+
+struct verifs_state_list {
+    uint64_t start_key;         /* in: list keys >= start_key */
+    uint64_t total;             /* out: number of states */
+    uint32_t count;             /* out: entries filled in */
+    uint32_t more;              /* out: non-zero if keys remain */
+    struct verifs_state_info states[VERIFS_LIST_MAX];
+};
+
+#define VERIFS_LIST        VERIFS2_GETSET_IOC(9, struct verifs_state_list)
+
+// Abstract state of the live file system: a SHA-256 hash over the tree of
+// names, attributes (mode, nlink, uid, gid, size, rdev, mtime, ctime, ino),
+// xattrs and contents. Access times are never included. Unchanged parts
+// are not hashed again, and the hash of an unchanged file system is
+// returned right away.
+#define VERIFS_HASH_NO_TIMES    1   /* Leave out mtime and ctime */
+#define VERIFS_HASH_NO_INO      2   /* Leave out the inode numbers */
+
+#define VERIFS_HASH_SIZE   32
+
+struct verifs_state_hash {
+    uint32_t flags;             /* in: VERIFS_HASH_* */
+    uint32_t reserved;
+    unsigned char hash[VERIFS_HASH_SIZE];   /* out */
+};
+
+#define VERIFS_STATE_HASH  VERIFS2_GETSET_IOC(10, struct verifs_state_hash)
+
+// Differences between two states, by path. A key of VERIFS_DIFF_LIVE
+// stands for the live file system. Subtrees with equal hashes (see
+// VERIFS_STATE_HASH) are skipped. The differences come in path order,
+// VERIFS_DIFF_MAX at a time; set start to the number already returned
+// for the next batch.
+#define VERIFS_DIFF_LIVE        UINT64_MAX
+#define VERIFS_DIFF_MAX         32
+#define VERIFS_DIFF_PATH_MAX    232
+
+#define VERIFS_DIFF_ADDED       1   /* Only in key_b */
+#define VERIFS_DIFF_REMOVED     2   /* Only in key_a */
+#define VERIFS_DIFF_CHANGED     3
+
+#define VERIFS_DIFF_TYPE        1   /* File type */
+#define VERIFS_DIFF_ATTR        2   /* Attributes */
+#define VERIFS_DIFF_XATTR       4   /* Extended attributes */
+#define VERIFS_DIFF_CONTENT     8   /* Data or link target; see offset */
+#define VERIFS_DIFF_TRUNCATED   16  /* The path did not fit */
+
+struct verifs_diff_entry {
+    uint32_t kind;              /* VERIFS_DIFF_ADDED etc. */
+    uint32_t what;              /* VERIFS_DIFF_TYPE etc., if changed */
+    uint64_t offset;            /* Range of the content that differs */
+    uint64_t length;
+    char path[VERIFS_DIFF_PATH_MAX];
+};
+
+struct verifs_diff {
+    uint64_t key_a;             /* in */
+    uint64_t key_b;             /* in */
+    uint32_t flags;             /* in: VERIFS_HASH_* */
+    uint32_t start;             /* in: differences to skip */
+    uint32_t count;             /* out: entries filled in */
+    uint32_t more;              /* out: non-zero if differences remain */
+    struct verifs_diff_entry entries[VERIFS_DIFF_MAX];
+};
+
+#define VERIFS_DIFF        VERIFS2_GETSET_IOC(11, struct verifs_diff)
+
+// Every state can be browsed read-only under /.snapshots/<key>, with the
+// key in decimal, without restoring it. The directory is not listed in
+// the root, and a real entry of the same name hides it.
+#define VERIFS_SNAPSHOT_DIR     ".snapshots"
+
+// Checkpoint tree. The parent of a state is the one the file system was
+// in when it was taken, i.e. the state checkpointed or restored last, or
+// VERIFS_NO_PARENT. Dropping a state makes its parent that of its children.
+// VERIFS_GC keeps the roots and their ancestors, and drops every other
+// state at once; returns how many were dropped.
+#define VERIFS_NO_PARENT        UINT64_MAX
+#define VERIFS_GC_MAX           64
+
+struct verifs_gc {
+    uint32_t num_roots;
+    uint32_t reserved;
+    uint64_t roots[VERIFS_GC_MAX];
+};
+
+#define VERIFS_GC          VERIFS2_SET_IOC(12, struct verifs_gc)
+
+// Run a sequence of checkpoints, restores and drops in one call, e.g.
+// "restore k1; checkpoint k2; drop k1". The commands run in order, with
+// the status of each (0 or -errno) stored in it; after a failure the rest
+// get -ECANCELED unless VERIFS_BATCH_CONTINUE is set. Returns how many
+// commands succeeded.
+#define VERIFS_BATCH_MAX        32
+
+#define VERIFS_BATCH_CHECKPOINT     1
+#define VERIFS_BATCH_RESTORE        2
+#define VERIFS_BATCH_RESTORE_KEEP   3
+#define VERIFS_BATCH_DROP           4
+
+#define VERIFS_BATCH_CONTINUE   1   /* Keep going after a failed command */
+
+struct verifs_batch_cmd {
+    uint32_t op;                /* in: VERIFS_BATCH_CHECKPOINT etc. */
+    int32_t status;             /* out */
+    uint64_t key;               /* in */
+};
+
+struct verifs_batch {
+    uint32_t count;             /* in: commands to run */
+    uint32_t flags;             /* in: VERIFS_BATCH_CONTINUE */
+    struct verifs_batch_cmd cmds[VERIFS_BATCH_MAX];
+};
+
+#define VERIFS_BATCH       VERIFS2_GETSET_IOC(13, struct verifs_batch)
+
+// Run a script of file system operations in one call, without a lookup
+// and a request for each of them. Paths are relative to the directory the
+// ioctl is issued on, or to the root if they start with '/', and, like
+// the other strings, are given as offsets of NUL-terminated strings in
+// data. The operations run in order like VERIFS_BATCH, with the status of
+// each (0 or -errno) stored in it; after a failure the rest get
+// -ECANCELED unless VERIFS_FILEOPS_CONTINUE is set. Returns how many
+// operations succeeded.
+#define VERIFS_FILEOPS_MAX      64
+#define VERIFS_FILEOPS_DATA     8192
+
+#define VERIFS_FILEOP_CREATE    1   /* Regular file with permissions mode */
+#define VERIFS_FILEOP_MKDIR     2   /* Directory with permissions mode */
+#define VERIFS_FILEOP_WRITE     3   /* length bytes at offset, repeating
+                                       the value_size bytes at value */
+#define VERIFS_FILEOP_TRUNCATE  4   /* To offset bytes */
+#define VERIFS_FILEOP_UNLINK    5
+#define VERIFS_FILEOP_RMDIR     6
+#define VERIFS_FILEOP_RENAME    7   /* To the path at name */
+#define VERIFS_FILEOP_SETXATTR  8   /* Attribute name to the value_size bytes
+                                       at value, with XATTR_* flags in mode */
+
+#define VERIFS_FILEOPS_CONTINUE 1   /* Keep going after a failed operation */
+
+struct verifs_fileop {
+    uint32_t op;                /* in: VERIFS_FILEOP_CREATE etc. */
+    int32_t status;             /* out */
+    uint32_t path;              /* in: offsets in data */
+    uint32_t name;
+    uint32_t value;
+    uint32_t value_size;
+    uint32_t mode;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct verifs_fileops {
+    uint32_t count;             /* in: operations to run */
+    uint32_t flags;             /* in: VERIFS_FILEOPS_CONTINUE */
+    struct verifs_fileop ops[VERIFS_FILEOPS_MAX];
+    char data[VERIFS_FILEOPS_DATA];
+};
+
+#define VERIFS_FILEOPS     VERIFS2_GETSET_IOC(14, struct verifs_fileops)
+
+// Read the whole tree of a state, or of the live file system, as one
+// image instead of a getdents/stat/readlink per object, up to
+// VERIFS_EXPORT_CHUNK bytes per call. The image holds a struct
+// verifs_export_header, then one record per path in depth-first name
+// order, the root first: a struct verifs_export_entry followed by the
+// path, the symlink target and the xattr names, each of the given length;
+// the names are NUL-terminated. A hard-linked object shows up at each of
+// its paths. With VERIFS_EXPORT_HASHES, each record also holds the
+// VERIFS_STATE_HASH hash of its subtree, computed with the VERIFS_HASH_*
+// flags given.
+//
+// A call at offset 0 builds the image from key and flags and returns a
+// cookie for it. The calls for the rest pass the cookie and the offset to
+// read from; the image is released once its last byte is read. Up to
+// VERIFS_EXPORT_IMAGES images are kept for concurrent readers; the calls
+// fail with ESTALE once the image was dropped for a newer one.
+#define VERIFS_EXPORT_LIVE      UINT64_MAX
+#define VERIFS_EXPORT_CHUNK     8192
+#define VERIFS_EXPORT_IMAGES    4
+#define VERIFS_EXPORT_MAGIC     "VFSTREE"
+#define VERIFS_EXPORT_VERSION   1
+
+#define VERIFS_EXPORT_HASHES    4   /* Next to VERIFS_HASH_NO_TIMES etc. */
+
+struct verifs_export_header {
+    char magic[8];              /* VERIFS_EXPORT_MAGIC */
+    uint32_t version;
+    uint32_t flags;
+    uint64_t key;
+    uint64_t count;             /* Records that follow */
+};
+
+struct verifs_export_entry {
+    uint32_t path_len;
+    uint32_t link_len;
+    uint32_t num_xattrs;
+    uint32_t xattr_len;         /* Bytes of all the names */
+    struct stat attr;
+    unsigned char hash[VERIFS_HASH_SIZE];
+};
+
+struct verifs_export {
+    uint64_t key;               /* in: state, or VERIFS_EXPORT_LIVE */
+    uint32_t flags;             /* in: VERIFS_EXPORT_HASHES, VERIFS_HASH_* */
+    uint32_t length;            /* out: bytes in data */
+    uint64_t offset;            /* in: position in the image */
+    uint64_t cookie;            /* in: image being read; out: set at 0 */
+    uint64_t count;             /* out: records in the image */
+    uint64_t bytes;             /* out: size of the image */
+    char data[VERIFS_EXPORT_CHUNK];
+};
+
+#define VERIFS_EXPORT      VERIFS2_GETSET_IOC(15, struct verifs_export)
+
+// Hint that the state with the key given as argument is restored next. Its
+// inode table is prepared in the background, thawing or loading the state
+// if needed, so that the restore only swaps it in. Only the last hint is
+// kept; a restore of another key leaves it in place.
+#define VERIFS_PREFETCH    VERIFS2_IOC(16)
+
+// Like VERIFS_CHECKPOINT, but return as soon as the live table is captured
+// and store the state in the background. Until then, operations copy a
+// captured inode before modifying it. The other VERIFS ioctls wait for the
+// pending checkpoints first; one that fails after returning is logged and
+// its key stays free.
+#define VERIFS_CHECKPOINT_ASYNC VERIFS2_IOC(17)
+
 #ifdef __cplusplus
 }
 #endif
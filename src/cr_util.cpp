@@ -26,7 +26,17 @@
 #include <vector>
 #include <cstdint>
 #include <cerrno>
+#include <mutex>
+#include <list>
+#include <unordered_set>
+#include <chrono>
+#include <condition_variable>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
 #include "cr_util.hpp"
+#include "worker_pool.hpp"
+#include "lz.hpp"
 
 #ifdef DUMP_TESTING
 #define PRINT_VAL(x) std::cout << #x" : " << x << std::endl
@@ -35,46 +45,833 @@ bool isExistInDeleted(fuse_ino_t curr_ino, std::queue<fuse_ino_t> DeletedInodes)
 void print_ino_queue(std::queue<fuse_ino_t> DeletedInodes);
 #endif
 
-std::unordered_map<uint64_t, verifs2_state> state_pool;
+std::unordered_map<uint64_t, verifs2_state_ptr> state_pool;
+/* Checkpoints fill the pool concurrently with each other */
+static std::mutex state_pool_mutex;
+
+/* Tiered state pool: past state_budget bytes of checkpointed pages, the
+ * least recently used states are pickled into the spill file and only
+ * their location is kept. */
+struct spilled_state {
+    off_t offset;
+    size_t size;
+    struct verifs_state_info info;
+};
+
+static size_t state_budget = 0;
+static int spill_fd = -1;
+static off_t spill_end = 0;
+static std::unordered_map<uint64_t, spilled_state> spilled_pool;
+
+/* States idle for compress_idle are pickled and compressed in memory by
+ * a background thread */
+struct compressed_state {
+    std::shared_ptr<const std::vector<char>> data;
+    size_t size;
+    struct verifs_state_info info;
+};
+
+static std::chrono::seconds compress_idle(0);
+static std::thread compress_thread;
+static bool compress_stopping = false;
+static std::condition_variable compress_cv;
+static std::unordered_map<uint64_t, compressed_state> compressed_pool;
+/* States found with no memory of their own; not worth compressing */
+static std::unordered_set<uint64_t> compress_skipped;
+
+/* Content fingerprints of the stored states. The states are not kept
+ * alive by it; entries of freed states are pruned whenever the map has
+ * doubled since the last pruning. */
+static std::unordered_map<std::string, std::weak_ptr<const verifs2_stored_state>> fingerprints;
+static size_t fingerprints_pruned = 0;
+
+/* Checkpoint tree: the parent of each key and the children of each key,
+ * and the key the live file system was last checkpointed as or restored
+ * from. Guarded by state_pool_mutex. */
+static std::unordered_map<uint64_t, uint64_t> state_parents;
+static std::unordered_map<uint64_t, std::unordered_set<uint64_t>> state_children;
+static uint64_t current_key = VERIFS_NO_PARENT;
+
+/* Keys in memory, most recently used first */
+struct state_use {
+    uint64_t key;
+    std::chrono::steady_clock::time_point last_used;
+};
+static std::list<state_use> state_lru;
+static std::unordered_map<uint64_t, std::list<state_use>::iterator> state_lru_pos;
+/* Serializes spilling, and reading or freeing areas of the spill file */
+static std::mutex spill_mutex;
+static std::mutex spill_file_mutex;
+
+/* Drop the references a state holds on its (possibly shared) inodes */
+static void release_state(verifs2_stored_state *state) {
+    std::vector<Inode *> &inodes = state->inodes;
+    WorkerPool::ParallelFor(inodes.size(), [&inodes](size_t begin, size_t end) {
+        for (size_t ino = begin; ino < end; ino++) {
+            Inode::PutRef(inodes[ino]);
+        }
+    });
+    for (auto &it : state->changes) {
+        Inode::PutRef(it.second);
+    }
+    delete state;
+}
+
+verifs2_state_ptr make_state(verifs2_state &&fs_state) {
+    verifs2_stored_state *state = new verifs2_stored_state();
+    state->depth = 0;
+    state->inodes = std::move(std::get<0>(fs_state));
+    state->table_size = state->inodes.size();
+    state->deleted_inodes = std::move(std::get<1>(fs_state));
+    state->stbuf = std::get<2>(fs_state);
+    return verifs2_state_ptr(state, release_state);
+}
+
+verifs2_state_ptr make_delta(const verifs2_state_ptr &parent,
+                             std::vector<std::pair<fuse_ino_t, Inode *>> &&changes,
+                             size_t table_size, std::queue<fuse_ino_t> &&deleted_inodes,
+                             const struct statvfs &stbuf) {
+    verifs2_stored_state *state = new verifs2_stored_state();
+    state->parent = parent;
+    state->depth = parent->depth + 1;
+    state->changes = std::move(changes);
+    state->table_size = table_size;
+    state->deleted_inodes = std::move(deleted_inodes);
+    state->stbuf = stbuf;
+    return verifs2_state_ptr(state, release_state);
+}
+
+verifs2_state materialize_state(const verifs2_state_ptr &state) {
+    std::vector<const verifs2_stored_state *> deltas;
+    const verifs2_stored_state *base = state.get();
+    for (; base->parent != nullptr; base = base->parent.get()) {
+        deltas.push_back(base);
+    }
+    verifs2_state image(base->inodes, state->deleted_inodes, state->stbuf);
+    std::vector<Inode *> &inodes = std::get<0>(image);
+    for (auto it = deltas.rbegin(); it != deltas.rend(); ++it) {
+        inodes.resize((*it)->table_size, nullptr);
+        for (auto &change : (*it)->changes) {
+            inodes[change.first] = change.second;
+        }
+    }
+    return image;
+}
+
+/* Caller must hold state_pool_mutex */
+static void touch_state(uint64_t key) {
+    auto it = state_lru_pos.find(key);
+    if (it != state_lru_pos.end()) {
+        state_lru.splice(state_lru.begin(), state_lru, it->second);
+    } else {
+        state_lru.push_front({key, {}});
+        state_lru_pos[key] = state_lru.begin();
+    }
+    state_lru.front().last_used = std::chrono::steady_clock::now();
+}
+
+/* Caller must hold state_pool_mutex */
+static void forget_state(uint64_t key) {
+    auto it = state_lru_pos.find(key);
+    if (it != state_lru_pos.end()) {
+        state_lru.erase(it->second);
+        state_lru_pos.erase(it);
+    }
+    compress_skipped.erase(key);
+}
+
+/* Take a key out of the checkpoint tree; its children move up to its
+ * parent. Caller must hold state_pool_mutex */
+static void _unlink_state(uint64_t key) {
+    auto it = state_parents.find(key);
+    uint64_t parent = (it != state_parents.end()) ? it->second : VERIFS_NO_PARENT;
+    auto cit = state_children.find(key);
+    if (cit != state_children.end()) {
+        for (uint64_t child : cit->second) {
+            state_parents[child] = parent;
+            if (parent != VERIFS_NO_PARENT) {
+                state_children[parent].insert(child);
+            }
+        }
+        state_children.erase(cit);
+    }
+    if (it != state_parents.end()) {
+        state_parents.erase(it);
+        if (parent != VERIFS_NO_PARENT) {
+            state_children[parent].erase(key);
+        }
+    }
+    if (current_key == key) {
+        current_key = parent;
+    }
+}
+
+/* Give the disk space of a spilled state back.
+ * Caller must hold spill_file_mutex */
+static void free_spilled(const spilled_state &rec) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+    fallocate(spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, rec.offset, rec.size);
+#endif
+}
+
+void count_state(const verifs2_state_ptr &state, struct verifs_state_info *info) {
+    if (state->parent == nullptr) {
+        count_state(state->inodes, info);
+        return;
+    }
+    std::vector<Inode *> changed;
+    for (auto &it : state->changes) {
+        changed.push_back(it.second);
+    }
+    info->flags |= VERIFS_STATE_DELTA;
+    count_state(changed, info);
+}
+
+void count_state(const std::vector<Inode *> &inodes, struct verifs_state_info *info) {
+    for (auto &i : inodes) {
+        if (i == nullptr) {
+            continue;
+        }
+        size_t npages = 0, nprivate = 0;
+        if (S_ISREG(i->GetMode())) {
+            dynamic_cast<File *>(i)->CountPages(npages, nprivate);
+        }
+        info->num_inodes++;
+        info->num_pages += npages;
+        if (!i->IsShared()) {
+            info->private_inodes++;
+            info->private_pages += nprivate;
+        }
+    }
+}
+
+/* Serialize a state: the inode table in the format of the pickle file,
+ * then the pending deleted inodes and the statvfs. Deltas are stored as
+ * a whole image. */
+static void pickle_state(const verifs2_state_ptr &stored, std::vector<char> &buf) {
+    verifs2_state state = materialize_state(stored);
+    auto append = [&buf](const void *data, size_t len) {
+        buf.insert(buf.end(), (const char *) data, (const char *) data + len);
+    };
+    const std::vector<Inode *> &inodes = std::get<0>(state);
+    size_t num_inodes = inodes.size();
+    append(&num_inodes, sizeof(num_inodes));
+    for (auto &inode : inodes) {
+        bool exist = (inode != nullptr);
+        mode_t mode = exist ? inode->GetMode() : 0;
+        append(&exist, sizeof(exist));
+        append(&mode, sizeof(mode));
+        if (!exist) {
+            continue;
+        }
+        size_t offset = buf.size();
+        buf.resize(offset + inode->GetPickledSize());
+        void *ptr = buf.data() + offset;
+        inode->Pickle(ptr);
+    }
+    std::queue<fuse_ino_t> deleted_inodes = std::get<1>(state);
+    size_t num_deleted = deleted_inodes.size();
+    append(&num_deleted, sizeof(num_deleted));
+    for (; !deleted_inodes.empty(); deleted_inodes.pop()) {
+        append(&deleted_inodes.front(), sizeof(fuse_ino_t));
+    }
+    append(&std::get<2>(state), sizeof(struct statvfs));
+}
+
+/* @return The state, or nullptr if the data is corrupted */
+static verifs2_state_ptr load_state(const char *data, size_t size) {
+    const char *ptr = data;
+    const char *end = data + size;
+    verifs2_state state;
+    std::vector<Inode *> &inodes = std::get<0>(state);
+    auto fetch = [&ptr, end](void *out, size_t len) {
+        if ((size_t)(end - ptr) < len) {
+            return false;
+        }
+        memcpy(out, ptr, len);
+        ptr += len;
+        return true;
+    };
+    size_t num_inodes;
+    bool ok = fetch(&num_inodes, sizeof(num_inodes));
+    for (size_t i = 0; ok && i < num_inodes; ++i) {
+        bool exist;
+        mode_t mode;
+        ok = fetch(&exist, sizeof(exist)) && fetch(&mode, sizeof(mode));
+        if (!ok || !exist) {
+            inodes.push_back(nullptr);
+            continue;
+        }
+        Inode *inode;
+        if (S_ISREG(mode)) {
+            inode = new File();
+        } else if (S_ISDIR(mode)) {
+            inode = new Directory();
+        } else if (S_ISLNK(mode)) {
+            inode = new SymLink();
+        } else {
+            inode = new SpecialInode();
+        }
+        inodes.push_back(inode);
+        const void *ptr2 = ptr;
+        size_t res = inode->Load(ptr2);
+        ok = (res > 0 && res <= (size_t)(end - ptr));
+        ptr += res;
+    }
+    size_t num_deleted;
+    ok = ok && fetch(&num_deleted, sizeof(num_deleted));
+    for (size_t i = 0; ok && i < num_deleted; ++i) {
+        fuse_ino_t ino;
+        ok = fetch(&ino, sizeof(ino));
+        std::get<1>(state).push(ino);
+    }
+    ok = ok && fetch(&std::get<2>(state), sizeof(struct statvfs));
+
+    verifs2_state_ptr loaded = make_state(std::move(state));
+    return ok ? loaded : nullptr;
+}
+
+/* Read a spilled state back.
+ * Caller must hold spill_file_mutex */
+static verifs2_state_ptr read_spilled(uint64_t key, const spilled_state &rec) {
+    std::vector<char> buf(rec.size);
+    ssize_t res = pread(spill_fd, buf.data(), rec.size, rec.offset);
+    verifs2_state_ptr state;
+    if (res == (ssize_t) rec.size) {
+        state = load_state(buf.data(), rec.size);
+    }
+    if (state == nullptr) {
+        std::cerr << "Cannot load spilled state " << key << std::endl;
+    }
+    return state;
+}
+
+/* Spill the least recently used states until their pages fit in the
+ * budget. States shared by several keys or in use are skipped, as are
+ * those whose memory is all shared with others. */
+static void spill_cold_states() {
+    if (state_budget == 0) {
+        return;
+    }
+    std::unique_lock<std::mutex> spilllk(spill_mutex, std::try_to_lock);
+    if (!spilllk.owns_lock()) {
+        return;
+    }
+    std::unordered_set<uint64_t> skipped;
+    while (PageStore::NumPages() * Page::Size > state_budget) {
+        uint64_t key;
+        verifs2_state_ptr state;
+        {
+            std::lock_guard<std::mutex> lk(state_pool_mutex);
+            for (auto it = state_lru.rbegin(); it != state_lru.rend(); ++it) {
+                const verifs2_state_ptr &candidate = state_pool.at(it->key);
+                if (candidate.use_count() == 1 && skipped.count(it->key) == 0) {
+                    key = it->key;
+                    state = candidate;
+                    break;
+                }
+            }
+        }
+        if (state == nullptr) {
+            break;
+        }
+        skipped.insert(key);
+
+        spilled_state rec = {};
+        rec.info.key = key;
+        rec.info.flags = VERIFS_STATE_SPILLED;
+        count_state(state, &rec.info);
+        if (rec.info.private_inodes == 0 && rec.info.private_pages == 0) {
+            continue;
+        }
+        std::vector<char> buf;
+        pickle_state(state, buf);
+        rec.offset = spill_end;
+        rec.size = buf.size();
+        if (pwrite(spill_fd, buf.data(), rec.size, rec.offset) != (ssize_t) rec.size) {
+            std::cerr << "Cannot spill state " << key << ": " << strerror(errno) << std::endl;
+            break;
+        }
+        spill_end += rec.size;
+
+        std::lock_guard<std::mutex> lk(state_pool_mutex);
+        auto it = state_pool.find(key);
+        if (it == state_pool.end() || it->second != state ||
+            it->second.use_count() != 2) {
+            /* Removed, replaced or used meanwhile: a user would keep the
+             * state in memory next to its spilled copy. The copy is the
+             * last record, as spill_mutex is held, so reuse its space. */
+            spill_end = rec.offset;
+            continue;
+        }
+        state_pool.erase(it);
+        forget_state(key);
+        spilled_pool[key] = rec;
+    }
+}
+
+/* Compress the states that have not been used for compress_idle */
+static void compress_idle_states() {
+    std::unique_lock<std::mutex> lk(state_pool_mutex);
+    auto now = std::chrono::steady_clock::now();
+    std::vector<std::pair<uint64_t, verifs2_state_ptr>> idle;
+    for (auto it = state_lru.rbegin(); it != state_lru.rend(); ++it) {
+        if (now - it->last_used < compress_idle) {
+            break;
+        }
+        const verifs2_state_ptr &state = state_pool.at(it->key);
+        if (state.use_count() == 1 && compress_skipped.count(it->key) == 0) {
+            idle.push_back({it->key, state});
+        }
+    }
+    lk.unlock();
+
+    for (auto &it : idle) {
+        compressed_state rec = {};
+        rec.info.key = it.first;
+        rec.info.flags = VERIFS_STATE_COMPRESSED;
+        count_state(it.second, &rec.info);
+        if (rec.info.private_inodes == 0 && rec.info.private_pages == 0) {
+            lk.lock();
+            compress_skipped.insert(it.first);
+            lk.unlock();
+            continue;
+        }
+        std::vector<char> buf;
+        pickle_state(it.second, buf);
+        auto data = std::make_shared<std::vector<char>>();
+        lz_compress(buf.data(), buf.size(), *data);
+        data->shrink_to_fit();
+        rec.data = data;
+        rec.size = buf.size();
+
+        lk.lock();
+        auto pit = state_pool.find(it.first);
+        if (pit != state_pool.end() && pit->second == it.second &&
+            pit->second.use_count() == 2) {
+            state_pool.erase(pit);
+            forget_state(it.first);
+            compressed_pool[it.first] = rec;
+        }
+        lk.unlock();
+        /* Frees the state unless it was used meanwhile */
+        it.second = nullptr;
+    }
+}
+
+static void compress_worker() {
+    std::unique_lock<std::mutex> lk(state_pool_mutex);
+    while (!compress_stopping) {
+        compress_cv.wait_for(lk, std::chrono::seconds(1));
+        if (compress_stopping) {
+            break;
+        }
+        lk.unlock();
+        compress_idle_states();
+        lk.lock();
+    }
+}
+
+/* The thread is started with the first checkpoint, as the daemon forks
+ * after parsing the options.
+ * Caller must hold state_pool_mutex */
+static void start_compression() {
+    if (compress_idle.count() > 0 && !compress_stopping && !compress_thread.joinable()) {
+        compress_thread = std::thread(compress_worker);
+    }
+}
+
+int set_state_compression(unsigned int idle_seconds) {
+    std::lock_guard<std::mutex> lk(state_pool_mutex);
+    compress_idle = std::chrono::seconds(idle_seconds);
+    return 0;
+}
+
+void stop_state_compression() {
+    {
+        std::lock_guard<std::mutex> lk(state_pool_mutex);
+        compress_stopping = true;
+    }
+    compress_cv.notify_all();
+    if (compress_thread.joinable()) {
+        compress_thread.join();
+    }
+}
+
+/* Decompress a compressed state.
+ * @return The state, or nullptr if the data is corrupted */
+static verifs2_state_ptr thaw_state(uint64_t key, const compressed_state &rec) {
+    std::vector<char> buf(rec.size);
+    verifs2_state_ptr state;
+    if (lz_decompress(rec.data->data(), rec.data->size(), buf.data(), rec.size)) {
+        state = load_state(buf.data(), rec.size);
+    }
+    if (state == nullptr) {
+        std::cerr << "Cannot decompress state " << key << std::endl;
+    }
+    return state;
+}
+
+int set_state_budget(size_t budget, const char *dir) {
+    int fd = -1;
+#ifdef O_TMPFILE
+    fd = open(dir, O_TMPFILE | O_RDWR, 0600);
+#endif
+    if (fd < 0) {
+        std::string path = std::string(dir) + "/verifs-spill-XXXXXX";
+        fd = mkstemp(&path[0]);
+        if (fd < 0) {
+            return -errno;
+        }
+        unlink(path.c_str());
+    }
+    spill_fd = fd;
+    state_budget = budget;
+    return 0;
+}
 
 int insert_state(uint64_t key,
                  const std::tuple<std::vector<Inode *>, std::queue<fuse_ino_t>,
                          struct statvfs> &fs_states_vec) {
-    auto it = state_pool.find(key);
-    if (it != state_pool.end()) {
-        return -EEXIST;
+    {
+        std::lock_guard<std::mutex> lk(state_pool_mutex);
+        if (state_pool.count(key) > 0 || spilled_pool.count(key) > 0 ||
+            compressed_pool.count(key) > 0) {
+            return -EEXIST;
+        }
+        state_pool.insert({key, make_state(verifs2_state(fs_states_vec))});
+        touch_state(key);
+        start_compression();
     }
-    state_pool.insert({key, fs_states_vec});
+    spill_cold_states();
+    return 0;
+}
 
+int insert_state(uint64_t key, const verifs2_state_ptr &state) {
+    {
+        std::lock_guard<std::mutex> lk(state_pool_mutex);
+        if (state_pool.count(key) > 0 || spilled_pool.count(key) > 0 ||
+            compressed_pool.count(key) > 0) {
+            return -EEXIST;
+        }
+        state_pool.insert({key, state});
+        touch_state(key);
+        start_compression();
+    }
+    spill_cold_states();
     return 0;
 }
 
-verifs2_state find_state(uint64_t key) {
+verifs2_state_ptr find_state(uint64_t key) {
+    std::unique_lock<std::mutex> lk(state_pool_mutex);
     auto it = state_pool.find(key);
-    if (it == state_pool.end()) {
-        std::queue<fuse_ino_t> empty_queue;
-        struct statvfs empty_statvfs = {};
-        return verifs2_state{std::vector<Inode *>(), empty_queue, empty_statvfs};
-    } else {
+    if (it != state_pool.end()) {
+        touch_state(key);
         return it->second;
     }
+    auto cit = compressed_pool.find(key);
+    if (cit != compressed_pool.end()) {
+        compressed_state rec = cit->second;
+        lk.unlock();
+        verifs2_state_ptr state = thaw_state(key, rec);
+        lk.lock();
+        it = state_pool.find(key);
+        if (it != state_pool.end()) {
+            /* Thawed by someone else meanwhile */
+            return it->second;
+        }
+        cit = compressed_pool.find(key);
+        if (state == nullptr || cit == compressed_pool.end() || cit->second.data != rec.data) {
+            return nullptr;
+        }
+        compressed_pool.erase(cit);
+        state_pool[key] = state;
+        touch_state(key);
+        lk.unlock();
+        spill_cold_states();
+        return state;
+    }
+    if (spilled_pool.count(key) == 0) {
+        return nullptr;
+    }
+    lk.unlock();
+
+    /* Page the state back in */
+    verifs2_state_ptr state;
+    {
+        std::lock_guard<std::mutex> filelk(spill_file_mutex);
+        lk.lock();
+        auto sit = spilled_pool.find(key);
+        if (sit == spilled_pool.end()) {
+            /* Loaded or removed meanwhile */
+            it = state_pool.find(key);
+            return (it != state_pool.end()) ? it->second : nullptr;
+        }
+        spilled_state rec = sit->second;
+        lk.unlock();
+        state = read_spilled(key, rec);
+        if (state == nullptr) {
+            return nullptr;
+        }
+        lk.lock();
+        spilled_pool.erase(key);
+        state_pool[key] = state;
+        touch_state(key);
+        lk.unlock();
+        free_spilled(rec);
+    }
+    spill_cold_states();
+    return state;
 }
 
 int remove_state(uint64_t key) {
+    verifs2_state_ptr state;
+    std::lock_guard<std::mutex> filelk(spill_file_mutex);
+    std::lock_guard<std::mutex> lk(state_pool_mutex);
+    auto sit = spilled_pool.find(key);
+    if (sit != spilled_pool.end()) {
+        free_spilled(sit->second);
+        spilled_pool.erase(sit);
+        _unlink_state(key);
+        return 0;
+    }
+    if (compressed_pool.erase(key) > 0) {
+        _unlink_state(key);
+        return 0;
+    }
     auto it = state_pool.find(key);
     if (it == state_pool.end()) {
         return -ENOENT;
     }
+    /* The state is released after unlocking, unless still in use */
+    state.swap(it->second);
     state_pool.erase(it);
+    forget_state(key);
+    _unlink_state(key);
     return 0;
 }
 
-std::unordered_map<uint64_t, verifs2_state> get_state_pool() {
+/* Remove the states whose keys match, releasing them all at once after
+ * unlocking */
+static size_t remove_states_if(const std::function<bool(uint64_t)> &match,
+                               std::vector<uint64_t> *removed) {
+    std::vector<verifs2_state_ptr> states;
+    std::vector<uint64_t> keys;
+    std::lock_guard<std::mutex> filelk(spill_file_mutex);
+    std::lock_guard<std::mutex> lk(state_pool_mutex);
+    for (auto it = state_pool.begin(); it != state_pool.end(); ) {
+        if (match(it->first)) {
+            forget_state(it->first);
+            keys.push_back(it->first);
+            states.push_back(std::move(it->second));
+            it = state_pool.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto it = spilled_pool.begin(); it != spilled_pool.end(); ) {
+        if (match(it->first)) {
+            free_spilled(it->second);
+            keys.push_back(it->first);
+            it = spilled_pool.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto it = compressed_pool.begin(); it != compressed_pool.end(); ) {
+        if (match(it->first)) {
+            keys.push_back(it->first);
+            it = compressed_pool.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (uint64_t key : keys) {
+        _unlink_state(key);
+    }
+    if (removed != nullptr) {
+        removed->insert(removed->end(), keys.begin(), keys.end());
+    }
+    return keys.size();
+}
+
+size_t remove_states(uint64_t first, uint64_t last) {
+    return remove_states_if([first, last](uint64_t key) {
+        return key >= first && key <= last;
+    }, nullptr);
+}
+
+size_t remove_unreachable_states(const std::unordered_set<uint64_t> &live,
+                                 std::vector<uint64_t> &removed) {
+    return remove_states_if([&live](uint64_t key) {
+        return live.count(key) == 0;
+    }, &removed);
+}
+
+void link_state(uint64_t key, uint64_t parent) {
+    std::lock_guard<std::mutex> lk(state_pool_mutex);
+    state_parents[key] = parent;
+    if (parent != VERIFS_NO_PARENT) {
+        state_children[parent].insert(key);
+    }
+    /* Unless another state was restored meanwhile */
+    if (current_key == parent) {
+        current_key = key;
+    }
+}
+
+void unlink_state(uint64_t key) {
+    std::lock_guard<std::mutex> lk(state_pool_mutex);
+    _unlink_state(key);
+}
+
+uint64_t current_state() {
+    std::lock_guard<std::mutex> lk(state_pool_mutex);
+    return current_key;
+}
+
+void set_current_state(uint64_t key) {
+    std::lock_guard<std::mutex> lk(state_pool_mutex);
+    current_key = key;
+}
+
+uint64_t state_parent(uint64_t key) {
+    std::lock_guard<std::mutex> lk(state_pool_mutex);
+    auto it = state_parents.find(key);
+    return (it != state_parents.end()) ? it->second : VERIFS_NO_PARENT;
+}
+
+std::unordered_set<uint64_t> reachable_states(const uint64_t *roots, size_t nroots) {
+    std::unordered_set<uint64_t> live;
+    std::lock_guard<std::mutex> lk(state_pool_mutex);
+    for (size_t n = 0; n < nroots; ++n) {
+        /* Stop at the first ancestor already marked */
+        for (uint64_t key = roots[n]; key != VERIFS_NO_PARENT && live.insert(key).second; ) {
+            auto it = state_parents.find(key);
+            key = (it != state_parents.end()) ? it->second : VERIFS_NO_PARENT;
+        }
+    }
+    return live;
+}
+
+void add_fingerprint(const std::string &fingerprint, const verifs2_state_ptr &state) {
+    std::lock_guard<std::mutex> lk(state_pool_mutex);
+    fingerprints[fingerprint] = state;
+    if (fingerprints.size() >= 2 * fingerprints_pruned + 64) {
+        for (auto it = fingerprints.begin(); it != fingerprints.end(); ) {
+            it = it->second.expired() ? fingerprints.erase(it) : std::next(it);
+        }
+        fingerprints_pruned = fingerprints.size();
+    }
+}
+
+verifs2_state_ptr find_fingerprint(const std::string &fingerprint) {
+    std::lock_guard<std::mutex> lk(state_pool_mutex);
+    auto it = fingerprints.find(fingerprint);
+    return (it != fingerprints.end()) ? it->second.lock() : nullptr;
+}
+
+size_t replace_state(const verifs2_state_ptr &old, const verifs2_state_ptr &replacement) {
+    std::vector<verifs2_state_ptr> replaced;
+    size_t nreplaced = 0;
+    std::lock_guard<std::mutex> lk(state_pool_mutex);
+    for (auto &it : fingerprints) {
+        if (it.second.lock() == old) {
+            it.second = replacement;
+        }
+    }
+    for (auto &it : state_pool) {
+        if (it.second == old) {
+            /* Released after unlocking */
+            replaced.push_back(replacement);
+            replaced.back().swap(it.second);
+            nreplaced++;
+        }
+    }
+    return nreplaced;
+}
+
+std::unordered_map<uint64_t, verifs2_state_ptr> get_state_pool() {
+    std::lock_guard<std::mutex> lk(state_pool_mutex);
     return state_pool;
 }
 
+std::unordered_map<uint64_t, verifs2_state_ptr> get_all_states() {
+    std::lock_guard<std::mutex> filelk(spill_file_mutex);
+    std::lock_guard<std::mutex> lk(state_pool_mutex);
+    std::unordered_map<uint64_t, verifs2_state_ptr> states = state_pool;
+    for (auto &it : spilled_pool) {
+        verifs2_state_ptr state = read_spilled(it.first, it.second);
+        if (state != nullptr) {
+            states[it.first] = state;
+        }
+    }
+    for (auto &it : compressed_pool) {
+        verifs2_state_ptr state = thaw_state(it.first, it.second);
+        if (state != nullptr) {
+            states[it.first] = state;
+        }
+    }
+    return states;
+}
+
+std::vector<struct verifs_state_info> get_packed_states() {
+    std::vector<struct verifs_state_info> states;
+    std::lock_guard<std::mutex> lk(state_pool_mutex);
+    for (auto &it : spilled_pool) {
+        states.push_back(it.second.info);
+    }
+    for (auto &it : compressed_pool) {
+        states.push_back(it.second.info);
+    }
+    return states;
+}
+
+bool state_packing_enabled() {
+    std::lock_guard<std::mutex> lk(state_pool_mutex);
+    return state_budget > 0 || compress_idle.count() > 0;
+}
+
+size_t num_states() {
+    std::lock_guard<std::mutex> lk(state_pool_mutex);
+    return state_pool.size() + spilled_pool.size() + compressed_pool.size();
+}
+
+size_t num_spilled_states() {
+    std::lock_guard<std::mutex> lk(state_pool_mutex);
+    return spilled_pool.size();
+}
+
+size_t num_compressed_states(uint64_t &nbytes) {
+    std::lock_guard<std::mutex> lk(state_pool_mutex);
+    nbytes = 0;
+    for (auto &it : compressed_pool) {
+        nbytes += it.second.data->size();
+    }
+    return compressed_pool.size();
+}
+
 void clear_states() {
-    state_pool.clear();
+    std::unordered_map<uint64_t, verifs2_state_ptr> states;
+    {
+        std::lock_guard<std::mutex> spilllk(spill_mutex);
+        std::lock_guard<std::mutex> filelk(spill_file_mutex);
+        std::lock_guard<std::mutex> lk(state_pool_mutex);
+        states.swap(state_pool);
+        state_lru.clear();
+        state_lru_pos.clear();
+        spilled_pool.clear();
+        compressed_pool.clear();
+        compress_skipped.clear();
+        fingerprints.clear();
+        fingerprints_pruned = 0;
+        state_parents.clear();
+        state_children.clear();
+        current_key = VERIFS_NO_PARENT;
+        if (spill_fd >= 0 && ftruncate(spill_fd, 0) == 0) {
+            spill_end = 0;
+        }
+    }
 }
 
 #ifdef DUMP_TESTING
@@ -82,7 +879,9 @@ void clear_states() {
 
 void dump_File(File* file)
 {
-  PRINT_VAL((char*)(file->m_buf));
+  std::string content(file->Size(), '\0');
+  file->CopyOut(&content[0], content.size(), 0);
+  PRINT_VAL(content);
 }
 
 void dump_Directory(Directory* dir)
@@ -208,7 +1007,7 @@ int dump_state_pool()
     std::cout << "\033[1;35mDump the "<< state_cnt <<"-th state\033[0m\n";
     state_cnt++;
     key = each_state.first;
-    value_inode = std::get<0>(each_state.second);
+    value_inode = std::get<0>(materialize_state(each_state.second));
     std::cout << "Key: " << each_state.first << std::endl;
     std::cout << "value_inode.size(): " << value_inode.size() << std::endl;
     for (std::vector<Inode *>::iterator it = value_inode.begin(); it != value_inode.end(); ++it){
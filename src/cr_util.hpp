@@ -30,16 +30,156 @@
 #include "directory.hpp"
 #include "special_inode.hpp"
 #include "symlink.hpp"
+#include "cr.h"
 
+/* The image of a file system: inode table, deleted inodes and statvfs */
 typedef std::tuple<std::vector<Inode *>, std::queue<fuse_ino_t>, struct statvfs> verifs2_state;
 
+struct verifs2_stored_state;
+
+/* Stored states are immutable and may be shared by several keys (e.g. a
+ * checkpoint of an unchanged file system aliases the previous one). The
+ * references on the inodes are dropped when the last holder goes away. */
+typedef std::shared_ptr<const verifs2_stored_state> verifs2_state_ptr;
+
+/* A stored state is either a base holding a whole inode table, or a delta
+ * holding the slots of the table that changed since its parent state.
+ * Successive checkpoints only differ by a few operations, so a delta costs
+ * O(changes) instead of O(inodes). */
+struct verifs2_stored_state {
+    /* nullptr for a base */
+    verifs2_state_ptr parent;
+    /* Number of deltas between this state and its base */
+    unsigned int depth;
+    /* Base: the inode table */
+    std::vector<Inode *> inodes;
+    /* Delta: the new object of each changed slot (nullptr if deleted),
+     * and the size of the table */
+    std::vector<std::pair<fuse_ino_t, Inode *>> changes;
+    size_t table_size;
+    std::queue<fuse_ino_t> deleted_inodes;
+    struct statvfs stbuf;
+};
+
+/* Wrap an image into a base state, taking over one reference on every
+ * inode of it */
+verifs2_state_ptr make_state(verifs2_state &&fs_state);
+
+/* Make a delta state on top of parent, taking over one reference on every
+ * changed object */
+verifs2_state_ptr make_delta(const verifs2_state_ptr &parent,
+                             std::vector<std::pair<fuse_ino_t, Inode *>> &&changes,
+                             size_t table_size, std::queue<fuse_ino_t> &&deleted_inodes,
+                             const struct statvfs &stbuf);
+
+/* Rebuild the image of a stored state by applying the deltas of its chain
+ * to the base. No references are taken on the inodes. */
+verifs2_state materialize_state(const verifs2_state_ptr &state);
+
+/* Replace every key of the pool holding state old by state replacement,
+ * which must have the same image (e.g. a compacted chain).
+ * @return The number of keys replaced */
+size_t replace_state(const verifs2_state_ptr &old, const verifs2_state_ptr &replacement);
+
+/* Undo journal of the latest checkpoint (the undo_journal mount option).
+ *
+ * Instead of storing a snapshot, the checkpoint on top of the stack only
+ * remembers the per-file-system metadata, and every slot of the inode table
+ * that is changed afterwards gets its original object saved here on the
+ * first change. Restoring that checkpoint puts the saved objects back, which
+ * costs O(changes) instead of O(inodes). */
+struct undo_journal {
+    /* The fields change under crMutex held exclusively, except that
+     * operations add to old_inodes under inodesRwSem (JournalSlot()) */
+    bool active;
+    uint64_t key;
+    /* Modification generation at the checkpoint */
+    uint64_t generation;
+    /* Slots from table_size on did not exist at the checkpoint */
+    size_t table_size;
+    std::queue<fuse_ino_t> deleted_inodes;
+    struct statvfs stbuf;
+    /* The original object of each changed slot; holds a reference */
+    std::unordered_map<fuse_ino_t, Inode *> old_inodes;
+};
+
+/* The state pool takes over one reference on every inode of the state */
 int insert_state(uint64_t key, const verifs2_state &fs_states_vec);
 
-verifs2_state find_state(uint64_t key);
+/* Insert a stored state under one more key */
+int insert_state(uint64_t key, const verifs2_state_ptr &state);
 
+/* @return The stored state, or nullptr if the key is not found */
+verifs2_state_ptr find_state(uint64_t key);
+
+/* Remove a state and drop its references on the inodes */
 int remove_state(uint64_t key);
 
-std::unordered_map<uint64_t, verifs2_state> get_state_pool();
+/* Remove the states with first <= key <= last
+ * @return The number of states removed */
+size_t remove_states(uint64_t first, uint64_t last);
+
+/* Remove the states whose keys are not in live
+ * @param[out] removed The keys removed
+ * @return The number of states removed */
+size_t remove_unreachable_states(const std::unordered_set<uint64_t> &live,
+                                 std::vector<uint64_t> &removed);
+
+/* Checkpoint tree (see VERIFS_GC). link_state() records the parent of a
+ * new state, which becomes the current one unless another state became
+ * current meanwhile. Removing a state unlinks it; unlink_state() is for
+ * states kept outside the pool. */
+void link_state(uint64_t key, uint64_t parent);
+void unlink_state(uint64_t key);
+uint64_t current_state();
+void set_current_state(uint64_t key);
+/* @return The parent of a state, or VERIFS_NO_PARENT */
+uint64_t state_parent(uint64_t key);
+/* @return The roots and all their ancestors */
+std::unordered_set<uint64_t> reachable_states(const uint64_t *roots, size_t nroots);
+
+/* Identical states: remember that a stored state has the given content
+ * fingerprint, and look up a state in memory by its fingerprint.
+ * @return The state, or nullptr if none is known */
+void add_fingerprint(const std::string &fingerprint, const verifs2_state_ptr &state);
+verifs2_state_ptr find_fingerprint(const std::string &fingerprint);
+
+/* @return The states kept in memory */
+std::unordered_map<uint64_t, verifs2_state_ptr> get_state_pool();
+
+/* @return All the states, including copies of the spilled ones */
+std::unordered_map<uint64_t, verifs2_state_ptr> get_all_states();
+
+/* @return The keys of the spilled and compressed states, and their counts
+ * from the time they were packed */
+std::vector<struct verifs_state_info> get_packed_states();
+
+/* Add the inode and page counts of a state to a list entry. A delta only
+ * counts its changed objects. */
+void count_state(const std::vector<Inode *> &inodes, struct verifs_state_info *info);
+void count_state(const verifs2_state_ptr &state, struct verifs_state_info *info);
+
+/* Keep the pages of the stored states within budget bytes by spilling the
+ * least recently used states to a temporary file in dir. find_state()
+ * loads them back.
+ *
+ * @return 0 on success, or -errno if the spill file cannot be created.
+ */
+int set_state_budget(size_t budget, const char *dir);
+
+/* Compress the states that have not been used for idle_seconds in the
+ * background. find_state() decompresses them. */
+int set_state_compression(unsigned int idle_seconds);
+void stop_state_compression();
+
+/* @return true if states may be spilled or compressed. These states
+ * must stand alone, so checkpoints are then not stored as deltas. */
+bool state_packing_enabled();
+
+size_t num_states();
+size_t num_spilled_states();
+/* @param[out] nbytes The memory used by the compressed states */
+size_t num_compressed_states(uint64_t &nbytes);
 
 void clear_states();
 
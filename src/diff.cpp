@@ -0,0 +1,214 @@
+/*
+ * This file is part of RefFS.
+ *
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ * Original Copyright (C) Peter Watkins
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include <sys/stat.h>
+
+#include "inode.hpp"
+#include "file.hpp"
+#include "directory.hpp"
+#include "symlink.hpp"
+#include "fuse_cpp_ramfs.hpp"
+
+/* Compare the attributes selected by flags (see VERIFS_HASH_*) */
+static bool same_attrs(const struct stat &x, const struct stat &y, unsigned int flags) {
+    if (x.st_mode != y.st_mode || x.st_nlink != y.st_nlink || x.st_uid != y.st_uid ||
+        x.st_gid != y.st_gid || x.st_size != y.st_size || x.st_rdev != y.st_rdev) {
+        return false;
+    }
+    if (!(flags & VERIFS_HASH_NO_INO) && x.st_ino != y.st_ino) {
+        return false;
+    }
+#ifdef __APPLE__
+    const struct timespec *tx[] = {&x.st_mtimespec, &x.st_ctimespec};
+    const struct timespec *ty[] = {&y.st_mtimespec, &y.st_ctimespec};
+#else
+    const struct timespec *tx[] = {&x.st_mtim, &x.st_ctim};
+    const struct timespec *ty[] = {&y.st_mtim, &y.st_ctim};
+#endif
+    for (int i = 0; !(flags & VERIFS_HASH_NO_TIMES) && i < 2; ++i) {
+        if (tx[i]->tv_sec != ty[i]->tv_sec || tx[i]->tv_nsec != ty[i]->tv_nsec) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool same_xattrs(const std::map<std::string, std::pair<void *, size_t>> &x,
+                        const std::map<std::string, std::pair<void *, size_t>> &y) {
+    if (x.size() != y.size()) {
+        return false;
+    }
+    for (auto ix = x.begin(), iy = y.begin(); ix != x.end(); ++ix, ++iy) {
+        if (ix->first != iy->first || ix->second.second != iy->second.second ||
+            memcmp(ix->second.first, iy->second.first, ix->second.second) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* diff_states: Compare the trees of two states by path.
+ *
+ * Both trees are walked from the root in name order. Entries whose subtree
+ * hashes are equal are skipped without looking into them, and an object
+ * shared by both states is not even hashed.
+ *
+ * @return 0 on success, or -ENOENT if a state does not exist.
+ */
+int FuseRamFs::diff_states(struct verifs_diff *diff) {
+    uint64_t keys[2] = {diff->key_a, diff->key_b};
+    uint32_t flags = diff->flags;
+    uint32_t skip = diff->start;
+    if (flags & ~(VERIFS_HASH_NO_TIMES | VERIFS_HASH_NO_INO)) {
+        return -EINVAL;
+    }
+    diff->count = 0;
+    diff->more = 0;
+
+    /* Stop modifications of the live table and of the hash caches */
+    std::unique_lock<std::shared_mutex> lk(crMutex);
+    std::vector<Inode *> tables[2];
+    verifs2_state_ptr states[2];
+    for (int n = 0; n < 2; ++n) {
+        if (keys[n] == VERIFS_DIFF_LIVE) {
+            tables[n] = Inodes;
+        } else if (state_table(keys[n], tables[n], states[n]) != 0) {
+            return -ENOENT;
+        }
+    }
+    const std::vector<Inode *> &a = tables[0], &b = tables[1];
+    std::unordered_map<fuse_ino_t, std::string> memo_a, memo_b;
+
+    bool stop = false;
+    auto report = [&](uint32_t kind, uint32_t what, const std::string &path,
+                      uint64_t offset, uint64_t length) {
+        if (skip > 0) {
+            skip--;
+            return;
+        }
+        if (diff->count == VERIFS_DIFF_MAX) {
+            diff->more = 1;
+            stop = true;
+            return;
+        }
+        struct verifs_diff_entry *entry = &diff->entries[diff->count++];
+        entry->kind = kind;
+        entry->what = what;
+        entry->offset = offset;
+        entry->length = length;
+        if (path.size() >= sizeof(entry->path)) {
+            entry->what |= VERIFS_DIFF_TRUNCATED;
+        }
+        strncpy(entry->path, path.c_str(), sizeof(entry->path) - 1);
+    };
+
+    std::function<void(fuse_ino_t, fuse_ino_t, const std::string &)> compare;
+    compare = [&](fuse_ino_t ia, fuse_ino_t ib, const std::string &path) {
+        Inode *x = (ia < a.size()) ? a[ia] : nullptr;
+        Inode *y = (ib < b.size()) ? b[ib] : nullptr;
+        if (x == nullptr || y == nullptr) {
+            if (x != y) {
+                report((x == nullptr) ? VERIFS_DIFF_ADDED : VERIFS_DIFF_REMOVED, 0, path, 0, 0);
+            }
+            return;
+        }
+        bool isdir = S_ISDIR(x->GetMode()) && S_ISDIR(y->GetMode());
+        if (x == y && !isdir) {
+            return;
+        }
+        unsigned char hx[VERIFS_HASH_SIZE], hy[VERIFS_HASH_SIZE];
+        hash_subtree(a, ia, flags, hx, &memo_a);
+        hash_subtree(b, ib, flags, hy, &memo_b);
+        if (memcmp(hx, hy, sizeof(hx)) == 0) {
+            return;
+        }
+
+        struct stat sx, sy;
+        x->GetAttr(&sx);
+        y->GetAttr(&sy);
+        if ((sx.st_mode & S_IFMT) != (sy.st_mode & S_IFMT)) {
+            report(VERIFS_DIFF_CHANGED, VERIFS_DIFF_TYPE, path, 0, 0);
+            return;
+        }
+        uint32_t what = 0;
+        uint64_t offset = 0, length = 0;
+        if (!same_attrs(sx, sy, flags)) {
+            what |= VERIFS_DIFF_ATTR;
+        }
+        if (!same_xattrs(x->m_xattr, y->m_xattr)) {
+            what |= VERIFS_DIFF_XATTR;
+        }
+        if (S_ISREG(sx.st_mode)) {
+            if (dynamic_cast<File *>(x)->DiffRange(dynamic_cast<File *>(y), offset, length)) {
+                what |= VERIFS_DIFF_CONTENT;
+            }
+        } else if (S_ISLNK(sx.st_mode)) {
+            const std::string &lx = dynamic_cast<SymLink *>(x)->Link();
+            const std::string &ly = dynamic_cast<SymLink *>(y)->Link();
+            if (lx != ly) {
+                what |= VERIFS_DIFF_CONTENT;
+                length = std::max(lx.size(), ly.size());
+            }
+        }
+        if (what != 0) {
+            report(VERIFS_DIFF_CHANGED, what, path.empty() ? "/" : path, offset, length);
+        }
+        if (!isdir) {
+            return;
+        }
+
+        /* Merge the sorted entries of both directories */
+        std::vector<std::pair<std::string, fuse_ino_t>> cx = dynamic_cast<Directory *>(x)->m_children;
+        std::vector<std::pair<std::string, fuse_ino_t>> cy = dynamic_cast<Directory *>(y)->m_children;
+        std::sort(cx.begin(), cx.end());
+        std::sort(cy.begin(), cy.end());
+        auto ix = cx.begin(), iy = cy.begin();
+        while (!stop && (ix != cx.end() || iy != cy.end())) {
+            int order = (ix == cx.end()) ? 1 : (iy == cy.end()) ? -1 : ix->first.compare(iy->first);
+            const std::string &name = (order <= 0) ? ix->first : iy->first;
+            bool dots = (name == "." || name == "..");
+            if (!dots && order < 0) {
+                report(VERIFS_DIFF_REMOVED, 0, path + "/" + name, 0, 0);
+            } else if (!dots && order > 0) {
+                report(VERIFS_DIFF_ADDED, 0, path + "/" + name, 0, 0);
+            } else if (!dots) {
+                compare(ix->second, iy->second, path + "/" + name);
+            }
+            if (order <= 0) {
+                ++ix;
+            }
+            if (order >= 0) {
+                ++iy;
+            }
+        }
+    };
+
+    try {
+        compare(FUSE_ROOT_ID, FUSE_ROOT_ID, "");
+    } catch (const std::bad_alloc &e) {
+        return -ENOMEM;
+    }
+    return 0;
+}
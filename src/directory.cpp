@@ -30,6 +30,7 @@
 
 using namespace std;
 std::unordered_map<off_t, Directory::ReadDirCtx *> Directory::readdirStates;
+std::mutex Directory::readdirStatesMutex;
 
 
 void Directory::UpdateSize(ssize_t delta) {
@@ -90,6 +91,7 @@ int Directory::_AddChild(const string &name, fuse_ino_t ino) {
 
     // TODO: Should we reserve m_children capacity and return -ENOMEM if it grows out of space?
     m_children.push_back(std::make_pair(name, ino));
+    MarkDirty();
 
     UpdateSize(elem_size);
     return 0;
@@ -115,6 +117,7 @@ int Directory::_UpdateChild(const string &name, fuse_ino_t ino) {
     }
 
     child->second = ino;
+    MarkDirty();
     
 #ifdef __APPLE__
         clock_gettime(CLOCK_REALTIME, &(m_fuseEntryParam.attr.st_ctimespec));
@@ -147,6 +150,7 @@ int Directory::_RemoveChild(const string &name) {
         return -ENOENT;
 
     m_children.erase(child);
+    MarkDirty();
 
     size_t elem_size = sizeof(_Rb_tree_node_base) + sizeof(fuse_ino_t) + sizeof(std::string) + name.size();
     UpdateSize(-elem_size);
@@ -311,6 +315,7 @@ size_t Directory::Load(const void* &buf) {
         // add children to this Directory object
         m_children.push_back(std::make_pair(name, ino));
     }
+    MarkDirty();
     return ptr - (char *)buf;
 }
 std::vector<std::pair<std::string, fuse_ino_t>>::iterator Directory::find(const string& name) {
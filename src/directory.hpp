@@ -47,6 +47,7 @@ public:
     };
 
     static std::unordered_map<off_t, Directory::ReadDirCtx *> readdirStates;
+    static std::mutex readdirStatesMutex;
     ReadDirCtx* PrepareReaddir(off_t cookie);
     void RecycleStates();
     friend class FuseRamFs;
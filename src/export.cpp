@@ -0,0 +1,171 @@
+/*
+ * This file is part of RefFS.
+ *
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ * Original Copyright (C) Peter Watkins
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+#include <sys/stat.h>
+
+#include "inode.hpp"
+#include "directory.hpp"
+#include "symlink.hpp"
+#include "fuse_cpp_ramfs.hpp"
+
+/* The images being read, by cookie, until their last chunk is; starting
+ * another export drops the oldest beyond VERIFS_EXPORT_IMAGES */
+struct export_image {
+    std::string records;
+    uint64_t count;
+};
+static std::mutex export_mutex;
+static std::map<uint64_t, export_image> export_images;
+static uint64_t last_export_cookie = 0;
+
+/* export_tree: Read a chunk of the image of the tree of a state (see
+ * VERIFS_EXPORT), building the image at offset 0.
+ *
+ * The records are built in memory while modifications are stopped, and
+ * read from there by the later calls.
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int FuseRamFs::export_tree(struct verifs_export *exp) {
+    uint32_t flags = exp->flags;
+    uint32_t hash_flags = flags & (VERIFS_HASH_NO_TIMES | VERIFS_HASH_NO_INO);
+    if (exp->offset > 0) {
+        return read_export(exp);
+    }
+    if (flags & ~(VERIFS_EXPORT_HASHES | VERIFS_HASH_NO_TIMES | VERIFS_HASH_NO_INO)) {
+        return -EINVAL;
+    }
+
+    struct verifs_export_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, VERIFS_EXPORT_MAGIC, sizeof(header.magic));
+    header.version = VERIFS_EXPORT_VERSION;
+    header.flags = flags;
+    header.key = exp->key;
+    std::string records;
+
+    /* Stop modifications of the live table and of the hash caches */
+    std::unique_lock<std::shared_mutex> lk(crMutex);
+    std::vector<Inode *> table;
+    verifs2_state_ptr state;
+    if (exp->key == VERIFS_EXPORT_LIVE) {
+        table = Inodes;
+    } else if (state_table(exp->key, table, state) != 0) {
+        return -ENOENT;
+    }
+    std::unordered_map<fuse_ino_t, std::string> memo;
+
+    std::function<void(fuse_ino_t, const std::string &)> walk;
+    walk = [&](fuse_ino_t ino, const std::string &path) {
+        Inode *inode = (ino < table.size()) ? table[ino] : nullptr;
+        if (inode == nullptr) {
+            return;
+        }
+        struct verifs_export_entry entry;
+        memset(&entry, 0, sizeof(entry));
+        inode->GetAttr(&entry.attr);
+        std::string link, names;
+        if (S_ISLNK(entry.attr.st_mode)) {
+            link = dynamic_cast<SymLink *>(inode)->Link();
+        }
+        for (auto &it : inode->m_xattr) {
+            names.append(it.first.c_str(), it.first.size() + 1);
+            entry.num_xattrs++;
+        }
+        if (flags & VERIFS_EXPORT_HASHES) {
+            hash_subtree(table, ino, hash_flags, entry.hash, &memo);
+        }
+        entry.path_len = path.size();
+        entry.link_len = link.size();
+        entry.xattr_len = names.size();
+        records.append((const char *) &entry, sizeof(entry));
+        records += path;
+        records += link;
+        records += names;
+        header.count++;
+
+        if (!S_ISDIR(entry.attr.st_mode)) {
+            return;
+        }
+        std::vector<std::pair<std::string, fuse_ino_t>> children =
+            dynamic_cast<Directory *>(inode)->m_children;
+        std::sort(children.begin(), children.end());
+        for (auto &child : children) {
+            if (child.first != "." && child.first != "..") {
+                walk(child.second, ((path == "/") ? path : path + "/") + child.first);
+            }
+        }
+    };
+
+    try {
+        records.append((const char *) &header, sizeof(header));
+        walk(FUSE_ROOT_ID, "/");
+    } catch (const std::bad_alloc &e) {
+        return -ENOMEM;
+    }
+    lk.unlock();
+    /* The header goes first, but the count is only known now */
+    memcpy(&records[0], &header, sizeof(header));
+
+    export_image dropped;
+    {
+        std::lock_guard<std::mutex> explk(export_mutex);
+        if (export_images.size() >= VERIFS_EXPORT_IMAGES) {
+            auto oldest = export_images.begin();
+            dropped = std::move(oldest->second);
+            export_images.erase(oldest);
+        }
+        exp->cookie = ++last_export_cookie;
+        export_image &image = export_images[exp->cookie];
+        image.records.swap(records);
+        image.count = header.count;
+    }
+    /* The dropped image, if any, is freed outside the lock */
+    return read_export(exp);
+}
+
+/* read_export: Read the chunk at exp->offset of the image of exp->cookie */
+int FuseRamFs::read_export(struct verifs_export *exp) {
+    export_image done;
+    std::lock_guard<std::mutex> lk(export_mutex);
+    auto it = export_images.find(exp->cookie);
+    if (it == export_images.end()) {
+        return -ESTALE;
+    }
+    const std::string &records = it->second.records;
+    if (exp->offset > records.size()) {
+        return -EINVAL;
+    }
+    exp->length = std::min<uint64_t>(VERIFS_EXPORT_CHUNK, records.size() - exp->offset);
+    memcpy(exp->data, records.data() + exp->offset, exp->length);
+    exp->count = it->second.count;
+    exp->bytes = records.size();
+    if (exp->offset + exp->length == records.size()) {
+        done = std::move(it->second);
+        export_images.erase(it);
+    }
+    return 0;
+}
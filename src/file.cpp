@@ -23,42 +23,172 @@
  */
 
 #include "common.h"
+#include <sys/uio.h>
 
 #include "inode.hpp"
 #include "fuse_cpp_ramfs.hpp"
 #include "file.hpp"
 
 File::~File() {
-    free(m_buf);
+    DropPages(0);
+}
+
+/**
+ Returns a page of the file that the caller is allowed to modify.
+
+ Pages may be shared with checkpointed copies of this file or through the
+ PageStore, so a shared page is replaced by a private copy first, and a hole
+ gets a fresh zeroed page.
+
+ @param index The page index, which must be within the file.
+ @return The private page, or nullptr if out of memory.
+ */
+Page *File::GetPageForWrite(size_t index) {
+    Page *page = m_pages[index];
+    if (page != nullptr && !page->IsShared() &&
+        (!page->IsInterned() || PageStore::Detach(page))) {
+        return page;
+    }
+    Page *copy = (page == nullptr) ? Page::Alloc() : page->Clone();
+    if (copy == nullptr) {
+        return nullptr;
+    }
+    m_pages[index] = copy;
+    Page::PutRef(page);
+    return copy;
+}
+
+/* Release the pages from index npages on */
+void File::DropPages(size_t npages) {
+    for (size_t i = npages; i < m_pages.size(); ++i) {
+        Page::PutRef(m_pages[i]);
+    }
+    if (npages < m_pages.size()) {
+        m_pages.resize(npages);
+    }
+}
+
+void File::InternPages() {
+    for (auto &page : m_pages) {
+        page = PageStore::Intern(page);
+    }
+}
+
+void File::CountPages(size_t &npages, size_t &nprivate) {
+    npages = 0;
+    nprivate = 0;
+    for (auto &page : m_pages) {
+        if (page != nullptr) {
+            npages++;
+            if (!page->IsShared()) {
+                nprivate++;
+            }
+        }
+    }
+}
+
+size_t File::CopyOut(void *buf, size_t size, off_t off) {
+    size_t fsize = m_fuseEntryParam.attr.st_size;
+    if ((size_t)off >= fsize) {
+        return 0;
+    }
+    size = std::min(size, fsize - off);
+    size_t done = 0;
+    while (done < size) {
+        size_t pos = off + done;
+        size_t pgoff = pos % Page::Size;
+        size_t len = std::min(size - done, Page::Size - pgoff);
+        Page *page = m_pages[pos / Page::Size];
+        const char *src = (page != nullptr) ? page->Data() : Page::ZeroData();
+        memcpy((char *)buf + done, src + pgoff, len);
+        done += len;
+    }
+    return size;
+}
+
+/* Holes hash like the zeros they read as */
+void File::HashContent(const DigestSink &feed) {
+    size_t fsize = m_fuseEntryParam.attr.st_size;
+    for (size_t i = 0; i < m_pages.size() && i * Page::Size < fsize; ++i) {
+        Page *page = m_pages[i];
+        feed((page != nullptr) ? page->Data() : Page::ZeroData(),
+             std::min(fsize - i * Page::Size, Page::Size));
+    }
+}
+
+bool File::DiffRange(File *other, uint64_t &offset, uint64_t &length) {
+    size_t xsize = Size(), ysize = other->Size();
+    size_t common = std::min(xsize, ysize);
+    size_t npages = get_nblocks(common, Page::Size);
+    /* Bytes within the common size; pages shared by both files are equal */
+    auto differs = [&](size_t i, size_t &first, size_t &last) {
+        Page *px = m_pages[i], *py = other->m_pages[i];
+        const char *dx = (px != nullptr) ? px->Data() : Page::ZeroData();
+        const char *dy = (py != nullptr) ? py->Data() : Page::ZeroData();
+        size_t len = std::min(common - i * Page::Size, Page::Size);
+        if (dx == dy || memcmp(dx, dy, len) == 0) {
+            return false;
+        }
+        for (first = 0; dx[first] == dy[first]; ++first);
+        for (last = len - 1; dx[last] == dy[last]; --last);
+        return true;
+    };
+    size_t first, last, begin = SIZE_MAX, end = 0;
+    for (size_t i = 0; i < npages; ++i) {
+        if (differs(i, first, last)) {
+            begin = i * Page::Size + first;
+            end = i * Page::Size + last + 1;
+            break;
+        }
+    }
+    for (size_t i = npages; begin != SIZE_MAX && i-- > 0; ) {
+        if (differs(i, first, last)) {
+            end = i * Page::Size + last + 1;
+            break;
+        }
+    }
+    if (xsize != ysize) {
+        begin = std::min(begin, common);
+        end = std::max(xsize, ysize);
+    }
+    if (begin == SIZE_MAX) {
+        return false;
+    }
+    offset = begin;
+    length = end - begin;
+    return true;
 }
 
 int File::FileTruncate(size_t newSize) {
     size_t newBlocks = get_nblocks(newSize, File::BufBlockSize);
     size_t oldBlocks = Inode::UsedBlocks();
     size_t oldSize = Inode::Size();
+    size_t newPages = get_nblocks(newSize, Page::Size);
 
     if (!FuseRamFs::CheckHasSpaceFor(this, newSize - oldSize)) {
         return -ENOSPC;
     }
 
-    /* Realloc if needed */
-    if (newBlocks != oldBlocks) {
-        void *newbuf = realloc(m_buf, newBlocks * File::BufBlockSize);
-        if (newbuf == nullptr && newBlocks > 0) {
-            /* Probably because newsize exceeds limit;
-             * return EINVAL in this case */
-            return EINVAL;
+    if (newSize < oldSize) {
+        /* If the file is shrunk, zero out the tail of the new last page */
+        size_t tail = newSize % Page::Size;
+        if (tail != 0 && m_pages[newPages - 1] != nullptr) {
+            Page *page = GetPageForWrite(newPages - 1);
+            if (page == nullptr) {
+                return -ENOMEM;
+            }
+            memset(page->Data() + tail, 0, Page::Size - tail);
         }
-        if (newBlocks == 0) {
-            newbuf = nullptr;
+        DropPages(newPages);
+    } else if (newSize > oldSize) {
+        /* The expanded range is a hole */
+        try {
+            m_pages.resize(newPages, nullptr);
+        } catch (std::bad_alloc &e) {
+            return -ENOMEM;
         }
-        m_buf = newbuf;
-    }
-
-    /* If the file is expanded, zero out outstanding bytes */
-    if (newSize > oldSize) {
-        memset((char *)m_buf + oldSize, 0, newSize - oldSize);
     }
+    MarkDirty();
 
     /* Update size / block usage */
     FuseRamFs::UpdateUsedBlocks(newBlocks - oldBlocks);
@@ -78,39 +208,62 @@ int File::FileTruncate(size_t newSize) {
 }
 
 int File::WriteAndReply(fuse_req_t req, const char *buf, size_t size, off_t off) {
-    // Allocate more memory if we don't have space.
+    ssize_t ret = Write(buf, size, off);
+    if (ret < 0) {
+        return fuse_reply_err(req, -ret);
+    }
+    return fuse_reply_write(req, ret);
+}
+
+ssize_t File::Write(const char *buf, size_t size, off_t off) {
     size_t newSize = off + size;
     size_t oldSize = Size();
     size_t originalCapacity = Inode::BufBlockSize * File::UsedBlocks();
-    size_t newBlocks = newSize/Inode::BufBlockSize + (newSize % Inode::BufBlockSize != 0);
 
-    /* Request for more memory if write() expands the file */
+    /* Check for space if write() expands the file */
     if (newSize > originalCapacity) {
         if (!FuseRamFs::CheckHasSpaceFor(this, newSize - File::Size())) {
-            return fuse_reply_err(req, ENOSPC);
+            return -ENOSPC;
         }
-        void *newBuf = realloc(m_buf, newBlocks * Inode::BufBlockSize);
-        // If we ran out of memory, let the caller know that no bytes were
-        // written.
-        if (newBuf == NULL) {
-            return fuse_reply_write(req, 0);;
+    }
+
+    /* If write() expands the file, the "hole" it may create (i.e. the range
+     * of [oldsize, offset)) is already zero: the new pages are holes, and
+     * the bytes past the old end of file in the last page are zero. */
+    if (newSize > oldSize) {
+        try {
+            m_pages.resize(get_nblocks(newSize, Page::Size), nullptr);
+        } catch (std::bad_alloc &e) {
+            return -ENOMEM;
         }
-        
-        // Update our buffer size
-        m_buf = newBuf;
     }
 
-    /* If write() operation expands the file, we must zero out the "hole"
-     * that the write may create (i.e. the range of [oldsize, offset)).
-     * Otherwise, the "hole" may contain garbage data */
-    if ((size_t)off > oldSize)
-        memset((char *)m_buf + oldSize, 0, off - oldSize);
-    
-    // Write to the buffer. TODO: Check if SRC and DST overlap.
-    // We assume that there can be no buffer overflow since realloc has already
-    // been called with the new size and offset. If realloc failed, we wouldn't
-    // be here.
-    memmove((char *) m_buf + off, buf, size);
+    // Write to the pages, cloning the shared ones.
+    size_t done = 0;
+    while (done < size) {
+        size_t pos = off + done;
+        size_t pgoff = pos % Page::Size;
+        size_t len = std::min(size - done, Page::Size - pgoff);
+        Page *page = GetPageForWrite(pos / Page::Size);
+        // If we ran out of memory, only report the bytes written so far,
+        // or fail if there are none.
+        if (page == nullptr) {
+            break;
+        }
+        memmove(page->Data() + pgoff, buf + done, len);
+        done += len;
+    }
+    if (done == 0 && size > 0) {
+        DropPages(get_nblocks(oldSize, Page::Size));
+        return -ENOMEM;
+    }
+    if (done < size) {
+        size = done;
+        newSize = off + size;
+        DropPages(get_nblocks(std::max(newSize, oldSize), Page::Size));
+    }
+    MarkDirty();
+    size_t newBlocks = get_nblocks(newSize, Inode::BufBlockSize);
 
     /* Update size and block usage info */
     if (newSize > originalCapacity) {
@@ -132,13 +285,13 @@ int File::WriteAndReply(fuse_req_t req, const char *buf, size_t size, off_t off)
     m_fuseEntryParam.attr.st_mtim = m_fuseEntryParam.attr.st_ctim;
 #endif
     
-    return fuse_reply_write(req, size);
+    return size;
 }
 
 int File::ReadAndReply(fuse_req_t req, size_t size, off_t off) {    
     // Don't start the read past our file size
     if (off > m_fuseEntryParam.attr.st_size) {
-        return fuse_reply_buf(req, (const char *) m_buf, 0);
+        return fuse_reply_buf(req, nullptr, 0);
     }
     
     // Update access time. TODO: This could get very intensive. Some
@@ -151,11 +304,39 @@ int File::ReadAndReply(fuse_req_t req, size_t size, off_t off) {
     clock_gettime(CLOCK_REALTIME, &(m_fuseEntryParam.attr.st_atim));
 #endif
     
+    return _ReplyData(req, size, off);
+}
+
+int File::ReplyData(fuse_req_t req, size_t size, off_t off) {
+    std::shared_lock<std::shared_mutex> lk(entryRwSem);
+    if (off > m_fuseEntryParam.attr.st_size) {
+        return fuse_reply_buf(req, nullptr, 0);
+    }
+    return _ReplyData(req, size, off);
+}
+
+int File::_ReplyData(fuse_req_t req, size_t size, off_t off) {
     // Handle reading past the file size as well as inside the size.
     size_t bytesRead = off + size > m_fuseEntryParam.attr.st_size ? m_fuseEntryParam.attr.st_size - off : size;
+    if (bytesRead == 0) {
+        return fuse_reply_buf(req, nullptr, 0);
+    }
+
+    /* Reply straight from the pages; holes are served from the zero page */
+    std::vector<struct iovec> iov;
+    size_t done = 0;
+    while (done < bytesRead) {
+        size_t pos = off + done;
+        size_t pgoff = pos % Page::Size;
+        size_t len = std::min(bytesRead - done, Page::Size - pgoff);
+        Page *page = m_pages[pos / Page::Size];
+        const char *src = (page != nullptr) ? page->Data() : Page::ZeroData();
+        iov.push_back({(void *)(src + pgoff), len});
+        done += len;
+    }
     
     // TODO: There are all sorts of other replies. What about them?
-    return fuse_reply_buf(req, (const char *) m_buf + off, bytesRead);
+    return fuse_reply_iov(req, iov.data(), iov.size());
 }
 
 size_t File::GetPickledSize() {
@@ -172,22 +353,27 @@ size_t File::Pickle(void* &buf) {
     size_t offset = Inode::Pickle(buf);
     char *ptr = (char *)buf + offset;
     size_t fsize = m_fuseEntryParam.attr.st_size;
-    memcpy(ptr, m_buf, fsize);
+    CopyOut(ptr, fsize, 0);
     return offset + fsize;
 }
 
 size_t File::Load(const void* &buf) {
     size_t offset = Inode::Load(buf);
     size_t fsize = m_fuseEntryParam.attr.st_size;
-    size_t nblocks = m_fuseEntryParam.attr.st_blocks;
-    size_t fcap = m_fuseEntryParam.attr.st_blksize * nblocks;
-    
-    m_buf = calloc(fcap, 1);
-    if (m_buf == nullptr) {
-        ClearXAttrs();
-        return 0;
+    const char *ptr = (const char *)buf + offset;
+
+    m_pages.assign(get_nblocks(fsize, Page::Size), nullptr);
+    for (size_t i = 0; i < m_pages.size(); ++i) {
+        size_t len = std::min(fsize - i * Page::Size, Page::Size);
+        Page *page = Page::Alloc();
+        if (page == nullptr) {
+            DropPages(0);
+            ClearXAttrs();
+            return 0;
+        }
+        memcpy(page->Data(), ptr + i * Page::Size, len);
+        /* Loaded states share the pages with identical content */
+        m_pages[i] = PageStore::Intern(page);
     }
-    char *ptr = (char *)buf + offset;
-    memcpy(m_buf, ptr, fsize);
     return offset + fsize;
 }
@@ -25,29 +25,58 @@
 #ifndef file_hpp
 #define file_hpp
 
+#include "page.hpp"
+
 class File : public Inode {
 private:
-    void *m_buf;
+    /* File contents, one entry per Page::Size bytes of st_size. A nullptr
+     * entry is a hole that reads as zeros. The bytes past the end of file
+     * in the last page are always zero, so extending the file never needs
+     * to clear them. */
+    std::vector<Page *> m_pages;
+
+    Page *GetPageForWrite(size_t index);
+    void DropPages(size_t npages);
+    /* Reply with the data at off; caller must hold entryRwSem */
+    int _ReplyData(fuse_req_t req, size_t size, off_t off);
     
 public:
-    File() :
-    m_buf(NULL) {}
-
-    File(const File &f) : Inode(f){
-        size_t bufsize = f.m_fuseEntryParam.attr.st_blocks * f.BufBlockSize; 
-        m_buf = malloc(bufsize);
-        if (!m_buf){
-            std::cerr << "malloc failed for File copy constructor\n";
-            exit(EXIT_FAILURE);
+    File() {}
+
+    /* Pages are shared with the source; see GetPageForWrite() */
+    File(const File &f) : Inode(f), m_pages(f.m_pages) {
+        for (auto &page : m_pages) {
+            if (page != nullptr) {
+                page->GetRef();
+            }
         }
-        memcpy(m_buf, f.m_buf, bufsize);
     };
     
     ~File();
     
     int WriteAndReply(fuse_req_t req, const char *buf, size_t size, off_t off);
+    /* Like WriteAndReply(), but returns the number of bytes written, which
+     * is short if memory ran out while writing pages, or -ENOSPC or
+     * -ENOMEM if nothing could be written */
+    ssize_t Write(const char *buf, size_t size, off_t off);
     int ReadAndReply(fuse_req_t req, size_t size, off_t off);
+    /* Like ReadAndReply(), but leaves the access time alone, so that it
+     * can serve the immutable objects of stored states */
+    int ReplyData(fuse_req_t req, size_t size, off_t off);
+    /* Returns 0 or -errno */
     int FileTruncate(size_t newSize);
+    /* Replace the pages by their deduplicated copies in the PageStore */
+    void InternPages();
+    /* Copy up to size bytes of the content at off into buf; returns the
+     * number of bytes copied */
+    size_t CopyOut(void *buf, size_t size, off_t off);
+    /* Count the pages holding data, and those not shared with any other
+     * file or state */
+    void CountPages(size_t &npages, size_t &nprivate);
+    void HashContent(const DigestSink &feed);
+    /* Find the range of bytes in which the contents of two files differ.
+     * @return false if they are equal */
+    bool DiffRange(File *other, uint64_t &offset, uint64_t &length);
 
     size_t GetPickledSize();
     size_t Pickle(void* &buf);
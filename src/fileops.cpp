@@ -0,0 +1,395 @@
+/*
+ * This file is part of RefFS.
+ *
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ * Original Copyright (C) Peter Watkins
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+#include <sys/stat.h>
+
+#include "inode.hpp"
+#include "file.hpp"
+#include "directory.hpp"
+#include "fuse_cpp_ramfs.hpp"
+
+/* Scripted file operations (see VERIFS_FILEOPS).
+ *
+ * A model checker issues most of its operations as short fixed sequences,
+ * and going through the kernel costs a lookup and a request for each step.
+ * Here the whole sequence is run against the objects directly, with the
+ * same helpers as the FUSE handlers, and the kernel caches of whatever it
+ * touched are invalidated once it is done.
+ */
+
+/* The NUL-terminated string at offset off of the data, or nullptr */
+static const char *fileops_string(const struct verifs_fileops *ops, uint32_t off) {
+    if (off >= VERIFS_FILEOPS_DATA ||
+        memchr(ops->data + off, '\0', VERIFS_FILEOPS_DATA - off) == nullptr) {
+        return nullptr;
+    }
+    return ops->data + off;
+}
+
+/* The kernel makes the permission checks of the FUSE handlers itself
+ * (default_permissions), but it cannot for a script, so the ones of
+ * path_resolution(7) and the directory operations are made here, for the
+ * caller of the ioctl. Root passes them all.
+ *
+ * @return: 0 if access is allowed, or a negative error code.
+ */
+static int may_access(const struct fuse_ctx *ctx, Inode *inode, int mask) {
+    if (ctx->uid == 0) {
+        return 0;
+    }
+    return -inode->CheckAccess(mask, ctx->gid, ctx->uid);
+}
+
+/* Whether the caller may remove or replace the entry name of dir: in a
+ * sticky directory, only the owners of the directory and of the entry may */
+static int may_delete(const struct fuse_ctx *ctx, Directory *dir, const std::string &name) {
+    int ret = may_access(ctx, dir, W_OK | X_OK);
+    if (ret != 0 || ctx->uid == 0 || !(dir->GetMode() & S_ISVTX)) {
+        return ret;
+    }
+    fuse_ino_t ino = dir->ChildInodeNumberWithName(name);
+    if (ino == INO_NOTFOUND || ctx->uid == dir->GetUid() ||
+        ctx->uid == FuseRamFs::GetInode(ino)->GetUid()) {
+        return 0;
+    }
+    return -EPERM;
+}
+
+/* resolve_path: Look up a path from a directory. Caller must hold crMutex.
+ *
+ * @param[in] ctx:   The caller, who needs search permission on the way
+ * @param[in] dir:   Directory relative paths start from
+ * @param[in] path:  The path; "." and empty components are skipped
+ * @param[out] leaf: If given, the last component is stored here and its
+ *                   directory is looked up instead
+ *
+ * @return: The inode number, or a negative error code.
+ */
+long FuseRamFs::resolve_path(const struct fuse_ctx *ctx, fuse_ino_t dir, const char *path,
+                             std::string *leaf) {
+    std::vector<std::string> names;
+    const char *p = path;
+    while (*p != '\0') {
+        const char *end = strchr(p, '/');
+        size_t len = (end != nullptr) ? end - p : strlen(p);
+        if (len > 0 && !(len == 1 && *p == '.')) {
+            names.emplace_back(p, len);
+        }
+        p += len + (end != nullptr);
+    }
+    if (leaf != nullptr) {
+        if (names.empty() || names.back() == "..") {
+            return -EINVAL;
+        }
+        *leaf = names.back();
+        names.pop_back();
+    }
+
+    fuse_ino_t ino = (*path == '/') ? FUSE_ROOT_ID : dir;
+    for (size_t n = 0; ; ++n) {
+        Inode *inode = GetInode(ino);
+        if (inode == nullptr || inode->HasNoLinks()) {
+            return -ENOENT;
+        }
+        if (n == names.size()) {
+            break;
+        }
+        auto *dir_p = dynamic_cast<Directory *>(inode);
+        if (dir_p == nullptr) {
+            return -ENOTDIR;
+        }
+        int ret = may_access(ctx, dir_p, X_OK);
+        if (ret != 0) {
+            return ret;
+        }
+        ino = dir_p->ChildInodeNumberWithName(names[n]);
+        if (ino == INO_NOTFOUND) {
+            return -ENOENT;
+        }
+    }
+    if (leaf != nullptr && !S_ISDIR(GetInode(ino)->GetMode())) {
+        return -ENOTDIR;
+    }
+    return ino;
+}
+
+/* Free an object removed by a script right away if the kernel has never
+ * looked it up; otherwise FuseForget() will. Caller must hold crMutex
+ * exclusively, so that no lookup can race with this. */
+void FuseRamFs::reclaim_inode(fuse_ino_t ino) {
+    Inode *inode = GetInode(ino);
+    if (inode == nullptr || !inode->HasNoLinks() || !inode->Forgotten()) {
+        return;
+    }
+    size_t blocks_freed = inode->UsedBlocks();
+    DeleteInode(ino);
+    FuseRamFs::UpdateUsedInodes(-1);
+    FuseRamFs::UpdateUsedBlocks(-blocks_freed);
+}
+
+/* Whether the directory ino is dir or below it */
+static bool is_below(fuse_ino_t ino, fuse_ino_t dir, size_t max_depth) {
+    for (size_t depth = 0; depth < max_depth; ++depth) {
+        if (ino == dir) {
+            return true;
+        }
+        auto *dir_p = dynamic_cast<Directory *>(FuseRamFs::GetInode(ino));
+        if (ino == FUSE_ROOT_ID || dir_p == nullptr) {
+            break;
+        }
+        ino = dir_p->ChildInodeNumberWithName("..");
+    }
+    return false;
+}
+
+/* do_fileop: Run one operation of a script. Caller must hold crMutex
+ * exclusively.
+ *
+ * @param[out] entries: The directory entries the kernel has to forget
+ * @param[out] inodes:  The inodes whose kernel caches have to be dropped
+ *
+ * @return: 0 on success, or a negative error code.
+ */
+int FuseRamFs::do_fileop(const struct fuse_ctx *ctx, fuse_ino_t dir,
+                         const struct verifs_fileops *ops, const struct verifs_fileop *op,
+                         std::vector<std::pair<fuse_ino_t, std::string>> &entries,
+                         std::vector<fuse_ino_t> &inodes) {
+    const char *path = fileops_string(ops, op->path);
+    if (path == nullptr ||
+        op->value > VERIFS_FILEOPS_DATA || op->value_size > VERIFS_FILEOPS_DATA - op->value) {
+        return -EINVAL;
+    }
+    const char *value = ops->data + op->value;
+
+    /* Operations on a file */
+    if (op->op == VERIFS_FILEOP_WRITE || op->op == VERIFS_FILEOP_TRUNCATE ||
+        op->op == VERIFS_FILEOP_SETXATTR) {
+        long ino = resolve_path(ctx, dir, path, nullptr);
+        if (ino < 0) {
+            return ino;
+        }
+        int ret = may_access(ctx, GetInode(ino), W_OK);
+        if (ret != 0) {
+            return ret;
+        }
+        Inode *inode = GetInodeForWrite(ino);
+        auto *file = dynamic_cast<File *>(inode);
+        uint64_t length = (op->op == VERIFS_FILEOP_WRITE) ? op->length : 0;
+        if (op->op == VERIFS_FILEOP_SETXATTR) {
+            const char *name = fileops_string(ops, op->name);
+            if (name == nullptr) {
+                return -EINVAL;
+            }
+            /* The trusted namespace needs CAP_SYS_ADMIN */
+            if (ctx->uid != 0 && strncmp(name, "trusted.", 8) == 0) {
+                return -EPERM;
+            }
+            return inode->SetXAttr(std::string(name), value, op->value_size, op->mode, 0);
+        } else if (file == nullptr) {
+            return S_ISDIR(inode->GetMode()) ? -EISDIR : -EINVAL;
+        } else if (length > (uint64_t) INT64_MAX || op->offset > (uint64_t) INT64_MAX - length) {
+            return -EFBIG;
+        } else if (op->op == VERIFS_FILEOP_TRUNCATE) {
+            ret = file->FileTruncate(op->offset);
+        } else {
+            /* Repeat the pattern over a chunk of whole copies, so that every
+             * chunk starts with it; an empty pattern writes zeros */
+            size_t target = std::min<uint64_t>(length, 65536);
+            std::string chunk;
+            if (op->value_size == 0) {
+                chunk.assign(target, '\0');
+            }
+            while (chunk.size() < target) {
+                chunk.append(value, op->value_size);
+            }
+            for (uint64_t done = 0; done < length && ret == 0; ) {
+                size_t len = std::min<uint64_t>(chunk.size(), length - done);
+                ssize_t written = file->Write(chunk.data(), len, op->offset + done);
+                if (written < 0) {
+                    ret = written;
+                } else if ((size_t) written < len) {
+                    /* Short writes mean that memory ran out */
+                    ret = -ENOMEM;
+                }
+                done += std::max<ssize_t>(written, 0);
+            }
+        }
+        inodes.push_back(ino);
+        return ret;
+    }
+
+    /* Operations on a directory entry */
+    std::string leaf;
+    long parent = resolve_path(ctx, dir, path, &leaf);
+    if (parent < 0) {
+        return parent;
+    }
+    long ret = may_access(ctx, GetInode(parent), W_OK | X_OK);
+    if (ret != 0) {
+        return ret;
+    }
+    auto *parentDir = dynamic_cast<Directory *>(GetInodeForWrite(parent));
+    switch (op->op) {
+        case VERIFS_FILEOP_CREATE:
+        case VERIFS_FILEOP_MKDIR:
+            if (parentDir->ChildInodeNumberWithName(leaf) != INO_NOTFOUND) {
+                return -EEXIST;
+            }
+            if (GetFreeInodes() <= 0) {
+                return -ENOSPC;
+            }
+            ret = do_create_node(parentDir, leaf.c_str(),
+                                 (op->mode & 07777) | ((op->op == VERIFS_FILEOP_MKDIR) ? S_IFDIR : S_IFREG),
+                                 0, ctx);
+            break;
+
+        case VERIFS_FILEOP_UNLINK:
+        case VERIFS_FILEOP_RMDIR:
+            ret = may_delete(ctx, parentDir, leaf);
+            if (ret != 0) {
+                return ret;
+            }
+            ret = (op->op == VERIFS_FILEOP_UNLINK) ? do_unlink(parentDir, leaf.c_str())
+                                                   : do_rmdir(parentDir, leaf.c_str());
+            if (ret > 0) {
+                inodes.push_back(ret);
+                reclaim_inode(ret);
+            }
+            break;
+
+        case VERIFS_FILEOP_RENAME: {
+            const char *newpath = fileops_string(ops, op->name);
+            if (newpath == nullptr) {
+                return -EINVAL;
+            }
+            std::string newleaf;
+            long newparent = resolve_path(ctx, dir, newpath, &newleaf);
+            if (newparent < 0) {
+                return newparent;
+            }
+            ret = may_access(ctx, GetInode(newparent), W_OK | X_OK);
+            if (ret != 0) {
+                return ret;
+            }
+            auto *newParentDir = dynamic_cast<Directory *>(GetInodeForWrite(newparent));
+            fuse_ino_t src = parentDir->ChildInodeNumberWithName(leaf);
+            fuse_ino_t old = newParentDir->ChildInodeNumberWithName(newleaf);
+            if (src == INO_NOTFOUND) {
+                return -ENOENT;
+            }
+            /* The kernel checks these for rename(2) */
+            if (src == old) {
+                return 0;
+            }
+            if (is_below(newparent, src, Inodes.size())) {
+                return -EINVAL;
+            }
+            ret = may_delete(ctx, parentDir, leaf);
+            if (ret == 0) {
+                ret = may_delete(ctx, newParentDir, newleaf);
+            }
+            /* A directory moved elsewhere gets a new ".." */
+            if (ret == 0 && newparent != parent && S_ISDIR(GetInode(src)->GetMode())) {
+                ret = may_access(ctx, GetInode(src), W_OK);
+            }
+            if (ret != 0) {
+                return ret;
+            }
+            ret = do_rename(parentDir, leaf.c_str(), newParentDir, newleaf.c_str());
+            if (ret == 0) {
+                entries.push_back({newparent, newleaf});
+                inodes.push_back(newparent);
+                if (old != INO_NOTFOUND) {
+                    inodes.push_back(old);
+                    reclaim_inode(old);
+                }
+            }
+            break;
+        }
+
+        default:
+            return -EINVAL;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    entries.push_back({parent, leaf});
+    inodes.push_back(parent);
+    return 0;
+}
+
+/* run_fileops: Run a script of file operations.
+ *
+ * The operations run under crMutex held exclusively, so a checkpoint never
+ * sees a script half done.
+ *
+ * @param[in] ino: The inode the ioctl was issued on
+ *
+ * @return: The number of operations that succeeded, or a negative error
+ *          code if the script is malformed.
+ */
+int FuseRamFs::run_fileops(fuse_req_t req, fuse_ino_t ino, struct verifs_fileops *ops) {
+    if (ops->count > VERIFS_FILEOPS_MAX || (ops->flags & ~VERIFS_FILEOPS_CONTINUE)) {
+        return -EINVAL;
+    }
+    if (IsSnapshotIno(ino)) {
+        return -EROFS;
+    }
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    std::vector<std::pair<fuse_ino_t, std::string>> entries;
+    std::vector<fuse_ino_t> inodes;
+    int done = 0;
+    bool failed = false;
+
+    std::unique_lock<std::shared_mutex> lk(crMutex);
+    for (uint32_t n = 0; n < ops->count; ++n) {
+        struct verifs_fileop *op = &ops->ops[n];
+        if (failed && !(ops->flags & VERIFS_FILEOPS_CONTINUE)) {
+            op->status = -ECANCELED;
+            continue;
+        }
+        try {
+            op->status = do_fileop(ctx, ino, ops, op, entries, inodes);
+        } catch (const std::bad_alloc &e) {
+            op->status = -ENOMEM;
+        }
+        if (op->status == 0) {
+            done++;
+        } else {
+            failed = true;
+        }
+    }
+    for (auto &it : entries) {
+        queue_invalidation(it.first, it.second);
+    }
+    for (auto it : inodes) {
+        queue_invalidation(it);
+    }
+    lk.unlock();
+
+    wait_notifications();
+    return done;
+}
@@ -27,6 +27,11 @@
 #endif
 
 #include "common.h"
+#include <openssl/evp.h>
+#include <chrono>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #include "inode.hpp"
 #include "file.hpp"
@@ -34,6 +39,7 @@
 #include "special_inode.hpp"
 #include "symlink.hpp"
 #include "fuse_cpp_ramfs.hpp"
+#include "worker_pool.hpp"
 
 using namespace std;
 
@@ -56,6 +62,82 @@ std::mutex FuseRamFs::deletedInodesMutex;
 struct statvfs FuseRamFs::m_stbuf = {};
 std::shared_mutex FuseRamFs::stbufMutex;
 
+/**
+ The last stored state matching the live file system.
+ */
+verifs2_state_ptr FuseRamFs::cleanState = nullptr;
+uint64_t FuseRamFs::cleanGeneration = 0;
+std::mutex FuseRamFs::cleanMutex;
+
+/**
+ Checkpoints that have captured the inode table but not yet taken their
+ references on it, and the inodes they keep alive.
+ */
+std::shared_mutex FuseRamFs::captureRwSem;
+size_t FuseRamFs::activeCaptures = 0;
+std::vector<Inode *> FuseRamFs::deferredInodes;
+
+/**
+ The undo journal of the latest checkpoint, if enabled.
+ */
+bool FuseRamFs::journalMode = false;
+struct undo_journal FuseRamFs::Journal = {};
+uint64_t FuseRamFs::inodeEpoch = 0;
+std::atomic<uint64_t> FuseRamFs::lastFuseGeneration(0);
+bool FuseRamFs::dedupStates = false;
+
+/**
+ The state the next checkpoint is a delta of, the inode table slots changed
+ since, and the compaction of long chains of deltas.
+ */
+verifs2_state_ptr FuseRamFs::liveParent = nullptr;
+std::unordered_set<fuse_ino_t> FuseRamFs::changedSlots;
+std::mutex FuseRamFs::checkpointMutex;
+std::thread FuseRamFs::compactThread;
+std::mutex FuseRamFs::compactMutex;
+std::condition_variable FuseRamFs::compactCv;
+verifs2_state_ptr FuseRamFs::compactPending = nullptr;
+bool FuseRamFs::compactStopping = false;
+std::thread FuseRamFs::notifyThread;
+std::mutex FuseRamFs::notifyMutex;
+std::condition_variable FuseRamFs::notifyCv;
+std::deque<std::pair<fuse_ino_t, std::string>> FuseRamFs::notifyQueue;
+std::set<std::pair<fuse_ino_t, std::string>> FuseRamFs::notifyPending;
+uint64_t FuseRamFs::notifyQueued = 0;
+uint64_t FuseRamFs::notifySent = 0;
+bool FuseRamFs::notifyStopping = false;
+std::thread FuseRamFs::reclaimThread;
+std::mutex FuseRamFs::reclaimMutex;
+std::condition_variable FuseRamFs::reclaimCv;
+std::deque<std::vector<Inode *>> FuseRamFs::reclaimQueue;
+size_t FuseRamFs::reclaimBusy = 0;
+bool FuseRamFs::reclaimStopping = false;
+std::thread FuseRamFs::prefetchThread;
+std::mutex FuseRamFs::prefetchMutex;
+std::condition_variable FuseRamFs::prefetchCv;
+uint64_t FuseRamFs::prefetchKey = 0;
+uint64_t FuseRamFs::prefetchSeq = 0;
+uint64_t FuseRamFs::prefetchDone = 0;
+verifs2_state_ptr FuseRamFs::prefetchState;
+std::vector<Inode *> FuseRamFs::prefetchTable;
+bool FuseRamFs::prefetchStopping = false;
+std::thread FuseRamFs::asyncThread;
+std::mutex FuseRamFs::asyncMutex;
+std::condition_variable FuseRamFs::asyncCv;
+std::deque<async_checkpoint *> FuseRamFs::asyncQueue;
+bool FuseRamFs::asyncBusy = false;
+bool FuseRamFs::asyncStopping = false;
+
+/**
+ The cached abstract state hash of the live file system.
+ */
+bool FuseRamFs::hashValid = false;
+uint32_t FuseRamFs::hashFlags = 0;
+std::unordered_map<fuse_ino_t, std::string> FuseRamFs::hashTree;
+hash_links FuseRamFs::hashLinks;
+std::mutex FuseRamFs::hashMutex;
+std::unordered_set<fuse_ino_t> FuseRamFs::hashDirty;
+
 std::mutex FuseRamFs::renameMutex;
 /**
  All the supported filesystem operations mapped to object-methods.
@@ -63,7 +145,8 @@ std::mutex FuseRamFs::renameMutex;
 struct fuse_lowlevel_ops FuseRamFs::FuseOps = {};
 
 
-FuseRamFs::FuseRamFs(fsblkcnt_t blocks, fsfilcnt_t inodes) {
+FuseRamFs::FuseRamFs(fsblkcnt_t blocks, fsfilcnt_t inodes, bool undo_journal,
+                     bool dedup_states) {
     FuseOps.init = FuseRamFs::FuseInit;
     FuseOps.destroy = FuseRamFs::FuseDestroy;
     FuseOps.lookup = FuseRamFs::FuseLookup;
@@ -117,6 +200,9 @@ FuseRamFs::FuseRamFs(fsblkcnt_t blocks, fsfilcnt_t inodes) {
     m_stbuf.f_fsid = kFilesystemId;         /* Filesystem ID */
     m_stbuf.f_flag = 0;                     /* Bit mask of values */
     m_stbuf.f_namemax = kMaxFilenameLength;    /* Max file name length */
+
+    journalMode = undo_journal;
+    dedupStates = dedup_states;
 }
 
 FuseRamFs::~FuseRamFs() {
@@ -124,239 +210,1539 @@ FuseRamFs::~FuseRamFs() {
 }
 
 static void free_inodes(std::vector<Inode *> &table) {
-    for (auto &i : table) {
-        delete i;
-    }
+    WorkerPool::ParallelFor(table.size(), [&table](size_t begin, size_t end) {
+        for (size_t ino = begin; ino < end; ino++) {
+            Inode::PutRef(table[ino]);
+        }
+    });
     table.clear();
 }
 
-int FuseRamFs::checkpoint(uint64_t key) {
+/* Take a reference on each inode of a table that is to be shared */
+static void get_inodes(std::vector<Inode *> &table) {
+    WorkerPool::ParallelFor(table.size(), [&table](size_t begin, size_t end) {
+        for (size_t ino = begin; ino < end; ino++) {
+            if (table[ino] != nullptr) {
+                table[ino]->GetRef();
+            }
+        }
+    });
+}
+
+/* copy_inode: Make a private copy of an inode using the copy constructor
+ * of its actual type.
+ *
+ * @return: The new inode, or nullptr if the object does not match its mode.
+ */
+static Inode *copy_inode(Inode *src) {
+    mode_t inode_mode = src->GetMode();
+    if (S_ISREG(inode_mode)) {
+        File *file_inode = dynamic_cast<File *>(src);
+        return file_inode ? new File(*file_inode) : nullptr;
+    } else if (S_ISDIR(inode_mode)) {
+        Directory *dir_inode = dynamic_cast<Directory *>(src);
+        return dir_inode ? new Directory(*dir_inode) : nullptr;
+    } else if (S_ISLNK(inode_mode)) {
+        SymLink *symlink_inode = dynamic_cast<SymLink *>(src);
+        return symlink_inode ? new SymLink(*symlink_inode) : nullptr;
+    } else {
+        SpecialInode *special_inode = dynamic_cast<SpecialInode *>(src);
+        return special_inode ? new SpecialInode(*special_inode) : nullptr;
+    }
+}
+
+/**
+ Returns an inode that the caller is allowed to modify.
+
+ Checkpointed states share inode objects with the live table, so an inode
+ that is still shared gets replaced by a private copy in the live table
+ first (copy-on-write). Only the first modification after a checkpoint
+ pays for the copy. With the undo journal, the objects of the journaled
+ checkpoint are copied the same way and saved in the journal, and so are
+ the objects captured by a checkpoint that is still taking references.
+
+ @param ino The inode number.
+ @return The private inode, or nullptr if it does not exist.
+ */
+Inode *FuseRamFs::GetInodeForWrite(fuse_ino_t ino) {
+    std::shared_lock<std::shared_mutex> readlk(inodesRwSem);
+    if (ino >= Inodes.size()) {
+        return nullptr;
+    }
+    Inode *inode = Inodes[ino];
+    auto must_copy = [](Inode *inode) {
+        return inode->IsShared() ||
+               ((Journal.active || activeCaptures > 0) && inode->m_epoch < inodeEpoch);
+    };
+    /* The caller is about to modify it */
+    if (inode != nullptr) {
+        DirtyHash(ino);
+    }
+    if (inode == nullptr || !must_copy(inode)) {
+        return inode;
+    }
+    readlk.unlock();
+
+    std::unique_lock<std::shared_mutex> writelk(inodesRwSem);
+    /* Someone else may have copied it in the meantime */
+    inode = Inodes[ino];
+    if (inode == nullptr || !must_copy(inode)) {
+        return inode;
+    }
+    Inode *copy = copy_inode(inode);
+    if (copy == nullptr) {
+        std::cerr << "Inode " << ino << " has incorrect inode type "
+                  << inode->GetMode() << "\n";
+        return nullptr;
+    }
+    if (!JournalSlot(ino)) {
+        ReleaseInode(inode);
+    }
+    copy->m_epoch = inodeEpoch;
+    Inodes[ino] = copy;
+    ChangeSlot(ino);
+    return copy;
+}
+
+int FuseRamFs::checkpoint(uint64_t key, const std::function<void()> *captured) {
     //std::cout << "Start Checkpoint.\n";
+    /* Each delta is taken against the state the previous one published */
+    std::unique_lock<std::mutex> cplk(checkpointMutex, std::defer_lock);
+    if (!journalMode) {
+        cplk.lock();
+    }
     // Lock
     std::unique_lock<std::shared_mutex> lk(crMutex);
+    return _checkpoint(key, &lk, captured);
+}
+
+/* _checkpoint: Checkpoint the live file system under key.
+ * Caller must hold crMutex exclusively, and checkpointMutex unless in
+ * journal mode. If lk is given, crMutex is released through it while the
+ * references are taken and the pages interned, and captured is called
+ * right after; otherwise it stays held.
+ */
+int FuseRamFs::_checkpoint(uint64_t key, std::unique_lock<std::shared_mutex> *lk,
+                           const std::function<void()> *captured) {
+    std::shared_lock<std::shared_mutex> capturelk(captureRwSem, std::defer_lock);
     int ret = 0;
-    std::vector<Inode *> copied_files = std::vector<Inode *>();
+    verifs2_state_ptr state;
+    verifs2_state_ptr parent;
+    uint64_t generation = Inode::CurrentGeneration();
+    uint64_t baseGeneration;
+
+    if (journalMode) {
+        if ((Journal.active && Journal.key == key) || find_state(key) != nullptr) {
+            std::cerr << "Checkpointing went to error.\n";
+            return -EEXIST;
+        }
+        /* The previous checkpoint is no longer on top of the stack */
+        ret = flush_journal();
+        if (ret != 0) {
+            return ret;
+        }
 
-    mode_t inode_mode;
+        /* Deduplicate the pages of the files written since the last
+         * checkpoint; the others have been interned already */
+        for (auto &i : Inodes) {
+            if (i != nullptr && S_ISREG(i->GetMode()) && !i->IsShared() &&
+                i->Generation() > cleanGeneration) {
+                dynamic_cast<File *>(i)->InternPages();
+            }
+        }
 
-    File *file_inode_old;
-    Directory *dir_inode_old;
-    SpecialInode *special_inode_old;
-    SymLink *symlink_inode_old;
+        /* Start journaling instead of storing a snapshot */
+        start_journal(key);
+        link_state(key, current_state());
+        return 0;
+    }
 
-    for (auto &i : Inodes) {
-        if (i == nullptr) {
-            copied_files.push_back(nullptr);
-            continue;
+    /* The state the new one is taken from, in the checkpoint tree */
+    uint64_t parentKey = current_state();
+
+    {
+        std::lock_guard<std::mutex> cleanlk(cleanMutex);
+        /* Nothing has changed since the live file system last matched a
+         * stored state (e.g. the last operation failed): just alias it */
+        if (cleanState != nullptr && generation == cleanGeneration) {
+            ret = insert_state(key, cleanState);
+            if (ret != 0) {
+                std::cerr << "Checkpointing went to error.\n";
+            } else {
+                link_state(key, parentKey);
+            }
+            return ret;
+        }
+        baseGeneration = cleanGeneration;
+        /* Take a new base if compaction falls behind */
+        if (liveParent != nullptr && liveParent->depth < 2 * kMaxChainDepth &&
+            !state_packing_enabled()) {
+            parent = liveParent;
+        }
+    }
+    if (find_state(key) != nullptr) {
+        std::cerr << "Checkpointing went to error.\n";
+        return -EEXIST;
+    }
+
+    /* The file system may have come back to a state stored before */
+    std::string fp;
+    if (dedupStates) {
+        try {
+            fp = fingerprint();
+        } catch (const std::bad_alloc &e) {
+            fp.clear();
+        }
+        verifs2_state_ptr same = fp.empty() ? nullptr : find_fingerprint(fp);
+        if (same != nullptr) {
+            ret = insert_state(key, same);
+            if (ret != 0) {
+                std::cerr << "Checkpointing went to error.\n";
+                return ret;
+            }
+            link_state(key, parentKey);
+            /* The changed slots still refer to liveParent */
+            std::lock_guard<std::mutex> cleanlk(cleanMutex);
+            if (generation >= cleanGeneration) {
+                cleanState = same;
+                cleanGeneration = generation;
+            }
+            return 0;
+        }
+    }
+
+    /* Capture the inode table, or only its slots changed since the parent
+     * state. From now on GetInodeForWrite() copies the captured objects
+     * before modifying them and defers freeing replaced ones, so the rest
+     * of the checkpoint runs without blocking other operations; only
+     * restore() and load wait for it. */
+    std::vector<fuse_ino_t> slots;
+    std::vector<Inode *> shared_files;
+    size_t table_size = Inodes.size();
+    if (parent != nullptr) {
+        slots.assign(changedSlots.begin(), changedSlots.end());
+        std::sort(slots.begin(), slots.end());
+        for (auto &ino : slots) {
+            shared_files.push_back(Inodes[ino]);
+        }
+    } else {
+        shared_files = Inodes;
+    }
+    std::queue<fuse_ino_t> deleted_inodes = DeletedInodes;
+    struct statvfs stbuf = m_stbuf;
+    {
+        std::unique_lock<std::shared_mutex> writelk(inodesRwSem);
+        changedSlots.clear();
+        inodeEpoch++;
+        activeCaptures++;
+    }
+    capturelk.lock();
+    if (lk != nullptr) {
+        lk->unlock();
+        if (captured != nullptr) {
+            (*captured)();
         }
+    }
 
-        inode_mode = i->GetMode();
-        if (S_ISREG(inode_mode)) {
-            file_inode_old = dynamic_cast<File *>(i);
-            if (file_inode_old == nullptr) {
-                ret = -EBADF;
-                goto err;
+    /* Inodes are shared with the state instead of being copied */
+    get_inodes(shared_files);
+    end_capture();
+
+    /* Deduplicate the pages of the files written since the last
+     * checkpoint. The live objects may be read meanwhile, so the state
+     * gets copies of them whose pages are interned. */
+    std::vector<Inode *> originals(shared_files.size(), nullptr);
+    std::atomic_bool failed(false);
+    WorkerPool::ParallelFor(shared_files.size(), [&](size_t begin, size_t end) {
+        for (size_t n = begin; n < end; n++) {
+            Inode *i = shared_files[n];
+            if (i == nullptr || !S_ISREG(i->GetMode()) || i->Generation() <= baseGeneration) {
+                continue;
+            }
+            try {
+                File *file = new File(*dynamic_cast<File *>(i));
+                shared_files[n] = file;
+                originals[n] = i;
+                file->InternPages();
+            } catch (const std::bad_alloc &e) {
+                failed = true;
             }
+        }
+    });
+    if (failed) {
+        free_inodes(shared_files);
+        free_inodes(originals);
+        /* The changed slots are lost, so the next checkpoint is a base */
+        std::lock_guard<std::mutex> cleanlk(cleanMutex);
+        liveParent = nullptr;
+        std::cerr << "Checkpointing went to error.\n";
+        return -ENOMEM;
+    }
+
+    /* The interned copies by slot, for the live table below */
+    std::vector<std::pair<fuse_ino_t, size_t>> copied;
+    for (size_t n = 0; n < originals.size(); n++) {
+        if (originals[n] != nullptr) {
+            copied.push_back({(parent != nullptr) ? slots[n] : n, n});
+        }
+    }
+    std::vector<Inode *> copies(copied.size());
+    for (size_t c = 0; c < copied.size(); c++) {
+        copies[c] = shared_files[copied[c].second];
+    }
 
-            File *file_inode_copy = new File(*file_inode_old);
-            copied_files.push_back((Inode *) file_inode_copy);
+    /* The stored state owns the references from now on */
+    if (parent != nullptr) {
+        std::vector<std::pair<fuse_ino_t, Inode *>> changes;
+        for (size_t n = 0; n < slots.size(); n++) {
+            changes.push_back({slots[n], shared_files[n]});
+        }
+        state = make_delta(parent, std::move(changes), table_size,
+                           std::move(deleted_inodes), stbuf);
+    } else {
+        state = make_state(std::make_tuple(std::move(shared_files), std::move(deleted_inodes), stbuf));
+    }
+    // insert state
+    ret = insert_state(key, state);
+    if (ret == 0) {
+        link_state(key, parentKey);
+    }
+    if (ret == 0 && !fp.empty()) {
+        add_fingerprint(fp, state);
+    }
+    {
+        std::lock_guard<std::mutex> cleanlk(cleanMutex);
+        if (ret != 0) {
+            std::cerr << "Checkpointing went to error.\n";
+            /* The changed slots are lost, so the next checkpoint is a base */
+            liveParent = nullptr;
+        } else {
+            /* A concurrent checkpoint may have captured a newer table */
+            if (generation >= cleanGeneration) {
+                cleanState = state;
+                cleanGeneration = generation;
+            }
+            liveParent = state;
+        }
+    }
+    capturelk.unlock();
+    if (ret == 0 && state->depth >= kMaxChainDepth) {
+        request_compaction(state);
+    }
 
-        } else if (S_ISDIR(inode_mode)) {
-            dir_inode_old = dynamic_cast<Directory *>(i);
-            if (dir_inode_old == nullptr) {
-                ret = -EBADF;
-                goto err;
+    /* Let the live table use the interned copies as well, so that the
+     * dirty pages are not kept twice. This only swaps pointers, but no
+     * operation may hold the replaced objects meanwhile. */
+    if (ret == 0) {
+        if (lk != nullptr) {
+            lk->lock();
+        }
+        std::unique_lock<std::shared_mutex> writelk(inodesRwSem);
+        for (size_t c = 0; c < copied.size(); c++) {
+            fuse_ino_t ino = copied[c].first;
+            Inode *original = originals[copied[c].second];
+            if (ino < Inodes.size() && Inodes[ino] == original) {
+                Inode *file = copies[c];
+                file->GetRef();
+                file->m_nlookup.store(original->m_nlookup.load());
+                file->m_epoch = original->m_epoch;
+                ReleaseInode(original);
+                Inodes[ino] = file;
             }
+        }
+    }
+    free_inodes(originals);
+#ifdef DUMP_TESTING
+    verifs2_state image = materialize_state(state);
+    ret = dump_inodes_verifs2(std::get<0>(image), std::get<1>(image), "During/After the checkpoint():");
+#endif
+    return ret;
+}
 
-            auto *dir_copy = new Directory(*dir_inode_old);
-            copied_files.push_back((Inode *) dir_copy);
+/* request_compaction: Have a long chain of delta states collapsed into a
+ * new base in the background. Only the latest request is kept.
+ */
+void FuseRamFs::request_compaction(const verifs2_state_ptr &state) {
+    std::lock_guard<std::mutex> lk(compactMutex);
+    if (compactStopping) {
+        return;
+    }
+    compactPending = state;
+    /* Started here rather than at mount, as the daemon forks after
+     * parsing the options */
+    if (!compactThread.joinable()) {
+        compactThread = std::thread(compact_worker);
+    }
+    compactCv.notify_one();
+}
 
-        } else if (S_ISLNK(inode_mode)) {
-            symlink_inode_old = dynamic_cast<SymLink *>(i);
-            if (symlink_inode_old == nullptr) {
-                ret = -EBADF;
-                goto err;
+void FuseRamFs::compact_worker() {
+    std::unique_lock<std::mutex> lk(compactMutex);
+    while (true) {
+        compactCv.wait(lk, [] { return compactStopping || compactPending != nullptr; });
+        if (compactStopping) {
+            break;
+        }
+        verifs2_state_ptr old = std::move(compactPending);
+        compactPending = nullptr;
+        lk.unlock();
+
+        /* The chain is immutable, so it is walked without locking */
+        verifs2_state image = materialize_state(old);
+        get_inodes(std::get<0>(image));
+        verifs2_state_ptr base = make_state(std::move(image));
+        replace_state(old, base);
+        {
+            /* The live table differs from the base by the same slots */
+            std::lock_guard<std::mutex> cleanlk(cleanMutex);
+            if (liveParent == old) {
+                liveParent = base;
             }
+            if (cleanState == old) {
+                cleanState = base;
+            }
+        }
+        /* Frees the chain unless still used by other states */
+        old = nullptr;
+        lk.lock();
+    }
+}
 
-            auto *symlink_inode_copy = new SymLink(*symlink_inode_old);
-            copied_files.push_back((Inode *) symlink_inode_copy);
+void FuseRamFs::stop_compaction() {
+    {
+        std::lock_guard<std::mutex> lk(compactMutex);
+        compactStopping = true;
+        compactPending = nullptr;
+    }
+    compactCv.notify_all();
+    if (compactThread.joinable()) {
+        compactThread.join();
+    }
+}
 
-        } else {
-            special_inode_old = dynamic_cast<SpecialInode *>(i);
-            if (special_inode_old == nullptr) {
-                ret = -EBADF;
-                goto err;
+/* checkpoint_async: Checkpoint the live file system under key in the
+ * checkpoint thread (VERIFS_CHECKPOINT_ASYNC).
+ *
+ * @return 0 once the live table is captured, or the result of a
+ * checkpoint that ended before, e.g. by aliasing a stored state.
+ */
+int FuseRamFs::checkpoint_async(uint64_t key) {
+    async_checkpoint req = {key, false, 0};
+    std::unique_lock<std::mutex> lk(asyncMutex);
+    asyncQueue.push_back(&req);
+    /* Started here rather than at mount, as the daemon forks after
+     * parsing the options */
+    if (!asyncThread.joinable()) {
+        asyncThread = std::thread(checkpoint_worker);
+    }
+    asyncCv.notify_all();
+    asyncCv.wait(lk, [&req] { return req.captured; });
+    return req.ret;
+}
+
+void FuseRamFs::checkpoint_worker() {
+    std::unique_lock<std::mutex> lk(asyncMutex);
+    while (true) {
+        asyncCv.wait(lk, [] { return asyncStopping || !asyncQueue.empty(); });
+        if (asyncQueue.empty()) {
+            break;
+        }
+        async_checkpoint *req = asyncQueue.front();
+        asyncQueue.pop_front();
+        asyncBusy = true;
+        lk.unlock();
+
+        /* The request belongs to its caller, which returns once told */
+        bool signalled = false;
+        auto signal = [&](int ret) {
+            std::lock_guard<std::mutex> reqlk(asyncMutex);
+            req->ret = ret;
+            req->captured = true;
+            signalled = true;
+            asyncCv.notify_all();
+        };
+        std::function<void()> captured = [&] { signal(0); };
+        int ret = checkpoint(req->key, &captured);
+        if (!signalled) {
+            signal(ret);
+        } else if (ret != 0) {
+            std::cerr << "Asynchronous checkpoint " << req->key << " failed: "
+                      << strerror(-ret) << "\n";
+        }
+
+        lk.lock();
+        asyncBusy = false;
+        asyncCv.notify_all();
+    }
+}
+
+/* wait_checkpoints: Wait until the pending checkpoints are stored */
+void FuseRamFs::wait_checkpoints() {
+    std::unique_lock<std::mutex> lk(asyncMutex);
+    asyncCv.wait(lk, [] { return asyncQueue.empty() && !asyncBusy; });
+}
+
+/* stop_checkpointer: Finish the pending checkpoints and stop the thread */
+void FuseRamFs::stop_checkpointer() {
+    {
+        std::lock_guard<std::mutex> lk(asyncMutex);
+        asyncStopping = true;
+    }
+    asyncCv.notify_all();
+    if (asyncThread.joinable()) {
+        asyncThread.join();
+    }
+}
+
+/* reclaim_table: Release the references of an inode table that is no
+ * longer used, in the background. Releasing the last references frees
+ * whole file systems, which would otherwise hold up the reply of the
+ * restore that retired the table. The table is left empty.
+ */
+void FuseRamFs::reclaim_table(std::vector<Inode *> &table) {
+    if (table.empty()) {
+        return;
+    }
+    std::unique_lock<std::mutex> lk(reclaimMutex);
+    if (reclaimStopping || reclaimQueue.size() >= kMaxReclaimBacklog) {
+        lk.unlock();
+        free_inodes(table);
+        return;
+    }
+    reclaimQueue.push_back(std::move(table));
+    table.clear();
+    /* Started here rather than at mount, as the daemon forks after
+     * parsing the options */
+    if (!reclaimThread.joinable()) {
+        reclaimThread = std::thread(reclaim_worker);
+    }
+    reclaimCv.notify_all();
+}
+
+void FuseRamFs::reclaim_worker() {
+    auto last_trim = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lk(reclaimMutex);
+    while (true) {
+        reclaimCv.wait(lk, [] { return reclaimStopping || !reclaimQueue.empty(); });
+        if (reclaimQueue.empty()) {
+            break;
+        }
+        std::vector<Inode *> table = std::move(reclaimQueue.front());
+        reclaimQueue.pop_front();
+        reclaimBusy++;
+        lk.unlock();
+
+        free_inodes(table);
+#ifdef __GLIBC__
+        /* Give the freed memory back to the system once the backlog is
+         * cleared, at most once a second as it walks the whole heap */
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_trim >= std::chrono::seconds(1)) {
+            lk.lock();
+            bool idle = reclaimQueue.empty();
+            lk.unlock();
+            if (idle) {
+                malloc_trim(0);
+                last_trim = now;
             }
+        }
+#endif
+        lk.lock();
+        reclaimBusy--;
+        reclaimCv.notify_all();
+    }
+}
+
+/* wait_reclaim: Wait until the tables retired so far are released */
+void FuseRamFs::wait_reclaim() {
+    std::unique_lock<std::mutex> lk(reclaimMutex);
+    reclaimCv.wait(lk, [] { return reclaimQueue.empty() && reclaimBusy == 0; });
+}
+
+/* stop_reclaimer: Release the waiting tables and stop the thread */
+void FuseRamFs::stop_reclaimer() {
+    {
+        std::lock_guard<std::mutex> lk(reclaimMutex);
+        reclaimStopping = true;
+    }
+    reclaimCv.notify_all();
+    if (reclaimThread.joinable()) {
+        reclaimThread.join();
+    }
+}
+
+/* end_capture: Release the inodes replaced while checkpoints were
+ * capturing the inode table, once the last one has taken its references.
+ */
+void FuseRamFs::end_capture() {
+    std::vector<Inode *> deferred;
+    {
+        std::unique_lock<std::shared_mutex> writelk(inodesRwSem);
+        if (--activeCaptures == 0) {
+            deferred.swap(deferredInodes);
+        }
+    }
+    for (auto &i : deferred) {
+        Inode::PutRef(i);
+    }
+}
 
-            auto *special_inode_copy = new SpecialInode(*special_inode_old);
-            copied_files.push_back((Inode *) special_inode_copy);
+/* flush_journal: Turn the journaled checkpoint into a regular state in the
+ * state pool, built from the live table and the saved objects.
+ * Caller must hold crMutex exclusively.
+ */
+int FuseRamFs::flush_journal() {
+    if (!Journal.active) {
+        return 0;
+    }
+    std::vector<Inode *> files(Inodes.begin(), Inodes.begin() + Journal.table_size);
+    for (size_t ino = 0; ino < files.size(); ++ino) {
+        auto it = Journal.old_inodes.find(ino);
+        if (it != Journal.old_inodes.end()) {
+            /* The journal's reference moves to the state */
+            files[ino] = it->second;
+        } else if (files[ino] != nullptr) {
+            files[ino]->GetRef();
+        }
+    }
+    Journal.old_inodes.clear();
+    Journal.active = false;
+
+    verifs2_state_ptr state = make_state(std::make_tuple(std::move(files),
+                                                         std::move(Journal.deleted_inodes),
+                                                         Journal.stbuf));
+    int ret = insert_state(Journal.key, state);
+    if (ret == 0 && Inode::CurrentGeneration() == Journal.generation) {
+        std::lock_guard<std::mutex> cleanlk(cleanMutex);
+        cleanState = state;
+    }
+    return ret;
+}
+
+/* start_journal: Checkpoint the live file system under key by journaling
+ * the changes made from now on.
+ * Caller must hold crMutex exclusively.
+ */
+void FuseRamFs::start_journal(uint64_t key) {
+    uint64_t generation = Inode::CurrentGeneration();
+    Journal.active = true;
+    Journal.key = key;
+    Journal.generation = generation;
+    Journal.table_size = Inodes.size();
+    Journal.deleted_inodes = DeletedInodes;
+    Journal.stbuf = m_stbuf;
+    inodeEpoch++;
+    std::lock_guard<std::mutex> cleanlk(cleanMutex);
+    cleanState = nullptr;
+    cleanGeneration = generation;
+}
+
+/* drop_journal: Forget the journaled checkpoint */
+void FuseRamFs::drop_journal() {
+    for (auto &it : Journal.old_inodes) {
+        Inode::PutRef(it.second);
+    }
+    Journal.old_inodes.clear();
+    Journal.active = false;
+}
+
+/* restore_journal: Restore the journaled checkpoint by rolling back the
+ * changed slots of the inode table.
+ * Caller must hold crMutex exclusively.
+ */
+int FuseRamFs::restore_journal() {
+    /* Only the changed inodes may be cached by the kernel in a state that
+     * differs from the checkpoint */
+    for (auto &it : Journal.old_inodes) {
+        invalidate_inode(Inodes[it.first]);
+        invalidate_inode(it.second);
+    }
+    for (size_t ino = Journal.table_size; ino < Inodes.size(); ++ino) {
+        invalidate_inode(Inodes[ino]);
+    }
+
+    for (auto &it : Journal.old_inodes) {
+        Inode::PutRef(Inodes[it.first]);
+        Inodes[it.first] = it.second;
+        DirtyHash(it.first);
+    }
+    for (size_t ino = Journal.table_size; ino < Inodes.size(); ++ino) {
+        Inode::PutRef(Inodes[ino]);
+        DirtyHash(ino);
+    }
+    Inodes.resize(Journal.table_size);
+    DeletedInodes = std::move(Journal.deleted_inodes);
+    m_stbuf = Journal.stbuf;
+    Journal.old_inodes.clear();
+    Journal.active = false;
+    std::lock_guard<std::mutex> cleanlk(cleanMutex);
+    cleanState = nullptr;
+    cleanGeneration = Inode::CurrentGeneration();
+#ifdef DUMP_TESTING
+    dump_inodes_verifs2(Inodes, DeletedInodes, "After the restore():");
+#endif
+    return 0;
+}
+
+/* Invalidate the kernel caches of an inode and, for a directory, of its
+ * entries */
+void FuseRamFs::invalidate_inode(Inode *inode) {
+    if (inode == nullptr) {
+        return;
+    }
+    /* Invalidate possible kernel inode cache */
+    // if m_markedForDeletion is false (the inode exists and is not marked as deleted)
+    if (!inode->m_markedForDeletion) {
+        queue_invalidation(inode->GetIno());
+    }
+    /* Invalidate potential d-cache */
+    if (S_ISDIR(inode->GetMode())) {
+        auto *parent_dir = dynamic_cast<Directory *>(inode);
+        /* If parent_dir has child dir*/
+        for (auto &it_child : parent_dir->m_children) {
+            if (it_child.second > 0 && it_child.first != "." && it_child.first != "..") {
+                queue_invalidation(inode->GetIno(), it_child.first);
+            }
+        }
+    }
+}
+
+/* queue_invalidation: Have the notifier thread invalidate the kernel cache
+ * of an inode, or of the entry name in the directory ino. The sending is
+ * left to the thread so that it does not hold up the caller, which often
+ * holds crMutex; wait_notifications() waits until it is done.
+ */
+void FuseRamFs::queue_invalidation(fuse_ino_t ino, const std::string &name) {
+    std::lock_guard<std::mutex> lk(notifyMutex);
+    if (notifyStopping || !notifyPending.insert({ino, name}).second) {
+        return;
+    }
+    notifyQueue.push_back({ino, name});
+    notifyQueued++;
+    /* Started here rather than at mount, as the daemon forks after
+     * parsing the options */
+    if (!notifyThread.joinable()) {
+        notifyThread = std::thread(notify_worker);
+    }
+    notifyCv.notify_all();
+}
+
+/* Send the queued invalidations in batches, in order */
+void FuseRamFs::notify_worker() {
+    std::unique_lock<std::mutex> lk(notifyMutex);
+    while (true) {
+        notifyCv.wait(lk, [] { return notifyStopping || !notifyQueue.empty(); });
+        if (notifyStopping) {
+            break;
+        }
+        std::deque<std::pair<fuse_ino_t, std::string>> batch;
+        batch.swap(notifyQueue);
+        notifyPending.clear();
+        lk.unlock();
+
+        for (auto &it : batch) {
+            if (it.second.empty()) {
+                fuse_lowlevel_notify_inval_inode(ch, it.first, 0, 0);
+            } else {
+                fuse_lowlevel_notify_inval_entry(ch, it.first, it.second.c_str(), it.second.size());
+            }
+        }
+        lk.lock();
+        notifySent += batch.size();
+        notifyCv.notify_all();
+    }
+}
+
+/* wait_notifications: Wait until the invalidations queued so far have been
+ * sent. Called before replying to an operation that queued some, so that
+ * no later lookup is served from stale kernel caches. Must not be called
+ * with crMutex held, since the kernel may wait on operations that need it
+ * before it takes the notifications.
+ */
+void FuseRamFs::wait_notifications() {
+    std::unique_lock<std::mutex> lk(notifyMutex);
+    uint64_t target = notifyQueued;
+    notifyCv.wait(lk, [target] { return notifyStopping || notifySent >= target; });
+}
+
+void FuseRamFs::stop_notifier() {
+    {
+        std::lock_guard<std::mutex> lk(notifyMutex);
+        notifyStopping = true;
+        notifyQueue.clear();
+        notifyPending.clear();
+    }
+    notifyCv.notify_all();
+    if (notifyThread.joinable()) {
+        notifyThread.join();
+    }
+}
+
+/* invalidate_changes: Invalidate the kernel caches of what differs when
+ * the inode table from is replaced by to.
+ *
+ * A slot is unchanged if it holds the same object in both tables, or a
+ * copy of it that was not modified, e.g. by an operation that failed (see
+ * Inode::MarkDirty()). An entry is only invalidated if it appears, goes
+ * away, or leads to another object; objects are told apart by their FUSE
+ * generation numbers.
+ */
+void FuseRamFs::invalidate_changes(const std::vector<Inode *> &from, const std::vector<Inode *> &to) {
+    auto object = [](const std::vector<Inode *> &table, fuse_ino_t ino) {
+        return (ino < table.size()) ? table[ino] : nullptr;
+    };
+    auto same_object = [&](fuse_ino_t ino) {
+        Inode *a = object(from, ino), *b = object(to, ino);
+        return a == b || (a != nullptr && b != nullptr &&
+                          a->m_fuseEntryParam.generation == b->m_fuseEntryParam.generation);
+    };
+    for (fuse_ino_t ino = 0; ino < from.size(); ++ino) {
+        Inode *a = from[ino], *b = object(to, ino);
+        /* The kernel has forgotten the objects no longer in the table */
+        if (a == nullptr || (same_object(ino) && (a == b || a->Generation() == b->Generation()))) {
+            continue;
+        }
+        auto *dir_a = dynamic_cast<Directory *>(a);
+        auto *dir_b = dynamic_cast<Directory *>(b);
+        if (dir_a == nullptr || dir_b == nullptr || !same_object(ino)) {
+            invalidate_inode(a);
+            continue;
+        }
+        if (!a->m_markedForDeletion) {
+            queue_invalidation(ino);
+        }
+        std::unordered_map<std::string, fuse_ino_t> entries_b(dir_b->m_children.begin(),
+                                                             dir_b->m_children.end());
+        for (auto &child : dir_a->m_children) {
+            if (child.first == "." || child.first == "..") {
+                continue;
+            }
+            auto it = entries_b.find(child.first);
+            if (it == entries_b.end() || it->second != child.second || !same_object(child.second)) {
+                queue_invalidation(ino, child.first);
+            }
+            if (it != entries_b.end()) {
+                entries_b.erase(it);
+            }
+        }
+        /* The kernel may have cached the lookups of the new names as
+         * negative entries, unless the directory was removed */
+        for (auto &child : entries_b) {
+            if (!a->HasNoLinks() && child.first != "." && child.first != "..") {
+                queue_invalidation(ino, child.first);
+            }
+        }
+    }
+}
+
+void FuseRamFs::invalidate_kernel_states() {
+    for (auto &it : Inodes) {
+        invalidate_inode(it);
+    }
+}
+
+
+void FuseRamFs::check_restored_inode_size() {
+    for (auto it = Inodes.begin(); it != Inodes.end(); ++it) {
+        std::cout << "Order: " << std::distance(Inodes.begin(), it) << " - Inode Size: "
+                  << (*it)->m_fuseEntryParam.attr.st_size << std::endl;
+    }
+}
+
+/* The live table shares the stored inodes; they will be copied when they
+ * are modified. A delta is rebuilt from its chain. */
+static void prepare_table(const verifs2_state_ptr &state, std::vector<Inode *> &table) {
+    table = std::move(std::get<0>(materialize_state(state)));
+    get_inodes(table);
+}
+
+/* prefetch: Prepare the table of the state with the given key in the
+ * background (VERIFS_PREFETCH), in place of the one last prefetched.
+ */
+int FuseRamFs::prefetch(uint64_t key) {
+    std::vector<Inode *> old;
+    {
+        std::lock_guard<std::mutex> lk(prefetchMutex);
+        if (prefetchKey == key && prefetchSeq != 0 &&
+            (prefetchDone != prefetchSeq || prefetchState != nullptr)) {
+            /* Already being prepared, or ready */
+            return 0;
+        }
+        old.swap(prefetchTable);
+        prefetchState = nullptr;
+        prefetchKey = key;
+        prefetchSeq++;
+        /* Started here rather than at mount, as the daemon forks after
+         * parsing the options */
+        if (!prefetchThread.joinable()) {
+            prefetchThread = std::thread(prefetch_worker);
+        }
+    }
+    prefetchCv.notify_all();
+    reclaim_table(old);
+    return 0;
+}
+
+void FuseRamFs::prefetch_worker() {
+    std::unique_lock<std::mutex> lk(prefetchMutex);
+    while (true) {
+        prefetchCv.wait(lk, [] { return prefetchStopping || prefetchDone != prefetchSeq; });
+        if (prefetchStopping) {
+            break;
+        }
+        uint64_t key = prefetchKey, seq = prefetchSeq;
+        lk.unlock();
+
+        /* The state may be in a pending checkpoint */
+        wait_checkpoints();
+        std::vector<Inode *> table;
+        verifs2_state_ptr state = find_state(key);
+        if (state != nullptr) {
+            prepare_table(state, table);
+        }
+
+        lk.lock();
+        if (seq == prefetchSeq) {
+            prefetchState = state;
+            prefetchTable.swap(table);
+            prefetchDone = seq;
+            prefetchCv.notify_all();
+        }
+        if (!table.empty()) {
+            /* Superseded by another hint */
+            lk.unlock();
+            reclaim_table(table);
+            lk.lock();
+        }
+    }
+}
+
+/* take_prefetched: Move the table prefetched for key into table, if it was
+ * prepared from state. Waits for the prefetch thread if it is preparing
+ * it, which is no slower than preparing it again.
+ *
+ * @return Whether table was filled.
+ */
+bool FuseRamFs::take_prefetched(uint64_t key, const verifs2_state_ptr &state,
+                                std::vector<Inode *> &table) {
+    std::vector<Inode *> stale;
+    {
+        std::unique_lock<std::mutex> lk(prefetchMutex);
+        if (prefetchSeq == 0 || prefetchKey != key) {
+            return false;
+        }
+        prefetchCv.wait(lk, [key] {
+            return prefetchStopping || prefetchKey != key || prefetchDone == prefetchSeq;
+        });
+        if (prefetchKey != key || prefetchDone != prefetchSeq || prefetchState == nullptr) {
+            return false;
+        }
+        if (prefetchState == state) {
+            table.swap(prefetchTable);
+            prefetchState = nullptr;
+            return true;
+        }
+        /* The state was replaced after the hint */
+        stale.swap(prefetchTable);
+        prefetchState = nullptr;
+    }
+    reclaim_table(stale);
+    return false;
+}
+
+/* stop_prefetcher: Stop the thread and release the prefetched table */
+void FuseRamFs::stop_prefetcher() {
+    {
+        std::lock_guard<std::mutex> lk(prefetchMutex);
+        prefetchStopping = true;
+    }
+    prefetchCv.notify_all();
+    if (prefetchThread.joinable()) {
+        prefetchThread.join();
+    }
+    free_inodes(prefetchTable);
+    prefetchState = nullptr;
+}
+
+int FuseRamFs::restore(uint64_t key, bool keep) {
+    //std::cout << "Start Restore.\n";
+    /* Stored states are immutable, so the new inode table can be prepared
+     * before stopping other operations */
+    verifs2_state_ptr stored_states = find_state(key);
+    std::vector<Inode *> newfiles;
+    if (stored_states != nullptr && !take_prefetched(key, stored_states, newfiles)) {
+        prepare_table(stored_states, newfiles);
+    }
+
+    // Lock
+    std::unique_lock<std::shared_mutex> lk(crMutex);
+    int ret = _restore(key, keep, stored_states, newfiles);
+    lk.unlock();
+
+    // clear old Inodes, which are unreachable now
+    reclaim_table(newfiles);
+    wait_notifications();
+    return ret;
+}
+
+/* _restore: Restore the state with the given key.
+ * Caller must hold crMutex exclusively.
+ *
+ * @param stored_states The state found under key beforehand, if any.
+ * @param[in,out] newfiles The table prepared for it by prepare_table(). On
+ * return, the objects the caller has to free after unlocking.
+ */
+int FuseRamFs::_restore(uint64_t key, bool keep, verifs2_state_ptr stored_states,
+                        std::vector<Inode *> &newfiles) {
+    int ret = 0;
+    /* Wait for checkpoints that still take references on the live table */
+    std::unique_lock<std::shared_mutex> capturelk(captureRwSem);
+#ifdef DUMP_TESTING
+    ret = dump_inodes_verifs2(Inodes, DeletedInodes, "Before the restore():");
+
+    if (ret != 0){
+        return ret;
+    }
+#endif
+    if (Journal.active) {
+        if (Journal.key == key) {
+            ret = restore_journal();
+            if (ret == 0) {
+                set_current_state(key);
+            }
+            if (ret == 0 && keep) {
+                /* The live table matches the checkpoint again */
+                start_journal(key);
+            } else if (ret == 0) {
+                unlink_state(key);
+                drop_snapshots(key, key);
+            }
+            return ret;
+        }
+    }
+    /* The state may have been restored or replaced meanwhile */
+    if (find_state(key) != stored_states) {
+        reclaim_table(newfiles);
+        stored_states = find_state(key);
+        if (stored_states != nullptr && !take_prefetched(key, stored_states, newfiles)) {
+            prepare_table(stored_states, newfiles);
+        }
+    }
+
+    if (stored_states == nullptr) {
+        ret = -ENOENT;
+        std::cerr << "Not found state in state pool with key " << key << std::endl;
+        return ret;
+    }
+    if (Journal.active) {
+        /* Restoring another state discards the live table */
+        ret = flush_journal();
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    const std::queue<fuse_ino_t> &stored_DeletedInodes = stored_states->deleted_inodes;
+    const struct statvfs &stored_m_stbuf = stored_states->stbuf;
+
+    invalidate_changes(Inodes, newfiles);
+    /* The objects of the live table are never shared when modified, so
+     * only the slots holding other objects have changed */
+    for (fuse_ino_t ino = 0; hashValid && ino < std::max(Inodes.size(), newfiles.size()); ++ino) {
+        if (ino >= Inodes.size() || ino >= newfiles.size() || Inodes[ino] != newfiles[ino]) {
+            DirtyHash(ino);
+        }
+    }
+
+    // Restore DeletedInodes First
+    DeletedInodes = stored_DeletedInodes;
+    // Then restore m_stbuf
+    m_stbuf = stored_m_stbuf;
+
+    Inodes.swap(newfiles);
+    {
+        /* Keep the image alive so that checkpointing again before any
+         * modification can alias it */
+        std::lock_guard<std::mutex> cleanlk(cleanMutex);
+        cleanState = stored_states;
+        cleanGeneration = Inode::CurrentGeneration();
+        /* The next checkpoint only stores the changes to it */
+        if (!journalMode) {
+            liveParent = stored_states;
+        }
+    }
+    changedSlots.clear();
+    set_current_state(key);
+    if (!keep) {
+        ret = remove_state(key);
+        drop_snapshots(key, key);
+    }
+#ifdef DUMP_TESTING
+    ret = dump_inodes_verifs2(Inodes, DeletedInodes, "After the restore():");
+#endif
+    return ret;
+}
+
+/* drop_states: Discard the states with first <= key <= last.
+ *
+ * @return The number of states discarded, or -ENOENT if there was none.
+ */
+int FuseRamFs::drop_states(uint64_t first, uint64_t last) {
+    std::unique_lock<std::shared_mutex> lk(crMutex);
+    return _drop_states(first, last);
+}
+
+/* _drop_states: Like drop_states(); caller must hold crMutex exclusively,
+ * so that no view of the states is opened before they are all gone (see
+ * open_snapshot()).
+ */
+int FuseRamFs::_drop_states(uint64_t first, uint64_t last) {
+    size_t ndropped = 0;
+    if (Journal.active && Journal.key >= first && Journal.key <= last) {
+        unlink_state(Journal.key);
+        drop_journal();
+        ndropped++;
+    }
+    ndropped += remove_states(first, last);
+    drop_snapshots(first, last);
+
+    std::lock_guard<std::mutex> cleanlk(cleanMutex);
+    /* Do not keep a dropped image alive just for aliasing it */
+    if (cleanState != nullptr && cleanState.use_count() == 1) {
+        cleanState = nullptr;
+    }
+    return (ndropped > 0) ? (int) ndropped : -ENOENT;
+}
+
+/* run_batch: Run the commands of a batch in order under one acquisition
+ * of crMutex, recording the status of each. Unless VERIFS_BATCH_CONTINUE is
+ * set, the commands after a failed one are skipped.
+ *
+ * @return The number of commands that succeeded.
+ */
+int FuseRamFs::run_batch(struct verifs_batch *batch) {
+    if (batch->count > VERIFS_BATCH_MAX || (batch->flags & ~VERIFS_BATCH_CONTINUE)) {
+        return -EINVAL;
+    }
+    /* The objects replaced by restores are freed after unlocking */
+    std::vector<std::vector<Inode *>> replaced;
+    int nsucceeded = 0;
+    bool failed = false;
+
+    std::unique_lock<std::mutex> cplk(checkpointMutex, std::defer_lock);
+    if (!journalMode) {
+        cplk.lock();
+    }
+    std::unique_lock<std::shared_mutex> lk(crMutex);
+    for (uint32_t n = 0; n < batch->count; ++n) {
+        struct verifs_batch_cmd *cmd = &batch->cmds[n];
+        if (failed && !(batch->flags & VERIFS_BATCH_CONTINUE)) {
+            cmd->status = -ECANCELED;
+            continue;
+        }
+        switch (cmd->op) {
+            case VERIFS_BATCH_CHECKPOINT:
+                cmd->status = _checkpoint(cmd->key, nullptr);
+                break;
+
+            case VERIFS_BATCH_RESTORE:
+            case VERIFS_BATCH_RESTORE_KEEP:
+                replaced.emplace_back();
+                cmd->status = _restore(cmd->key, cmd->op == VERIFS_BATCH_RESTORE_KEEP,
+                                       nullptr, replaced.back());
+                break;
+
+            case VERIFS_BATCH_DROP:
+                cmd->status = _drop_states(cmd->key, cmd->key);
+                cmd->status = (cmd->status > 0) ? 0 : cmd->status;
+                break;
+
+            default:
+                cmd->status = -EINVAL;
+                break;
+        }
+        if (cmd->status == 0) {
+            nsucceeded++;
+        } else {
+            failed = true;
         }
     }
-    // insert state
-    ret = insert_state(key, std::make_tuple(copied_files, DeletedInodes, m_stbuf));
-    if (ret != 0) {
-        goto err;
+    lk.unlock();
+    if (cplk.owns_lock()) {
+        cplk.unlock();
     }
-#ifdef DUMP_TESTING
-    ret = dump_inodes_verifs2(Inodes, DeletedInodes, "During/After the checkpoint():");
-    if (ret != 0){
-        goto err;
+
+    for (auto &table : replaced) {
+        reclaim_table(table);
     }
-#endif
-    return ret;
-    err:
-    // clear copied_files vector
-    std::cerr << "Checkpointing went to error.\n";
-    free_inodes(copied_files);
-    return ret;
+    wait_notifications();
+    return nsucceeded;
 }
 
-void FuseRamFs::invalidate_kernel_states() {
-    for (auto &it : Inodes) {
-        if (it == nullptr) {
-            continue;
+/* list_states: List the stored states with keys >= list->start_key */
+int FuseRamFs::list_states(struct verifs_state_list *list) {
+    uint64_t start_key = list->start_key;
+    std::shared_lock<std::shared_mutex> lk(crMutex);
+    std::unordered_map<uint64_t, verifs2_state_ptr> pool = get_state_pool();
+    std::unordered_map<uint64_t, struct verifs_state_info> packed;
+    std::vector<uint64_t> keys;
+    for (auto &it : pool) {
+        if (it.first >= start_key) {
+            keys.push_back(it.first);
+        }
+    }
+    for (auto &info : get_packed_states()) {
+        if (info.key >= start_key) {
+            keys.push_back(info.key);
         }
-        /* Invalidate possible kernel inode cache */
-        // if m_markedForDeletion is false (the inode exists and is not marked as deleted)
-        if (!it->m_markedForDeletion) {
-            fuse_lowlevel_notify_inval_inode(ch, it->GetIno(), 0, 0);
-        }
-        /* Invalidate potential d-cache */
-        if (S_ISDIR(it->GetMode())) {
-            auto *parent_dir = dynamic_cast<Directory *>(it);
-            /* If parent_dir has child dir*/
-            for (auto &it_child : parent_dir->m_children) {
-                if (it_child.second > 0 && it_child.first != "." && it_child.first != "..") {
-                    fuse_lowlevel_notify_inval_entry(ch, it->GetIno(), (it_child.first).c_str(),
-                                                     (it_child.first).size());
+        packed[info.key] = info;
+    }
+    if (Journal.active && Journal.key >= start_key) {
+        keys.push_back(Journal.key);
+    }
+    std::sort(keys.begin(), keys.end());
+    /* A state may have been packed meanwhile */
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    memset(list, 0, sizeof(*list));
+    list->start_key = start_key;
+    list->total = num_states() + (Journal.active ? 1 : 0);
+    list->count = std::min(keys.size(), (size_t) VERIFS_LIST_MAX);
+    list->more = (keys.size() > list->count);
+    for (uint32_t n = 0; n < list->count; ++n) {
+        struct verifs_state_info *info = &list->states[n];
+        info->key = keys[n];
+        if (Journal.active && Journal.key == keys[n]) {
+            /* Only the saved objects belong to the journal. Operations
+             * running meanwhile save more of them under inodesRwSem. */
+            std::vector<Inode *> saved;
+            {
+                std::shared_lock<std::shared_mutex> readlk(inodesRwSem);
+                saved.reserve(Journal.old_inodes.size());
+                for (auto &it : Journal.old_inodes) {
+                    saved.push_back(it.second);
                 }
             }
+            info->flags = VERIFS_STATE_JOURNALED;
+            count_state(saved, info);
+        } else if (pool.count(keys[n]) == 0) {
+            *info = packed[keys[n]];
+        } else {
+            count_state(pool[keys[n]], info);
         }
+        info->parent = state_parent(keys[n]);
     }
+    return 0;
 }
 
-
-void FuseRamFs::check_restored_inode_size() {
-    for (auto it = Inodes.begin(); it != Inodes.end(); ++it) {
-        std::cout << "Order: " << std::distance(Inodes.begin(), it) << " - Inode Size: "
-                  << (*it)->m_fuseEntryParam.attr.st_size << std::endl;
+/* collect_states: Drop every state that is neither one of the roots nor
+ * an ancestor of one, in one batch.
+ *
+ * @return The number of states dropped.
+ */
+int FuseRamFs::collect_states(const uint64_t *roots, size_t nroots) {
+    /* A checkpoint inserts its state after releasing crMutex, but still
+     * under checkpointMutex (journaled ones are taken under crMutex), so
+     * no state can appear between marking and sweeping. No view of the
+     * dropped states may be opened until they are all gone either; see
+     * open_snapshot(). */
+    std::unique_lock<std::mutex> cplk(checkpointMutex, std::defer_lock);
+    if (!journalMode) {
+        cplk.lock();
     }
-}
-
-int FuseRamFs::restore(uint64_t key) {
-    //std::cout << "Start Restore.\n";
-    // Lock
     std::unique_lock<std::shared_mutex> lk(crMutex);
-    int ret = 0;
-#ifdef DUMP_TESTING
-    ret = dump_inodes_verifs2(Inodes, DeletedInodes, "Before the restore():");
-
-    if (ret != 0){
-        return ret;
+    std::unordered_set<uint64_t> live = reachable_states(roots, nroots);
+    std::vector<uint64_t> removed;
+    if (Journal.active && live.count(Journal.key) == 0) {
+        removed.push_back(Journal.key);
+        unlink_state(Journal.key);
+        drop_journal();
     }
-#endif
-    verifs2_state stored_states = find_state(key);
-
-    std::vector<Inode *> stored_files = std::get<0>(stored_states);
-    std::queue<fuse_ino_t> stored_DeletedInodes = std::get<1>(stored_states);
-    struct statvfs stored_m_stbuf = std::get<2>(stored_states);
-
-    if (stored_files.empty() && stored_DeletedInodes.empty()) {
-        ret = -ENOENT;
-        std::cerr << "Not found state in state pool with key " << key << std::endl;
-        return ret;
+    remove_unreachable_states(live, removed);
+    for (uint64_t key : removed) {
+        drop_snapshots(key, key);
+    }
+    lk.unlock();
+    if (cplk.owns_lock()) {
+        cplk.unlock();
     }
 
-    invalidate_kernel_states();
+    std::lock_guard<std::mutex> cleanlk(cleanMutex);
+    if (cleanState != nullptr && cleanState.use_count() == 1) {
+        cleanState = nullptr;
+    }
+    return (int) removed.size();
+}
 
-    // tmp_DeletedInodes stores the current DeletedInodes in case restoration failed
-    std::queue<fuse_ino_t> tmp_DeletedInodes = DeletedInodes;
-    // Restore DeletedInodes First
-    DeletedInodes = stored_DeletedInodes;
-    // Then restore m_stbuf
-    struct statvfs tmp_m_stbuf = m_stbuf;
-    m_stbuf = stored_m_stbuf;
+int FuseRamFs::get_stats(struct verifs_stats *stats) {
+    /* Count the memory of the retired tables as given back */
+    wait_reclaim();
+    std::shared_lock<std::shared_mutex> lk(crMutex);
+    memset(stats, 0, sizeof(*stats));
+    stats->num_states = num_states() + (Journal.active ? 1 : 0);
+    PageStore::GetStats(stats->unique_pages, stats->page_refs);
+    stats->page_size = Page::Size;
+    stats->spilled_states = num_spilled_states();
+    stats->compressed_states = num_compressed_states(stats->compressed_bytes);
+    stats->bytes_saved = (stats->page_refs - stats->unique_pages) * Page::Size;
+    if (stats->unique_pages > 0) {
+        stats->dedup_ratio_milli = stats->page_refs * 1000 / stats->unique_pages;
+    }
+    return 0;
+}
 
-    std::vector<Inode *> newfiles;
-    mode_t inode_mode;
+/* state_table: Get the inode table of the state with the given key. No
+ * references are taken on the inodes. Caller must hold crMutex exclusively.
+ *
+ * @param[out] state The stored state, which keeps the inodes of the table
+ * alive; nullptr for the journaled checkpoint, whose inodes are held by
+ * the live table and the journal.
+ * @return 0 on success, or -ENOENT if the state does not exist.
+ */
+int FuseRamFs::state_table(uint64_t key, std::vector<Inode *> &table, verifs2_state_ptr &state) {
+    if (Journal.active && Journal.key == key) {
+        /* Operations save objects into the journal under inodesRwSem */
+        std::shared_lock<std::shared_mutex> readlk(inodesRwSem);
+        table.assign(Inodes.begin(), Inodes.begin() + Journal.table_size);
+        for (auto &it : Journal.old_inodes) {
+            table[it.first] = it.second;
+        }
+        state = nullptr;
+        return 0;
+    }
+    state = find_state(key);
+    if (state == nullptr) {
+        return -ENOENT;
+    }
+    table = std::move(std::get<0>(materialize_state(state)));
+    return 0;
+}
 
-    File *file_inode_stored;
-    Directory *dir_inode_stored;
-    SpecialInode *special_inode_stored;
-    SymLink *symlink_inode_stored;
+/* hash_subtree: Merkle hash of the tree at ino in an inode table. A
+ * directory hashes its own digest, then the name, inode number and hash of
+ * each entry in name order. The hashes of the subtrees are kept in memo if
+ * given, and those found there are not computed again; the links hashed
+ * are recorded in links if given. Caller must hold crMutex exclusively.
+ */
+void FuseRamFs::hash_subtree(const std::vector<Inode *> &table, fuse_ino_t ino,
+                             unsigned int flags, unsigned char *out,
+                             std::unordered_map<fuse_ino_t, std::string> *memo,
+                             hash_links *links) {
+    Inode *inode = (ino < table.size()) ? table[ino] : nullptr;
+    if (inode == nullptr) {
+        memset(out, 0, VERIFS_HASH_SIZE);
+        return;
+    }
+    if (memo != nullptr) {
+        auto it = memo->find(ino);
+        if (it != memo->end()) {
+            memcpy(out, it->second.data(), VERIFS_HASH_SIZE);
+            return;
+        }
+    }
+    inode->Digest(flags, out);
+    if (S_ISDIR(inode->GetMode())) {
+        typedef std::pair<std::string, fuse_ino_t> entry;
+        std::vector<const entry *> children;
+        for (auto &child : dynamic_cast<Directory *>(inode)->m_children) {
+            if (child.first != "." && child.first != "..") {
+                children.push_back(&child);
+            }
+        }
+        std::sort(children.begin(), children.end(),
+                  [](const entry *a, const entry *b) { return a->first < b->first; });
 
-    for (auto &stored_file : stored_files) {
-        if (stored_file == nullptr) {
-            newfiles.push_back(nullptr);
-            continue;
+        EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+        if (ctx == nullptr) {
+            throw std::bad_alloc();
         }
-        inode_mode = stored_file->GetMode();
-        if (S_ISREG(inode_mode)) {
-            file_inode_stored = dynamic_cast<File *>(stored_file);
-            if (file_inode_stored == nullptr) {
-                ret = -EBADF;
-                goto err;
+        EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+        EVP_DigestUpdate(ctx, out, VERIFS_HASH_SIZE);
+        std::vector<fuse_ino_t> hashed;
+        for (auto child : children) {
+            unsigned char digest[VERIFS_HASH_SIZE];
+            try {
+                hash_subtree(table, child->second, flags, digest, memo, links);
+            } catch (...) {
+                EVP_MD_CTX_free(ctx);
+                throw;
             }
-            File *file_new = new File(*file_inode_stored);
-            newfiles.push_back((Inode *) file_new);
-        } else if (S_ISDIR(inode_mode)) {
-            dir_inode_stored = dynamic_cast<Directory *>(stored_file);
-            if (dir_inode_stored == nullptr) {
-                ret = -EBADF;
-                goto err;
+            size_t namelen = child->first.size();
+            EVP_DigestUpdate(ctx, &namelen, sizeof(namelen));
+            EVP_DigestUpdate(ctx, child->first.data(), namelen);
+            if (!(flags & VERIFS_HASH_NO_INO)) {
+                EVP_DigestUpdate(ctx, &child->second, sizeof(child->second));
             }
-            auto *dir_new = new Directory(*dir_inode_stored);
-            newfiles.push_back((Inode *) dir_new);
-        } else if (S_ISLNK(inode_mode)) {
-            symlink_inode_stored = dynamic_cast<SymLink *>(stored_file);
-            if (symlink_inode_stored == nullptr) {
-                ret = -EBADF;
-                goto err;
+            EVP_DigestUpdate(ctx, digest, sizeof(digest));
+            hashed.push_back(child->second);
+        }
+        EVP_DigestFinal_ex(ctx, out, nullptr);
+        EVP_MD_CTX_free(ctx);
+
+        if (links != nullptr) {
+            std::vector<fuse_ino_t> &old = links->children[ino];
+            for (auto child : old) {
+                auto it = links->parents.find(child);
+                if (it == links->parents.end()) {
+                    continue;
+                }
+                auto pos = std::find(it->second.begin(), it->second.end(), ino);
+                if (pos != it->second.end()) {
+                    it->second.erase(pos);
+                }
+                if (it->second.empty()) {
+                    links->parents.erase(it);
+                }
             }
-            auto *symlink_new = new SymLink(*symlink_inode_stored);
-            newfiles.push_back((Inode *) symlink_new);
-        } else {
-            special_inode_stored = dynamic_cast<SpecialInode *>(stored_file);
-            if (special_inode_stored == nullptr) {
-                ret = -EBADF;
-                goto err;
+            for (auto child : hashed) {
+                links->parents[child].push_back(ino);
             }
-            auto *special_inode_new = new SpecialInode(*special_inode_stored);
-            newfiles.push_back((Inode *) special_inode_new);
+            old.swap(hashed);
         }
     }
-    // clear old Inodes
-    free_inodes(Inodes);
-    Inodes.swap(newfiles);
-    free_inodes(stored_files);
-    std::vector<Inode *>().swap(stored_files);
-    ret = remove_state(key);
-#ifdef DUMP_TESTING
-    ret = dump_inodes_verifs2(Inodes, DeletedInodes, "After the restore():");
+    if (memo != nullptr) {
+        memo->insert({ino, std::string((const char *) out, VERIFS_HASH_SIZE)});
+    }
+}
 
-    if (ret != 0){
-        goto err;
+/* drop_hash: Drop the hashes of the live subtrees containing ino: its own,
+ * then those of the directories it was hashed under, up to the root. A
+ * subtree without a hash has none above it either, as every directory is
+ * hashed together with what it contains.
+ * Caller must hold crMutex exclusively.
+ */
+void FuseRamFs::drop_hash(fuse_ino_t ino) {
+    std::vector<fuse_ino_t> pending = {ino};
+    while (!pending.empty()) {
+        fuse_ino_t cur = pending.back();
+        pending.pop_back();
+        if (hashTree.erase(cur) == 0) {
+            continue;
+        }
+        auto it = hashLinks.parents.find(cur);
+        if (it != hashLinks.parents.end()) {
+            pending.insert(pending.end(), it->second.begin(), it->second.end());
+        }
     }
-#endif
+}
+
+/* fingerprint: Hash the whole image of the live file system, so that
+ * equal fingerprints mean that restoring either state gives the same file
+ * system: every slot of the inode table with the digest of its inode and
+ * the entries of a directory, then the deleted inodes and the free
+ * counts. Timestamps are left out, as revisiting a state never gives
+ * the same ones, and so are lookup counts.
+ * Caller must hold crMutex exclusively.
+ *
+ * @return The raw SHA-256 digest.
+ */
+std::string FuseRamFs::fingerprint() {
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (ctx == nullptr) {
+        throw std::bad_alloc();
+    }
+    EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+    size_t table_size = Inodes.size();
+    EVP_DigestUpdate(ctx, &table_size, sizeof(table_size));
+    for (auto &inode : Inodes) {
+        unsigned char digest[VERIFS_HASH_SIZE] = {};
+        if (inode != nullptr) {
+            inode->Digest(VERIFS_HASH_NO_TIMES, digest);
+        }
+        EVP_DigestUpdate(ctx, digest, sizeof(digest));
+        if (inode == nullptr || !S_ISDIR(inode->GetMode())) {
+            continue;
+        }
+        for (auto &child : dynamic_cast<Directory *>(inode)->m_children) {
+            size_t namelen = child.first.size();
+            EVP_DigestUpdate(ctx, &namelen, sizeof(namelen));
+            EVP_DigestUpdate(ctx, child.first.data(), namelen);
+            EVP_DigestUpdate(ctx, &child.second, sizeof(child.second));
+        }
+    }
+    std::queue<fuse_ino_t> deleted = DeletedInodes;
+    size_t num_deleted = deleted.size();
+    EVP_DigestUpdate(ctx, &num_deleted, sizeof(num_deleted));
+    for (; !deleted.empty(); deleted.pop()) {
+        EVP_DigestUpdate(ctx, &deleted.front(), sizeof(fuse_ino_t));
+    }
+    EVP_DigestUpdate(ctx, &m_stbuf.f_bfree, sizeof(m_stbuf.f_bfree));
+    EVP_DigestUpdate(ctx, &m_stbuf.f_ffree, sizeof(m_stbuf.f_ffree));
+    unsigned char digest[VERIFS_HASH_SIZE];
+    EVP_DigestFinal_ex(ctx, digest, nullptr);
+    EVP_MD_CTX_free(ctx);
+    return std::string((const char *) digest, sizeof(digest));
+}
+
+/* state_hash: Compute the abstract state hash of the live file system.
+ * Only the subtrees containing a slot changed since the last hash are
+ * hashed again, along the paths from the changed inodes to the root.
+ */
+int FuseRamFs::state_hash(struct verifs_state_hash *hash) {
+    uint32_t flags = hash->flags;
+    if (flags & ~(VERIFS_HASH_NO_TIMES | VERIFS_HASH_NO_INO)) {
+        return -EINVAL;
+    }
+    /* Stop modifications for a consistent hash */
+    std::unique_lock<std::shared_mutex> lk(crMutex);
+    std::unordered_set<fuse_ino_t> dirty;
+    {
+        std::lock_guard<std::mutex> dirtylk(hashMutex);
+        dirty.swap(hashDirty);
+    }
+    unsigned char root[VERIFS_HASH_SIZE];
+    try {
+        if (!hashValid || hashFlags != flags) {
+            hashTree.clear();
+            hashLinks = hash_links();
+            hashFlags = flags;
+            /* Record the changes from now on */
+            hashValid = true;
+        }
+        for (auto ino : dirty) {
+            drop_hash(ino);
+        }
+        hash_subtree(Inodes, FUSE_ROOT_ID, flags, root, &hashTree, &hashLinks);
+    } catch (const std::bad_alloc &e) {
+        hashValid = false;
+        return -ENOMEM;
+    }
+    memset(hash, 0, sizeof(*hash));
+    hash->flags = flags;
+    memcpy(hash->hash, root, sizeof(hash->hash));
     return 0;
-    err:
-    std::cerr << "Restoration went to error.\n";
-    free_inodes(newfiles);
-    std::vector<Inode *>().swap(newfiles);
-    DeletedInodes = tmp_DeletedInodes;
-    m_stbuf = tmp_m_stbuf;
-    return ret;
 }
 
 void FuseRamFs::FuseIoctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
                           struct fuse_file_info *fi, unsigned flags,
                           const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
     int ret;
-    switch (cmd) {
+    struct verifs_stats stats;
+    struct verifs_key_range range;
+    struct verifs_state_list list;
+    struct verifs_state_hash hash;
+    struct verifs_diff *diff = nullptr;
+    struct verifs_fileops *fileops = nullptr;
+    struct verifs_gc gc;
+    struct verifs_batch batch;
+    struct verifs_export *exp = nullptr;
+    const void *out_buf = nullptr;
+    size_t out_size = 0;
+
+    /* The other commands see the states of the pending checkpoints */
+    if ((unsigned int) cmd != VERIFS_CHECKPOINT_ASYNC && (unsigned int) cmd != VERIFS_PREFETCH) {
+        wait_checkpoints();
+    }
+
+    switch ((unsigned int) cmd) {
         case VERIFS_CHECKPOINT:
             ret = checkpoint((uint64_t) arg);
             break;
 
+        case VERIFS_CHECKPOINT_ASYNC:
+            ret = checkpoint_async((uint64_t) arg);
+            break;
+
         case VERIFS_RESTORE:
             ret = restore((uint64_t) arg);
             break;
@@ -369,16 +1755,152 @@ void FuseRamFs::FuseIoctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
             ret = load_verifs2();
             break;
 
+        case VERIFS_GET_STATS:
+            if (out_bufsz < sizeof(stats)) {
+                ret = -EINVAL;
+                break;
+            }
+            ret = get_stats(&stats);
+            out_buf = &stats;
+            out_size = sizeof(stats);
+            break;
+
+        case VERIFS_DROP:
+            ret = drop_states((uint64_t) arg, (uint64_t) arg);
+            ret = (ret > 0) ? 0 : ret;
+            break;
+
+        case VERIFS_DROP_RANGE:
+            if (in_bufsz < sizeof(range)) {
+                ret = -EINVAL;
+                break;
+            }
+            memcpy(&range, in_buf, sizeof(range));
+            ret = drop_states(range.first, range.last);
+            break;
+
+        case VERIFS_RESTORE_KEEP:
+            ret = restore((uint64_t) arg, true);
+            break;
+
+        case VERIFS_PREFETCH:
+            ret = prefetch((uint64_t) arg);
+            break;
+
+        case VERIFS_LIST:
+            if (in_bufsz < sizeof(list.start_key) || out_bufsz < sizeof(list)) {
+                ret = -EINVAL;
+                break;
+            }
+            memcpy(&list.start_key, in_buf, sizeof(list.start_key));
+            ret = list_states(&list);
+            out_buf = &list;
+            out_size = sizeof(list);
+            break;
+
+        case VERIFS_STATE_HASH:
+            if (in_bufsz < sizeof(hash.flags) || out_bufsz < sizeof(hash)) {
+                ret = -EINVAL;
+                break;
+            }
+            memcpy(&hash.flags, in_buf, sizeof(hash.flags));
+            ret = state_hash(&hash);
+            out_buf = &hash;
+            out_size = sizeof(hash);
+            break;
+
+        case VERIFS_GC:
+            if (in_bufsz < sizeof(struct verifs_gc)) {
+                ret = -EINVAL;
+                break;
+            }
+            memcpy(&gc, in_buf, sizeof(gc));
+            if (gc.num_roots > VERIFS_GC_MAX) {
+                ret = -EINVAL;
+                break;
+            }
+            ret = collect_states(gc.roots, gc.num_roots);
+            break;
+
+        case VERIFS_BATCH:
+            if (in_bufsz < sizeof(batch) || out_bufsz < sizeof(batch)) {
+                ret = -EINVAL;
+                break;
+            }
+            memcpy(&batch, in_buf, sizeof(batch));
+            ret = run_batch(&batch);
+            out_buf = &batch;
+            out_size = sizeof(batch);
+            break;
+
+        case VERIFS_FILEOPS:
+            if (in_bufsz < sizeof(struct verifs_fileops) ||
+                out_bufsz < offsetof(struct verifs_fileops, data)) {
+                ret = -EINVAL;
+                break;
+            }
+            /* Too large for the stack */
+            fileops = (struct verifs_fileops *) malloc(sizeof(struct verifs_fileops));
+            if (fileops == nullptr) {
+                ret = -ENOMEM;
+                break;
+            }
+            memcpy(fileops, in_buf, sizeof(struct verifs_fileops));
+            ret = run_fileops(req, ino, fileops);
+            /* The data is not sent back */
+            out_buf = fileops;
+            out_size = offsetof(struct verifs_fileops, data);
+            break;
+
+        case VERIFS_EXPORT:
+            if (in_bufsz < offsetof(struct verifs_export, data) ||
+                out_bufsz < sizeof(struct verifs_export)) {
+                ret = -EINVAL;
+                break;
+            }
+            /* Too large for the stack */
+            exp = (struct verifs_export *) calloc(1, sizeof(struct verifs_export));
+            if (exp == nullptr) {
+                ret = -ENOMEM;
+                break;
+            }
+            memcpy(exp, in_buf, offsetof(struct verifs_export, data));
+            ret = export_tree(exp);
+            out_buf = exp;
+            out_size = offsetof(struct verifs_export, data) + exp->length;
+            break;
+
+        case VERIFS_DIFF:
+            if (in_bufsz < offsetof(struct verifs_diff, count) ||
+                out_bufsz < sizeof(struct verifs_diff)) {
+                ret = -EINVAL;
+                break;
+            }
+            /* Too large for the stack */
+            diff = (struct verifs_diff *) calloc(1, sizeof(struct verifs_diff));
+            if (diff == nullptr) {
+                ret = -ENOMEM;
+                break;
+            }
+            memcpy(diff, in_buf, offsetof(struct verifs_diff, count));
+            ret = diff_states(diff);
+            out_buf = diff;
+            out_size = sizeof(struct verifs_diff);
+            break;
+
         default:
             std::cerr << "Function Not implemented in FuseIoctl.\n";
-            ret = ENOSYS;
+            ret = -ENOSYS;
             break;
     }
-    if (ret == 0) {
-        fuse_reply_ioctl(req, 0, nullptr, 0);
+    if (ret >= 0) {
+        fuse_reply_ioctl(req, ret, out_buf, out_size);
     } else {
         fuse_reply_err(req, -ret);
     }
+    free(diff);
+    free(fileops);
+    free(exp);
 }
 
 static inline mode_t get_umask() {
@@ -435,9 +1957,19 @@ void FuseRamFs::FuseInit(void *userdata, struct fuse_conn_info *conn) {
  */
 void FuseRamFs::FuseDestroy(void *userdata) {
     /* No need for locking because it's destruction of the file system */
-    for (auto const &inode: Inodes) {
-        delete inode;
-    }
+    stop_checkpointer();
+    drop_journal();
+    stop_prefetcher();
+    stop_reclaimer();
+    free_inodes(Inodes);
+    stop_compaction();
+    stop_notifier();
+    cleanState = nullptr;
+    liveParent = nullptr;
+    stop_state_compression();
+    clear_states();
+    drop_snapshots(0, UINT64_MAX);
+    WorkerPool::Shutdown();
 }
 
 
@@ -449,6 +1981,10 @@ void FuseRamFs::FuseDestroy(void *userdata) {
  @param name The name of the child to look up.
  */
 void FuseRamFs::FuseLookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    if (IsSnapshotIno(parent)) {
+        SnapshotLookup(req, parent, name);
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
     Inode *parentInode = GetInode(parent);
     if (parentInode == nullptr || parentInode->HasNoLinks()) {
@@ -464,11 +2000,18 @@ void FuseRamFs::FuseLookup(fuse_req_t req, fuse_ino_t parent, const char *name)
     }
 
     fuse_ino_t ino = dir->ChildInodeNumberWithName(string(name));
+    if (ino == INO_NOTFOUND && parent == FUSE_ROOT_ID && strcmp(name, VERIFS_SNAPSHOT_DIR) == 0) {
+        lk.unlock();
+        SnapshotLookup(req, parent, name);
+        return;
+    }
     if (ino == INO_NOTFOUND) {
         fuse_reply_err(req, ENOENT);
         return;
     }
 
+    /* The lookup count is not part of the state, so counting the lookup
+     * does not copy a shared inode */
     Inode *inode = GetInode(ino);
     /* Return ENOENT if this inode has been deleted */
     if (inode == nullptr || inode->HasNoLinks()) {
@@ -487,6 +2030,10 @@ void FuseRamFs::FuseLookup(fuse_req_t req, fuse_ino_t parent, const char *name)
  @param fi The file info (information about an open file).
  */
 void FuseRamFs::FuseGetAttr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (IsSnapshotIno(ino)) {
+        SnapshotGetAttr(req, ino);
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
     Inode *inode = GetInode(ino);
     /* return enoent if this inode has been deleted */
@@ -509,8 +2056,11 @@ void FuseRamFs::FuseGetAttr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_inf
  @param fi The file info (information about an open file).
  */
 void FuseRamFs::FuseSetAttr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    if (RejectSnapshotWrite(req, ino)) {
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
-    Inode *inode = GetInode(ino);
+    Inode *inode = GetInodeForWrite(ino);
     /* return enoent if this inode has been deleted */
     if (inode == nullptr || inode->HasNoLinks()) {
         fuse_reply_err(req, ENOENT);
@@ -532,7 +2082,7 @@ void FuseRamFs::FuseSetAttr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, i
         if (ret == 0) {
             file->ReplyAttr(req);
         } else {
-            fuse_reply_err(req, ret);
+            fuse_reply_err(req, -ret);
         }
         return;
     }
@@ -549,6 +2099,10 @@ void FuseRamFs::FuseSetAttr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, i
  @param fi The file info (information about an open file).
  */
 void FuseRamFs::FuseOpenDir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (IsSnapshotIno(ino)) {
+        SnapshotOpen(req, ino, fi, true);
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
     Inode *inode = GetInode(ino);
     /* return enoent if this inode has been deleted */
@@ -579,6 +2133,10 @@ void FuseRamFs::FuseOpenDir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_inf
  @param fi The file info (information about an open file).
  */
 void FuseRamFs::FuseReleaseDir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (IsSnapshotIno(ino)) {
+        fuse_reply_err(req, 0);
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
     Inode *inode = GetInode(ino);
     /* return enoent if this inode has been deleted */
@@ -612,6 +2170,10 @@ void FuseRamFs::FuseReleaseDir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_
  */
 void FuseRamFs::FuseReadDir(fuse_req_t req, fuse_ino_t ino, size_t size,
                             off_t off, struct fuse_file_info *fi) {
+    if (IsSnapshotIno(ino)) {
+        SnapshotReadDir(req, ino, size, off);
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
     (void) fi;
 
@@ -628,6 +2190,8 @@ void FuseRamFs::FuseReadDir(fuse_req_t req, fuse_ino_t ino, size_t size,
         return;
     }
 
+    /* The contexts are shared by all directories and handles */
+    std::lock_guard<std::mutex> readdirlk(Directory::readdirStatesMutex);
     Directory::ReadDirCtx *ctx;
     try {
         ctx = dir->PrepareReaddir(off);
@@ -694,8 +2258,9 @@ void FuseRamFs::FuseReadDir(fuse_req_t req, fuse_ino_t ino, size_t size,
                                         &stbuf,
                                         ++ctx->cookie);
         if (bytesAdded > bufSize) {
-            // Oops. There wasn't enough space for that last item. Back up and exit.
-            --(ctx->it);
+            // Oops. There wasn't enough space for that last item. Leave it
+            // for the next response and exit; the iterator still points at it.
+            --(ctx->cookie);
             bytesAdded = oldSize;
             break;
         } else {
@@ -710,6 +2275,10 @@ void FuseRamFs::FuseReadDir(fuse_req_t req, fuse_ino_t ino, size_t size,
 }
 
 void FuseRamFs::FuseOpen(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (IsSnapshotIno(ino)) {
+        SnapshotOpen(req, ino, fi, false);
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
     Inode *inode = GetInode(ino);
     /* return ENOENT if this inode has been deleted */
@@ -735,6 +2304,10 @@ void FuseRamFs::FuseOpen(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *
 }
 
 void FuseRamFs::FuseRelease(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (IsSnapshotIno(ino)) {
+        fuse_reply_err(req, 0);
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
     Inode *inode_p = GetInode(ino);
     /* return ENOENT if this inode has been deleted */
@@ -758,6 +2331,10 @@ void FuseRamFs::FuseRelease(fuse_req_t req, fuse_ino_t ino, struct fuse_file_inf
 }
 
 void FuseRamFs::FuseFsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    if (IsSnapshotIno(ino)) {
+        fuse_reply_err(req, 0);
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
     if (GetInode(ino) == nullptr) {
         fuse_reply_err(req, ENOENT);
@@ -768,6 +2345,10 @@ void FuseRamFs::FuseFsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct f
 }
 
 void FuseRamFs::FuseFsyncDir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    if (IsSnapshotIno(ino)) {
+        fuse_reply_err(req, 0);
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
     Inode *inode_p = GetInode(ino);
 
@@ -788,8 +2369,11 @@ void FuseRamFs::FuseFsyncDir(fuse_req_t req, fuse_ino_t ino, int datasync, struc
 
 void FuseRamFs::FuseMknod(fuse_req_t req, fuse_ino_t parent, const char *name,
                           mode_t mode, dev_t rdev) {
+    if (RejectSnapshotWrite(req, parent)) {
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
-    Inode *parentInode = GetInode(parent);
+    Inode *parentInode = GetInodeForWrite(parent);
     /* return ENOENT if this inode has been deleted */
     if (parentInode == nullptr || parentInode->HasNoLinks()) {
         fuse_reply_err(req, ENOENT);
@@ -897,7 +2481,7 @@ long FuseRamFs::do_create_node(Directory *parent, const char *name, mode_t mode,
     if (ret < 0) {
         FuseRamFs::UpdateUsedInodes(-1);
         FuseRamFs::UpdateUsedBlocks(new_node->UsedBlocks());
-        delete new_node;
+        /* Drops the new node as well */
         FuseRamFs::DeleteInode(ino);
         return ret;
     }
@@ -909,8 +2493,11 @@ long FuseRamFs::do_create_node(Directory *parent, const char *name, mode_t mode,
 }
 
 void FuseRamFs::FuseMkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    if (RejectSnapshotWrite(req, parent)) {
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
-    Inode *parentInode = GetInode(parent);
+    Inode *parentInode = GetInodeForWrite(parent);
     
     if (parentInode == nullptr || parentInode->HasNoLinks()) {
         fuse_reply_err(req, ENOENT);
@@ -951,8 +2538,11 @@ void FuseRamFs::FuseMkdir(fuse_req_t req, fuse_ino_t parent, const char *name, m
 }
 
 void FuseRamFs::FuseUnlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    if (RejectSnapshotWrite(req, parent)) {
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
-    Inode *parentInode = GetInode(parent);
+    Inode *parentInode = GetInodeForWrite(parent);
     /* return ENOENT if this inode has been deleted */
     if (parentInode == nullptr || parentInode->HasNoLinks()) {
         fuse_reply_err(req, ENOENT);
@@ -970,31 +2560,43 @@ void FuseRamFs::FuseUnlink(fuse_req_t req, fuse_ino_t parent, const char *name)
     //    else if ((fi->flags & 3) != O_RDONLY)
     //        fuse_reply_err(req, EACCES);
 
+    long ino = do_unlink(parentDir_p, name);
+    fuse_reply_err(req, (ino < 0) ? -ino : 0);
+}
+
+/* do_unlink: Remove a non-directory entry
+ *
+ * @return: The inode number of the removed entry, or a negative error code.
+ */
+long FuseRamFs::do_unlink(Directory *parent, const char *name) {
     // Return an error if the child doesn't exist.
-    fuse_ino_t ino = parentDir_p->ChildInodeNumberWithName(string(name));
+    fuse_ino_t ino = parent->ChildInodeNumberWithName(string(name));
     if (ino == INO_NOTFOUND) {
-        fuse_reply_err(req, ENOENT);
-        return;
+        return -ENOENT;
     }
 
-    // Point the name to the deleted block
-    parentDir_p->RemoveChild(string(name));
-
-    Inode *inode_p = GetInode(ino);
+    Inode *inode_p = GetInodeForWrite(ino);
     // TODO: Any way we can fail here? What if the inode doesn't exist? That probably indicates
     // a problem that happened earlier.
     assert(inode_p);
+    if (S_ISDIR(inode_p->GetMode())) {
+        return -EISDIR;
+    }
+
+    // Point the name to the deleted block
+    parent->RemoveChild(string(name));
 
     // Update the number of hardlinks in the target
     inode_p->DecrementLinkCount();
-
-    // Reply with no error. TODO: Where is ESUCCESS?
-    fuse_reply_err(req, 0);
+    return ino;
 }
 
 void FuseRamFs::FuseRmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    if (RejectSnapshotWrite(req, parent)) {
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
-    Inode *parentInode = GetInode(parent);
+    Inode *parentInode = GetInodeForWrite(parent);
     /* return ENOENT if this inode has been deleted */
     if (parentInode == nullptr || parentInode->HasNoLinks()) {
         fuse_reply_err(req, ENOENT);
@@ -1012,45 +2614,50 @@ void FuseRamFs::FuseRmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
     //    else if ((fi->flags & 3) != O_RDONLY)
     //        fuse_reply_err(req, EACCES);
 
+    long ino = do_rmdir(parentDir_p, name);
+    fuse_reply_err(req, (ino < 0) ? -ino : 0);
+}
+
+/* do_rmdir: Remove an empty directory
+ *
+ * @return: The inode number of the removed directory, or a negative error
+ *          code.
+ */
+long FuseRamFs::do_rmdir(Directory *parent, const char *name) {
     // Return an error if the child doesn't exist.
-    fuse_ino_t ino = parentDir_p->ChildInodeNumberWithName(string(name));
+    fuse_ino_t ino = parent->ChildInodeNumberWithName(string(name));
     if (ino == INO_NOTFOUND) {
-        fuse_reply_err(req, ENOENT);
-        return;
+        return -ENOENT;
     }
 
     /* Prevent removing '.': raise error if ino == parent */
-    if (ino == parent) {
-        fuse_reply_err(req, EINVAL);
-        return;
+    if (ino == parent->GetIno()) {
+        return -EINVAL;
     }
 
-    Inode *inode_p = GetInode(ino);
+    Inode *inode_p = GetInodeForWrite(ino);
     // TODO: Any way we can fail here? What if the inode doesn't exist? That probably indicates
     // a problem that happened earlier.
     if (inode_p == nullptr || (inode_p->HasNoLinks())) {
-        fuse_reply_err(req, ENOENT);
-        return;
+        return -ENOENT;
     }
 
     auto *dir_p = dynamic_cast<Directory *>(inode_p);
     if (dir_p == nullptr) {
         // Someone tried to rmdir on something that wasn't a directory.
-        fuse_reply_err(req, ENOTDIR);
-        return;
+        return -ENOTDIR;
     }
 
     /* Cannot remove if the directory is not empty */
     /* 2 is a base size: each dir contains at least '.' and '..' */
     /* This also prevents removing '..' */
     if (!dir_p->IsEmpty()) {
-        fuse_reply_err(req, ENOTEMPTY);
-        return;
+        return -ENOTEMPTY;
     }
 
-    parentDir_p->RemoveChild(name);
+    parent->RemoveChild(name);
     // Update the number of hardlinks in the parent dir
-    parentDir_p->DecrementLinkCount();
+    parent->DecrementLinkCount();
 
     // Remove the hard links to this dir so it can be cleaned up later
     // TODO: What if there's a real hardlink to this dir? Hardlinks to dirs allowed?
@@ -1058,12 +2665,14 @@ void FuseRamFs::FuseRmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
     while (dir_p->NumLinks() > 0) {
         dir_p->DecrementLinkCount();
     }
-
-    // Reply with no error. 
-    fuse_reply_err(req, 0);
+    return ino;
 }
 
 void FuseRamFs::FuseForget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    if (IsSnapshotIno(ino)) {
+        fuse_reply_none(req);
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
     Inode *inode_p = GetInode(ino);
 
@@ -1079,9 +2688,8 @@ void FuseRamFs::FuseForget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup
         {
             // Let's just delete this inode and free memory.
             size_t blocks_freed = inode_p->UsedBlocks();
-            delete inode_p;
-            /* Atomically erase the record in inodes table and
-             * push this ino to the DeletedInodes list */
+            /* Atomically erase the record in inodes table, drop the
+             * inode and push this ino to the DeletedInodes list */
             DeleteInode(ino);
             FuseRamFs::UpdateUsedInodes(-1);
             FuseRamFs::UpdateUsedBlocks(-blocks_freed);
@@ -1095,6 +2703,9 @@ void FuseRamFs::FuseForget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup
 
 void FuseRamFs::FuseWrite(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off,
                           struct fuse_file_info *fi) {
+    if (RejectSnapshotWrite(req, ino)) {
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
     // TODO: Fuse seems to have problems writing with a null (buf) buffer.
     if (buf == nullptr) {
@@ -1102,7 +2713,7 @@ void FuseRamFs::FuseWrite(fuse_req_t req, fuse_ino_t ino, const char *buf, size_
         return;
     }
 
-    Inode *inode_p = GetInode(ino);
+    Inode *inode_p = GetInodeForWrite(ino);
     if (inode_p == nullptr || inode_p->HasNoLinks()) {
         fuse_reply_err(req, ENOENT);
         return;
@@ -1120,7 +2731,12 @@ void FuseRamFs::FuseFlush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info
 
 
 void FuseRamFs::FuseRead(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    if (IsSnapshotIno(ino)) {
+        SnapshotRead(req, ino, size, off);
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
+    /* Reads only update the access time, which is not checkpointed */
     Inode *inode_p = GetInode(ino);
     
     if (inode_p == nullptr || inode_p->HasNoLinks()) {
@@ -1135,10 +2751,13 @@ void FuseRamFs::FuseRead(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
 
 void
 FuseRamFs::FuseRename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname) {
+    if (RejectSnapshotWrite(req, parent) || RejectSnapshotWrite(req, newparent)) {
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
     // Make sure the parents still exists.
-    Inode *parentInode = GetInode(parent);
-    Inode *newParentInode = GetInode(newparent);
+    Inode *parentInode = GetInodeForWrite(parent);
+    Inode *newParentInode = GetInodeForWrite(newparent);
 
     // Make sure it's not an already deleted inode
     if (parentInode == nullptr || parentInode->HasNoLinks()) {
@@ -1164,6 +2783,15 @@ FuseRamFs::FuseRename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_
         return;
     }
 
+    int ret = do_rename(parentDir, name, newParentDir, newname);
+    fuse_reply_err(req, -ret);
+}
+
+/* do_rename: Move an entry, replacing the destination if there is one
+ *
+ * @return: 0 on success, or a negative error code.
+ */
+int FuseRamFs::do_rename(Directory *parentDir, const char *name, Directory *newParentDir, const char *newname) {
     std::unique_lock<std::mutex> G(FuseRamFs::renameMutex, std::defer_lock);
     std::unique_lock<std::shared_mutex> L1(parentDir->DirLock(), std::defer_lock);
     std::unique_lock<std::shared_mutex> L2(newParentDir->DirLock(), std::defer_lock);
@@ -1177,19 +2805,18 @@ FuseRamFs::FuseRename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_
     fuse_ino_t srcIno = parentDir->ChildInodeNumberWithName(string(name));
     Inode *srcInode = GetInode(srcIno);
     if (srcInode == nullptr || (srcInode->HasNoLinks())) {
-        fuse_reply_err(req, ENOENT);
-        return;
+        return -ENOENT;
     }
 
     /* Lock directories */
     if (S_ISDIR(srcInode->GetMode())) {
-        if (parent == newparent) {
+        if (parentDir->GetIno() == newParentDir->GetIno()) {
             std::lock(G, L1);
         } else {
             std::lock(G, L1, L2);
         }
     } else {
-        if (parent == newparent) {
+        if (parentDir->GetIno() == newParentDir->GetIno()) {
             L1.lock();
         } else {
             std::lock(L1, L2);
@@ -1199,7 +2826,7 @@ FuseRamFs::FuseRename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_
     // Look for an existing child with the same name in the new parent
     // directory
     fuse_ino_t existingIno = newParentDir->_ChildInodeNumberWithName(string(newname));
-    Inode *existingInode = GetInode(existingIno);
+    Inode *existingInode = (existingIno != INO_NOTFOUND) ? GetInodeForWrite(existingIno) : nullptr;
 
     /* If the newname (or destination) already exists, rename() should replace
      * the destination with the source.
@@ -1210,8 +2837,7 @@ FuseRamFs::FuseRename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_
     if (existingInode != nullptr && (existingInode->NumLinks() > 0)) {
         /* src is directory but dest is not: return ENOTDIR */
         if (S_ISDIR(srcInode->GetMode()) && !S_ISDIR(existingInode->GetMode())) {
-            fuse_reply_err(req, ENOTDIR);
-            return;
+            return -ENOTDIR;
         }
         /* If dest is a non-empty directory, return ENOTEMPTY */
         if (S_ISDIR(existingInode->GetMode())) {
@@ -1220,15 +2846,13 @@ FuseRamFs::FuseRename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_
                something bad might have happened */
             assert(existingDir);
             if (!existingDir->IsEmpty()) {
-                fuse_reply_err(req, ENOTEMPTY);
-                return;
+                return -ENOTEMPTY;
             }
         }
         /* Vise versa: return EISDIR */
         // srcInode: naming; different bw srcIno
         if (!S_ISDIR(srcInode->GetMode()) && S_ISDIR(existingInode->GetMode())) {
-            fuse_reply_err(req, EISDIR);
-            return;
+            return -EISDIR;
         }
 
         /* For every links/regular files with the same inode number as the 
@@ -1255,7 +2879,6 @@ FuseRamFs::FuseRename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_
              * dir has been moved out */
             parentDir->DecrementLinkCount();
         }
-        fuse_reply_err(req, 0);
     } 
     else {
         /* If the destination does not exist */
@@ -1268,15 +2891,18 @@ FuseRamFs::FuseRename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_
             /* Increment one link for the new parent because of moving in */
             newParentDir->IncrementLinkCount();
         }
-        fuse_reply_err(req, 0);
     }
+    return 0;
 }
 
 void FuseRamFs::FuseLink(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) {
+    if (RejectSnapshotWrite(req, ino) || RejectSnapshotWrite(req, newparent)) {
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
     // Make sure the source inode and the parent exists.
-    Inode *parent = GetInode(newparent);
-    Inode *src = GetInode(ino);
+    Inode *parent = GetInodeForWrite(newparent);
+    Inode *src = GetInodeForWrite(ino);
     
     if (src == nullptr || (src->HasNoLinks())) {
         fuse_reply_err(req, ENOENT);
@@ -1319,8 +2945,11 @@ void FuseRamFs::FuseLink(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, c
 }
 
 void FuseRamFs::FuseSymlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name) {
+    if (RejectSnapshotWrite(req, parent)) {
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
-    Inode *parent_p = GetInode(parent);
+    Inode *parent_p = GetInodeForWrite(parent);
     
     if (parent_p == nullptr || (parent_p->HasNoLinks())) {
         fuse_reply_err(req, ENOENT);
@@ -1365,6 +2994,10 @@ void FuseRamFs::FuseSymlink(fuse_req_t req, const char *link, fuse_ino_t parent,
 }
 
 void FuseRamFs::FuseReadLink(fuse_req_t req, fuse_ino_t ino) {
+    if (IsSnapshotIno(ino)) {
+        SnapshotReadLink(req, ino);
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
     Inode *inode_p = GetInode(ino);
     
@@ -1404,8 +3037,11 @@ void
 FuseRamFs::FuseSetXAttr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags)
 #endif
 {
+    if (RejectSnapshotWrite(req, ino)) {
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
-    Inode *inode_p = GetInode(ino);
+    Inode *inode_p = GetInodeForWrite(ino);
     
     if (inode_p == nullptr || inode_p->HasNoLinks()) {
         fuse_reply_err(req, ENOENT);
@@ -1426,6 +3062,10 @@ void FuseRamFs::FuseGetXAttr(fuse_req_t req, fuse_ino_t ino, const char *name, s
 void FuseRamFs::FuseGetXAttr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
 #endif
 {
+    if (IsSnapshotIno(ino)) {
+        SnapshotGetXAttr(req, ino, name, size);
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
     Inode *inode_p = GetInode(ino);
     
@@ -1442,6 +3082,10 @@ void FuseRamFs::FuseGetXAttr(fuse_req_t req, fuse_ino_t ino, const char *name, s
 }
 
 void FuseRamFs::FuseListXAttr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+    if (IsSnapshotIno(ino)) {
+        SnapshotListXAttr(req, ino, size);
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
     Inode *inode_p = GetInode(ino);
 
@@ -1454,8 +3098,11 @@ void FuseRamFs::FuseListXAttr(fuse_req_t req, fuse_ino_t ino, size_t size) {
 }
 
 void FuseRamFs::FuseRemoveXAttr(fuse_req_t req, fuse_ino_t ino, const char *name) {
+    if (RejectSnapshotWrite(req, ino)) {
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
-    Inode *inode_p = GetInode(ino);
+    Inode *inode_p = GetInodeForWrite(ino);
     
     if (inode_p == nullptr || inode_p->HasNoLinks()) {
         fuse_reply_err(req, ENOENT);
@@ -1465,6 +3112,10 @@ void FuseRamFs::FuseRemoveXAttr(fuse_req_t req, fuse_ino_t ino, const char *name
 }
 
 void FuseRamFs::FuseAccess(fuse_req_t req, fuse_ino_t ino, int mask) {
+    if (IsSnapshotIno(ino)) {
+        SnapshotAccess(req, ino, mask);
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
     Inode *inode_p = GetInode(ino);
     
@@ -1479,8 +3130,11 @@ void FuseRamFs::FuseAccess(fuse_req_t req, fuse_ino_t ino, int mask) {
 
 void
 FuseRamFs::FuseCreate(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+    if (RejectSnapshotWrite(req, parent)) {
+        return;
+    }
     std::shared_lock<std::shared_mutex> lk(crMutex);
-    Inode *parent_p = GetInode(parent);
+    Inode *parent_p = GetInodeForWrite(parent);
     if (parent_p == nullptr || (parent_p->HasNoLinks())) {
         fuse_reply_err(req, ENOENT);
         return;
@@ -1520,6 +3174,7 @@ fuse_ino_t FuseRamFs::RegisterInode(Inode *inode_p, mode_t mode, nlink_t nlink,
     FuseRamFs::UpdateUsedInodes(1);
 
     inode_p->Initialize(ino, mode, nlink, gid, uid);
+    inode_p->m_fuseEntryParam.generation = ++lastFuseGeneration;
     FuseRamFs::UpdateUsedBlocks(inode_p->UsedBlocks());
     return ino;
 }
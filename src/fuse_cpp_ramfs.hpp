@@ -32,6 +32,41 @@
 
 class Directory;
 
+/* A read-only view of a stored state under /.snapshots (see snapshot.cpp) */
+struct snapshot_view {
+    uint64_t key;
+    /* Inode number of the view's root; the inodes of the view are numbered
+     * base + their inode number in the state */
+    fuse_ino_t base;
+    /* Keeps the inodes of the table alive. For the journaled checkpoint,
+     * which is not a stored state, the view holds a reference on each. */
+    verifs2_state_ptr state;
+    std::vector<Inode *> inodes;
+
+    ~snapshot_view() {
+        if (state == nullptr) {
+            for (auto &inode : inodes) {
+                Inode::PutRef(inode);
+            }
+        }
+    }
+};
+
+/* A VERIFS_CHECKPOINT_ASYNC request, owned by the caller waiting for it */
+struct async_checkpoint {
+    uint64_t key;
+    bool captured;      /* The caller may return */
+    int ret;
+};
+
+/* The links of a hashed tree (see FuseRamFs::hash_subtree()): the
+ * directories each inode was hashed under, and the inodes each directory
+ * was hashed with, so that a change can be carried up to the root */
+struct hash_links {
+    std::unordered_map<fuse_ino_t, std::vector<fuse_ino_t>> parents;
+    std::unordered_map<fuse_ino_t, std::vector<fuse_ino_t>> children;
+};
+
 class FuseRamFs {
 private:
     static const size_t kReadDirEntriesPerResponse = 255;
@@ -41,6 +76,8 @@ private:
     static const fsfilcnt_t kTotalInodes = 1048576;
     static const unsigned long kFilesystemId = 0xc13f944870434d8f;
     static const size_t kMaxFilenameLength = 1024;
+    /* Checkpoint chains longer than this are compacted into a new base */
+    static const unsigned int kMaxChainDepth = 64;
     
     static std::vector<Inode *> Inodes;
     static std::shared_mutex inodesRwSem;
@@ -49,6 +86,97 @@ private:
     static std::mutex deletedInodesMutex;
     static struct statvfs m_stbuf;
     static std::shared_mutex stbufMutex;
+    /* The stored state that the live file system is identical to, if
+     * any, and the modification generation at the time it matched */
+    static verifs2_state_ptr cleanState;
+    static uint64_t cleanGeneration;
+    static std::mutex cleanMutex;
+    /* Checkpoints still taking references on a captured inode table, and
+     * the inodes replaced meanwhile that must outlive them */
+    static std::shared_mutex captureRwSem;
+    static size_t activeCaptures;
+    static std::vector<Inode *> deferredInodes;
+    /* Undo journal mode; see struct undo_journal */
+    static bool journalMode;
+    static struct undo_journal Journal;
+    static uint64_t inodeEpoch;
+    /* The last FUSE generation number given to a new object, so that the
+     * kernel can tell it from an older one with the same inode number */
+    static std::atomic<uint64_t> lastFuseGeneration;
+    /* Alias checkpoints of states already stored (dedup_states) */
+    static bool dedupStates;
+    /* Delta checkpoints: the stored state the live table was last
+     * captured into or restored from, and the slots changed since */
+    static verifs2_state_ptr liveParent;
+    static std::unordered_set<fuse_ino_t> changedSlots;
+    static std::mutex checkpointMutex;
+    /* Background compaction of long checkpoint chains */
+    static std::thread compactThread;
+    static std::mutex compactMutex;
+    static std::condition_variable compactCv;
+    static verifs2_state_ptr compactPending;
+    static bool compactStopping;
+    /* Kernel cache invalidations, sent by the notifier thread in the order
+     * they were queued: an inode number with an empty name for the inode,
+     * or a directory and the name of an entry. An invalidation already
+     * waiting is not queued twice. */
+    static std::thread notifyThread;
+    static std::mutex notifyMutex;
+    static std::condition_variable notifyCv;
+    static std::deque<std::pair<fuse_ino_t, std::string>> notifyQueue;
+    static std::set<std::pair<fuse_ino_t, std::string>> notifyPending;
+    static uint64_t notifyQueued;
+    static uint64_t notifySent;
+    static bool notifyStopping;
+    /* Inode tables retired by restores, released in the background. Past
+     * kMaxReclaimBacklog waiting tables, the caller releases its own. */
+    static const size_t kMaxReclaimBacklog = 8;
+    static std::thread reclaimThread;
+    static std::mutex reclaimMutex;
+    static std::condition_variable reclaimCv;
+    static std::deque<std::vector<Inode *>> reclaimQueue;
+    static size_t reclaimBusy;
+    static bool reclaimStopping;
+    /* Restore prefetching: the prefetch thread prepares the table of
+     * prefetchKey for the hint numbered prefetchSeq. prefetchDone is the
+     * number of the last hint handled, and prefetchState the state its
+     * table was prepared from, if any. */
+    static std::thread prefetchThread;
+    static std::mutex prefetchMutex;
+    static std::condition_variable prefetchCv;
+    static uint64_t prefetchKey;
+    static uint64_t prefetchSeq;
+    static uint64_t prefetchDone;
+    static verifs2_state_ptr prefetchState;
+    static std::vector<Inode *> prefetchTable;
+    static bool prefetchStopping;
+    /* Asynchronous checkpoints, taken in order by the checkpoint thread */
+    static std::thread asyncThread;
+    static std::mutex asyncMutex;
+    static std::condition_variable asyncCv;
+    static std::deque<async_checkpoint *> asyncQueue;
+    static bool asyncBusy;
+    static bool asyncStopping;
+    /* The abstract state hash of the live file system: the hash of each
+     * subtree under hashFlags and the links they were hashed with, and the
+     * slots changed since, whose hashes and those of their ancestors are
+     * stale. The slots are only recorded while hashValid. */
+    static bool hashValid;
+    static uint32_t hashFlags;
+    static std::unordered_map<fuse_ino_t, std::string> hashTree;
+    static hash_links hashLinks;
+    static std::mutex hashMutex;
+    static std::unordered_set<fuse_ino_t> hashDirty;
+
+    /* Views of the stored states, by key and by id. The inode numbers of
+     * the views have the top bit set, then the id of the view in the next
+     * 31 bits; the /.snapshots directory itself is view 0. */
+    static const fuse_ino_t kSnapshotInoBit = 1ULL << 63;
+    static const fuse_ino_t kSnapshotDirIno = kSnapshotInoBit;
+    static std::map<uint64_t, std::shared_ptr<snapshot_view>> snapshotKeys;
+    static std::unordered_map<uint32_t, std::shared_ptr<snapshot_view>> snapshotViews;
+    static uint32_t nextSnapshotId;
+    static std::mutex snapshotMutex;
 
     static std::mutex renameMutex;
     
@@ -57,33 +185,165 @@ public:
     
 private:
     static long do_create_node(Directory *parent, const char *name, mode_t mode, dev_t dev, const struct fuse_ctx *ctx, const char *symlink = nullptr);
+    static long do_unlink(Directory *parent, const char *name);
+    static long do_rmdir(Directory *parent, const char *name);
+    static int do_rename(Directory *parentDir, const char *name, Directory *newParentDir, const char *newname);
     static fuse_ino_t RegisterInode(Inode *inode_p, mode_t mode, nlink_t nlink, gid_t gid, uid_t uid);
     static fuse_ino_t NextInode();
-    static int checkpoint(uint64_t key);
+    static int checkpoint(uint64_t key, const std::function<void()> *captured = nullptr);
+    static int _checkpoint(uint64_t key, std::unique_lock<std::shared_mutex> *lk,
+                           const std::function<void()> *captured = nullptr);
+    static int checkpoint_async(uint64_t key);
+    static void checkpoint_worker();
+    static void wait_checkpoints();
+    static void stop_checkpointer();
+    static void end_capture();
+    static void request_compaction(const verifs2_state_ptr &state);
+    static void compact_worker();
+    static void stop_compaction();
     static void invalidate_kernel_states();
-    static int restore(uint64_t key);
+    static int prefetch(uint64_t key);
+    static void prefetch_worker();
+    static bool take_prefetched(uint64_t key, const verifs2_state_ptr &state,
+                                std::vector<Inode *> &table);
+    static void stop_prefetcher();
+    static int restore(uint64_t key, bool keep = false);
+    static int _restore(uint64_t key, bool keep, verifs2_state_ptr stored_states,
+                        std::vector<Inode *> &newfiles);
+    static int restore_journal();
+    static void start_journal(uint64_t key);
+    static int flush_journal();
+    static void drop_journal();
+    static void invalidate_inode(Inode *inode);
+    static void queue_invalidation(fuse_ino_t ino, const std::string &name = std::string());
+    static void notify_worker();
+    static void wait_notifications();
+    static void stop_notifier();
+    static void reclaim_table(std::vector<Inode *> &table);
+    static void reclaim_worker();
+    static void wait_reclaim();
+    static void stop_reclaimer();
+    static void invalidate_changes(const std::vector<Inode *> &from, const std::vector<Inode *> &to);
+    static int drop_states(uint64_t first, uint64_t last);
+    static int _drop_states(uint64_t first, uint64_t last);
+    static int run_batch(struct verifs_batch *batch);
+    static long resolve_path(const struct fuse_ctx *ctx, fuse_ino_t dir, const char *path,
+                             std::string *leaf);
+    static void reclaim_inode(fuse_ino_t ino);
+    static int do_fileop(const struct fuse_ctx *ctx, fuse_ino_t dir,
+                         const struct verifs_fileops *ops, const struct verifs_fileop *op,
+                         std::vector<std::pair<fuse_ino_t, std::string>> &entries,
+                         std::vector<fuse_ino_t> &inodes);
+    static int run_fileops(fuse_req_t req, fuse_ino_t ino, struct verifs_fileops *ops);
+    static int list_states(struct verifs_state_list *list);
+    static int collect_states(const uint64_t *roots, size_t nroots);
+    static int get_stats(struct verifs_stats *stats);
+    static int state_table(uint64_t key, std::vector<Inode *> &table, verifs2_state_ptr &state);
+    static int state_hash(struct verifs_state_hash *hash);
+    static void hash_subtree(const std::vector<Inode *> &table, fuse_ino_t ino,
+                             unsigned int flags, unsigned char *out,
+                             std::unordered_map<fuse_ino_t, std::string> *memo = nullptr,
+                             hash_links *links = nullptr);
+    static void drop_hash(fuse_ino_t ino);
+    static int diff_states(struct verifs_diff *diff);
+    static int export_tree(struct verifs_export *exp);
+    static int read_export(struct verifs_export *exp);
+    static bool IsSnapshotIno(fuse_ino_t ino) { return (ino & kSnapshotInoBit) != 0; }
+    static std::shared_ptr<snapshot_view> find_snapshot(fuse_ino_t ino, Inode *&inode);
+    static std::shared_ptr<snapshot_view> open_snapshot(uint64_t key);
+    static void drop_snapshots(uint64_t first, uint64_t last);
+    static bool RejectSnapshotWrite(fuse_req_t req, fuse_ino_t ino);
+    static void SnapshotLookup(fuse_req_t req, fuse_ino_t parent, const char *name);
+    static void SnapshotGetAttr(fuse_req_t req, fuse_ino_t ino);
+    static void SnapshotOpen(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, bool dir);
+    static void SnapshotReadDir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off);
+    static void SnapshotRead(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off);
+    static void SnapshotReadLink(fuse_req_t req, fuse_ino_t ino);
+    static void SnapshotGetXAttr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size);
+    static void SnapshotListXAttr(fuse_req_t req, fuse_ino_t ino, size_t size);
+    static void SnapshotAccess(fuse_req_t req, fuse_ino_t ino, int mask);
+    static std::string fingerprint();
     static void check_restored_inode_size();
     static int pickle_verifs2(void);
     static int load_verifs2(void);
 
+    /* Save the object in a slot of the inode table into the undo journal
+     * before the slot is changed for the first time since the journaled
+     * checkpoint. The journal takes over the table's reference then.
+     * Caller must hold inodesRwSem exclusively.
+     *
+     * @return true if the object was saved, false if the caller still has
+     * to drop the table's reference.
+     */
+    static bool JournalSlot(fuse_ino_t ino) {
+        if (!Journal.active || ino >= Journal.table_size) {
+            return false;
+        }
+        return Journal.old_inodes.insert({ino, Inodes[ino]}).second;
+    }
+
+    /* Record a changed slot of the inode table for the next delta
+     * checkpoint. Caller must hold inodesRwSem exclusively. */
+    static void ChangeSlot(fuse_ino_t ino) {
+        if (!journalMode) {
+            changedSlots.insert(ino);
+        }
+    }
+
+    /* Record a changed slot of the inode table for the next state hash.
+     * Caller must hold crMutex. */
+    static void DirtyHash(fuse_ino_t ino) {
+        if (hashValid) {
+            std::lock_guard<std::mutex> lk(hashMutex);
+            hashDirty.insert(ino);
+        }
+    }
+
+    /* Drop the table's reference on an object removed from the inode
+     * table, unless a checkpoint has yet to take its own reference on it.
+     * Caller must hold inodesRwSem exclusively.
+     */
+    static void ReleaseInode(Inode *inode) {
+        if (activeCaptures > 0) {
+            deferredInodes.push_back(inode);
+        } else {
+            Inode::PutRef(inode);
+        }
+    }
+
     /* Atomic inode table operations */
     static void DeleteInode(fuse_ino_t ino) {
         std::unique_lock<std::shared_mutex> L1(inodesRwSem, std::defer_lock);
         std::unique_lock<std::mutex> L2(deletedInodesMutex, std::defer_lock);
         std::lock(L1, L2);
+        if (!JournalSlot(ino)) {
+            ReleaseInode(Inodes[ino]);
+        }
         Inodes[ino] = nullptr;
+        ChangeSlot(ino);
+        DirtyHash(ino);
         DeletedInodes.push(ino);
+        Inode::NewGeneration();
     }
 
     static fuse_ino_t AddInode(Inode *inode) {
         std::unique_lock<std::shared_mutex> writelk(inodesRwSem);
+        inode->m_epoch = inodeEpoch;
         Inodes.push_back(inode);
+        ChangeSlot(Inodes.size() - 1);
+        DirtyHash(Inodes.size() - 1);
         return Inodes.size() - 1;
     }
 
     static void UpdateInode(fuse_ino_t ino, Inode *newInode) {
         std::unique_lock<std::shared_mutex> writelk(inodesRwSem);
+        if (!JournalSlot(ino)) {
+            ReleaseInode(Inodes[ino]);
+        }
+        newInode->m_epoch = inodeEpoch;
         Inodes[ino] = newInode;
+        ChangeSlot(ino);
+        DirtyHash(ino);
     }
 
     static fuse_ino_t PopOneDeletedInode() {
@@ -94,7 +354,8 @@ private:
     }
     
 public:
-    FuseRamFs(fsblkcnt_t blocks = 0, fsfilcnt_t inodes = 0);
+    FuseRamFs(fsblkcnt_t blocks = 0, fsfilcnt_t inodes = 0, bool undo_journal = false,
+              bool dedup_states = false);
     ~FuseRamFs();
     
     static void FuseInit(void *userdata, struct fuse_conn_info *conn);
@@ -168,6 +429,9 @@ public:
         }
     }
 
+    /* Like GetInode(), but for callers that modify the inode */
+    static Inode *GetInodeForWrite(fuse_ino_t ino);
+
     /* Check if the file system can handle the increased size */
     static bool CheckHasSpaceFor(Inode *inode, ssize_t incSize) {
         if (incSize <= 0) {
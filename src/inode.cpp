@@ -24,12 +24,34 @@
 
 #include "common.h"
 
+#include <memory_resource>
+#include <openssl/evp.h>
+
 #include "util.hpp"
 #include "inode.hpp"
 
 using namespace std;
 
-Inode::~Inode() {}
+std::atomic<uint64_t> Inode::s_generation(0);
+
+Inode::~Inode() {
+    ClearXAttrs();
+}
+
+/* Never destroyed, as inodes may outlive static destruction */
+static std::pmr::synchronized_pool_resource &inode_pool() {
+    static std::pmr::synchronized_pool_resource *pool =
+        new std::pmr::synchronized_pool_resource();
+    return *pool;
+}
+
+void *Inode::operator new(size_t size) {
+    return inode_pool().allocate(size);
+}
+
+void Inode::operator delete(void *ptr, size_t size) {
+    inode_pool().deallocate(ptr, size);
+}
 
 /** Fix until FUSE 3 is available on all platforms. */
 #ifndef FUSE_SET_ATTR_CTIME
@@ -55,6 +77,7 @@ int Inode::ReplyAttr(fuse_req_t req) {
 
 int Inode::ReplySetAttr(fuse_req_t req, struct stat *attr, int to_set) {
     std::unique_lock<std::shared_mutex> lk(entryRwSem);
+    MarkDirty();
     if (to_set & FUSE_SET_ATTR_MODE) {
         m_fuseEntryParam.attr.st_mode = attr->st_mode;
     }
@@ -127,18 +150,22 @@ void Inode::Forget(fuse_req_t req, unsigned long nlookup) {
 
 int Inode::SetXAttrAndReply(fuse_req_t req, const string &name, const void *value, size_t size, int flags,
                             uint32_t position) {
+    return fuse_reply_err(req, -SetXAttr(name, value, size, flags, position));
+}
+
+int Inode::SetXAttr(const string &name, const void *value, size_t size, int flags, uint32_t position) {
     std::unique_lock<std::shared_mutex> lk(xattrRwSem);
     if (m_xattr.find(name) != m_xattr.end()) {
         if (flags & XATTR_CREATE) {
-            return fuse_reply_err(req, EEXIST);
+            return -EEXIST;
         }
     }
     else {
         if (flags & XATTR_REPLACE) {
 #ifdef __APPLE__
-            return fuse_reply_err(req, ENOATTR);
+            return -ENOATTR;
 #else
-            return fuse_reply_err(req, ENODATA);
+            return -ENODATA;
 #endif
         }
     }
@@ -150,7 +177,7 @@ int Inode::SetXAttrAndReply(fuse_req_t req, const string &name, const void *valu
     if (m_xattr[name].second < newExtent) {
         void *newBuf = realloc(m_xattr[name].first, newExtent);
         if (newBuf == NULL) {
-            return fuse_reply_err(req, E2BIG);
+            return -E2BIG;
         }
 
         m_xattr[name].first = newBuf;
@@ -162,8 +189,9 @@ int Inode::SetXAttrAndReply(fuse_req_t req, const string &name, const void *valu
 
     // Copy the data.
     memcpy((char *) m_xattr[name].first + position, value, size);
+    MarkDirty();
 
-    return fuse_reply_err(req, 0);
+    return 0;
 }
 
 int Inode::GetXAttrAndReply(fuse_req_t req, const string &name, size_t size, uint32_t position) {
@@ -240,21 +268,28 @@ int Inode::RemoveXAttrAndReply(fuse_req_t req, const string &name) {
 #endif
     }
 
+    free(it->second.first);
     m_xattr.erase(it);
+    MarkDirty();
 
     return fuse_reply_err(req, 0);
 }
 
-int Inode::ReplyAccess(fuse_req_t req, int mask, gid_t gid, uid_t uid) {
+/* CheckAccess: Whether a user may access the inode as asked by mask
+ * (R_OK, W_OK, X_OK or F_OK), as ReplyAccess() answers access(2).
+ *
+ * @return: 0 if access is allowed, EACCES otherwise.
+ */
+int Inode::CheckAccess(int mask, gid_t gid, uid_t uid) {
     // If all the user wanted was to know if the file existed, it does.
     if (mask == F_OK) {
-        return fuse_reply_err(req, 0);
+        return 0;
     }
 
     std::shared_lock<std::shared_mutex> lk(entryRwSem);
     // Check other
     if ((m_fuseEntryParam.attr.st_mode & mask) == mask) {
-        return fuse_reply_err(req, 0);
+        return 0;
     }
     mask <<= 3;
 
@@ -262,7 +297,7 @@ int Inode::ReplyAccess(fuse_req_t req, int mask, gid_t gid, uid_t uid) {
     if ((m_fuseEntryParam.attr.st_mode & mask) == mask) {
         // Go ahead if the user's main group is the same as the file's
         if (gid == m_fuseEntryParam.attr.st_gid) {
-            return fuse_reply_err(req, 0);
+            return 0;
         }
 
         // Now check the user's other groups. TODO: Where is this function?! not on this version of FUSE?
@@ -273,10 +308,14 @@ int Inode::ReplyAccess(fuse_req_t req, int mask, gid_t gid, uid_t uid) {
 
     // Check owner.
     if ((uid == m_fuseEntryParam.attr.st_uid) && (m_fuseEntryParam.attr.st_mode & mask) == mask) {
-        return fuse_reply_err(req, 0);
+        return 0;
     }
 
-    return fuse_reply_err(req, EACCES);
+    return EACCES;
+}
+
+int Inode::ReplyAccess(fuse_req_t req, int mask, gid_t gid, uid_t uid) {
+    return fuse_reply_err(req, CheckAccess(mask, gid, uid));
 }
 
 void Inode::Initialize(fuse_ino_t ino, mode_t mode, nlink_t nlink, gid_t gid, uid_t uid) {
@@ -311,6 +350,61 @@ void Inode::Initialize(fuse_ino_t ino, mode_t mode, nlink_t nlink, gid_t gid, ui
     m_fuseEntryParam.attr.st_ctim = ts;
     m_fuseEntryParam.attr.st_mtim = ts;
 #endif
+    MarkDirty();
+}
+
+void Inode::Digest(unsigned int flags, unsigned char *out) {
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (ctx == nullptr) {
+        throw std::bad_alloc();
+    }
+    auto feed = [ctx](const void *data, size_t len) {
+        EVP_DigestUpdate(ctx, data, len);
+    };
+    if (!m_digestValid || m_digestGeneration != m_generation) {
+        EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+        size_t num_xattrs = m_xattr.size();
+        feed(&num_xattrs, sizeof(num_xattrs));
+        for (auto &it : m_xattr) {
+            size_t keysize = it.first.size();
+            feed(&keysize, sizeof(keysize));
+            feed(it.first.data(), keysize);
+            feed(&it.second.second, sizeof(it.second.second));
+            feed(it.second.first, it.second.second);
+        }
+        HashContent(feed);
+        unsigned char digest[VERIFS_HASH_SIZE];
+        EVP_DigestFinal_ex(ctx, digest, nullptr);
+        std::unique_lock<std::shared_mutex> lk(entryRwSem);
+        memcpy(m_contentDigest, digest, sizeof(m_contentDigest));
+        m_digestGeneration = m_generation;
+        m_digestValid = true;
+    }
+
+    /* Fields one by one, as struct stat has padding */
+    const struct stat &attr = m_fuseEntryParam.attr;
+    EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+    feed(&attr.st_mode, sizeof(attr.st_mode));
+    feed(&attr.st_nlink, sizeof(attr.st_nlink));
+    feed(&attr.st_uid, sizeof(attr.st_uid));
+    feed(&attr.st_gid, sizeof(attr.st_gid));
+    feed(&attr.st_size, sizeof(attr.st_size));
+    feed(&attr.st_rdev, sizeof(attr.st_rdev));
+    if (!(flags & VERIFS_HASH_NO_TIMES)) {
+#ifdef __APPLE__
+        feed(&attr.st_mtimespec, sizeof(attr.st_mtimespec));
+        feed(&attr.st_ctimespec, sizeof(attr.st_ctimespec));
+#else
+        feed(&attr.st_mtim, sizeof(attr.st_mtim));
+        feed(&attr.st_ctim, sizeof(attr.st_ctim));
+#endif
+    }
+    if (!(flags & VERIFS_HASH_NO_INO)) {
+        feed(&attr.st_ino, sizeof(attr.st_ino));
+    }
+    feed(m_contentDigest, sizeof(m_contentDigest));
+    EVP_DigestFinal_ex(ctx, out, nullptr);
+    EVP_MD_CTX_free(ctx);
 }
 
 size_t Inode::GetPickledSize() {
@@ -344,7 +438,11 @@ size_t Inode::Pickle(void *&buf) {
     memcpy(ptr, &nlookup, sizeof(nlookup));
     ptr += sizeof(nlookup);
     // struct fuse_entry_param m_fuseEntryParam;
-    memcpy(ptr, &m_fuseEntryParam, sizeof(m_fuseEntryParam));
+    {
+        /* The access time of a shared object may change meanwhile */
+        std::shared_lock<std::shared_mutex> lk(entryRwSem);
+        memcpy(ptr, &m_fuseEntryParam, sizeof(m_fuseEntryParam));
+    }
     ptr += sizeof(m_fuseEntryParam);
     // how many xattrs are there
     size_t num_xattrs = m_xattr.size();
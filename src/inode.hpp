@@ -25,15 +25,31 @@
 #define inode_hpp
 
 #include "common.h"
+#include "cr.h"
 
 class Inode {
 private:    
     bool m_markedForDeletion;
     std::atomic_ulong m_nlookup;
+    /* Number of inode tables (the live one and checkpointed states) that
+     * hold this object. Shared objects must not be modified in place. */
+    std::atomic_ulong m_refcount;
+    /* Generation of the last modification to this inode */
+    std::atomic<uint64_t> m_generation;
+    static std::atomic<uint64_t> s_generation;
+    /* Checkpoint epoch in which this object entered the live table; used
+     * by FuseRamFs to tell objects of the journaled checkpoint apart */
+    uint64_t m_epoch;
+    /* Cached digest of the xattrs and contents, valid while the inode is
+     * at generation m_digestGeneration. Written under entryRwSem, as the
+     * object may be copied while a checkpoint is taken. */
+    bool m_digestValid;
+    uint64_t m_digestGeneration;
+    unsigned char m_contentDigest[VERIFS_HASH_SIZE];
 
 protected:
     struct fuse_entry_param m_fuseEntryParam;
-    std::shared_mutex entryRwSem;
+    mutable std::shared_mutex entryRwSem;
     std::map<std::string, std::pair<void *, size_t> > m_xattr;
     std::shared_mutex xattrRwSem;
 
@@ -50,17 +66,47 @@ public:
 public:
     Inode() :
     m_markedForDeletion(false),
-    m_nlookup(0)
+    m_nlookup(0),
+    m_refcount(1),
+    m_generation(0),
+    m_epoch(0),
+    m_digestValid(false),
+    m_digestGeneration(0)
     {}
 
-    Inode(const Inode &src) {
+    Inode(const Inode &src) : m_refcount(1), m_generation(src.m_generation.load()), m_epoch(0),
+    m_digestValid(false), m_digestGeneration(0) {
       m_markedForDeletion = src.m_markedForDeletion;
       m_nlookup.store(src.m_nlookup.load());
-      m_fuseEntryParam = src.m_fuseEntryParam;
-      m_xattr = src.m_xattr;
+      {
+          /* The access time of a shared object may change meanwhile, and
+           * Digest() publishes the cached digest under the same lock */
+          std::shared_lock<std::shared_mutex> lk(src.entryRwSem);
+          m_fuseEntryParam = src.m_fuseEntryParam;
+          m_digestValid = src.m_digestValid;
+          m_digestGeneration = src.m_digestGeneration;
+          memcpy(m_contentDigest, src.m_contentDigest, sizeof(m_contentDigest));
+      }
+      /* xattr values are owned by each copy */
+      for (auto &it : src.m_xattr) {
+          void *value = malloc(it.second.second);
+          if (value == nullptr && it.second.second > 0) {
+              std::cerr << "malloc failed for Inode copy constructor\n";
+              exit(EXIT_FAILURE);
+          }
+          if (it.second.second > 0) {
+              memcpy(value, it.second.first, it.second.second);
+          }
+          m_xattr.insert({it.first, {value, it.second.second}});
+      }
     }
 
     virtual ~Inode() = 0;
+
+    /* Inodes of all types come from a shared pool, which keeps the many
+     * small allocations of checkpoints and restores off the heap */
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr, size_t size);
     
     virtual int WriteAndReply(fuse_req_t req, const char *buf, size_t size, off_t off) = 0;
     virtual int ReadAndReply(fuse_req_t req, size_t size, off_t off) = 0;
@@ -73,19 +119,24 @@ public:
     void Forget(fuse_req_t req, unsigned long nlookup);
     virtual void Initialize(fuse_ino_t ino, mode_t mode, nlink_t nlink, gid_t gid, uid_t uid);
     virtual int SetXAttrAndReply(fuse_req_t req, const std::string &name, const void *value, size_t size, int flags, uint32_t position);
+    /* Like SetXAttrAndReply(), but returns 0 or -errno */
+    int SetXAttr(const std::string &name, const void *value, size_t size, int flags, uint32_t position);
     virtual int GetXAttrAndReply(fuse_req_t req, const std::string &name, size_t size, uint32_t position);
     virtual int ListXAttrAndReply(fuse_req_t req, size_t size);
     virtual int RemoveXAttrAndReply(fuse_req_t req, const std::string &name);
+    int CheckAccess(int mask, gid_t gid, uid_t uid);
     virtual int ReplyAccess(fuse_req_t req, int mask, gid_t gid, uid_t uid);
     
     /* Atomic file attribute operations */
     void IncrementLinkCount() {
         std::unique_lock<std::shared_mutex> lk(entryRwSem);
         m_fuseEntryParam.attr.st_nlink++;
+        MarkDirty();
     }
     void DecrementLinkCount() {
         std::unique_lock<std::shared_mutex> lk(entryRwSem);
         m_fuseEntryParam.attr.st_nlink--;
+        MarkDirty();
     }
     int NumLinks() {
         std::shared_lock<std::shared_mutex> lk(entryRwSem);
@@ -115,11 +166,53 @@ public:
         std::shared_lock<std::shared_mutex> lk(entryRwSem);
         return m_fuseEntryParam.attr.st_mode;
     }
+    uid_t GetUid() {
+        std::shared_lock<std::shared_mutex> lk(entryRwSem);
+        return m_fuseEntryParam.attr.st_uid;
+    }
     /* We assume that attr.st_ino won't change */
     fuse_ino_t GetIno() { return m_fuseEntryParam.attr.st_ino; }
     
     bool Forgotten() { return m_nlookup == 0; }
 
+    /* Copy-on-write reference counting. A checkpoint shares the inode
+     * objects of the live table instead of copying them, so an object
+     * that IsShared() is immutable and the live table has to replace it
+     * with a private copy before modifying it. The lookup count and the
+     * access time are the exceptions: they are not part of the stored
+     * state, and reads and lookups update them in place. */
+    void GetRef() { m_refcount++; }
+    static void PutRef(Inode *inode) {
+        if (inode != nullptr && --inode->m_refcount == 0) {
+            delete inode;
+        }
+    }
+    bool IsShared() { return m_refcount > 1; }
+
+    /* Modification generations. Every change to the file system state
+     * stamps the modified inode with a new generation taken from a global,
+     * monotonically increasing counter, so an inode changed after a
+     * checkpoint iff its generation is newer than the one current at the
+     * checkpoint. Lookup counts are kernel bookkeeping rather than file
+     * system state and do not count as modifications. */
+    void MarkDirty() { m_generation = NewGeneration(); }
+    uint64_t Generation() { return m_generation; }
+    static uint64_t NewGeneration() { return ++s_generation; }
+    static uint64_t CurrentGeneration() { return s_generation; }
+
+    /* Abstract state digest (see VERIFS_STATE_HASH) of this inode: the
+     * attributes selected by flags, then the xattrs and contents. The
+     * part for the xattrs and contents is cached until the inode is
+     * modified. Directory entries are left to the caller.
+     *
+     * Not thread-safe; the caller must stop all modifications.
+     */
+    void Digest(unsigned int flags, unsigned char *out);
+
+    typedef std::function<void(const void *, size_t)> DigestSink;
+    /* Feed the contents of the inode (e.g. the data of a file) */
+    virtual void HashContent(const DigestSink &feed) {}
+
     virtual size_t GetPickledSize();
 
     /* Pickle: Serialize the Inode object.
@@ -0,0 +1,158 @@
+/*
+ * This file is part of RefFS.
+ * 
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include "lz.hpp"
+
+/* Matches are at least kMinMatch long and at most kMaxOffset back; the
+ * last kTail bytes are always literals so that matching never reads
+ * past the end of the input. */
+static const size_t kMinMatch = 4;
+static const size_t kMaxOffset = 65535;
+static const size_t kTail = 5;
+static const int kHashBits = 12;
+
+static inline uint32_t load32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash32(uint32_t v) {
+    return (v * 2654435761U) >> (32 - kHashBits);
+}
+
+/* Lengths of 15 and more spill into extra bytes of 255 */
+static void put_length(std::vector<char> &out, size_t len) {
+    for (; len >= 255; len -= 255) {
+        out.push_back((char) 255);
+    }
+    out.push_back((char) len);
+}
+
+static void put_sequence(std::vector<char> &out, const char *lit, size_t litlen,
+                         size_t offset, size_t matchlen) {
+    size_t mlen = (matchlen > 0) ? matchlen - kMinMatch : 0;
+    unsigned char token = (unsigned char) ((std::min(litlen, (size_t) 15) << 4) |
+                                           std::min(mlen, (size_t) 15));
+    out.push_back((char) token);
+    if (litlen >= 15) {
+        put_length(out, litlen - 15);
+    }
+    out.insert(out.end(), lit, lit + litlen);
+    if (matchlen == 0) {
+        return;
+    }
+    out.push_back((char) (offset & 0xff));
+    out.push_back((char) (offset >> 8));
+    if (mlen >= 15) {
+        put_length(out, mlen - 15);
+    }
+}
+
+void lz_compress(const char *src, size_t len, std::vector<char> &out) {
+    uint32_t table[1 << kHashBits] = {};
+    size_t anchor = 0;
+    size_t pos = 1;
+
+    if (len > kTail + kMinMatch) {
+        size_t limit = len - kTail;
+        while (pos + kMinMatch <= limit) {
+            uint32_t h = hash32(load32(src + pos));
+            size_t cand = table[h];
+            table[h] = (uint32_t) pos;
+            if (cand >= pos || pos - cand > kMaxOffset ||
+                load32(src + cand) != load32(src + pos)) {
+                pos++;
+                continue;
+            }
+            size_t matchlen = kMinMatch;
+            while (pos + matchlen < limit && src[cand + matchlen] == src[pos + matchlen]) {
+                matchlen++;
+            }
+            put_sequence(out, src + anchor, pos - anchor, pos - cand, matchlen);
+            pos += matchlen;
+            anchor = pos;
+        }
+    }
+    put_sequence(out, src + anchor, len - anchor, 0, 0);
+}
+
+/* @return false if the length runs past the end of the input */
+static bool get_length(const unsigned char *&ip, const unsigned char *end, size_t &len) {
+    unsigned char b;
+    do {
+        if (ip >= end) {
+            return false;
+        }
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+bool lz_decompress(const char *src, size_t len, char *dst, size_t dstlen) {
+    const unsigned char *ip = (const unsigned char *) src;
+    const unsigned char *end = ip + len;
+    size_t op = 0;
+
+    while (ip < end) {
+        unsigned char token = *ip++;
+        size_t litlen = token >> 4;
+        if (litlen == 15 && !get_length(ip, end, litlen)) {
+            return false;
+        }
+        if (litlen > (size_t) (end - ip) || litlen > dstlen - op) {
+            return false;
+        }
+        memcpy(dst + op, ip, litlen);
+        ip += litlen;
+        op += litlen;
+        if (ip == end) {
+            /* The last sequence has no match */
+            break;
+        }
+
+        if (end - ip < 2) {
+            return false;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t matchlen = token & 15;
+        if (matchlen == 15 && !get_length(ip, end, matchlen)) {
+            return false;
+        }
+        matchlen += kMinMatch;
+        if (offset == 0 || offset > op || matchlen > dstlen - op) {
+            return false;
+        }
+        /* Byte by byte, as the match may overlap its own output */
+        for (size_t i = 0; i < matchlen; i++, op++) {
+            dst[op] = dst[op - offset];
+        }
+    }
+    return op == dstlen;
+}
@@ -0,0 +1,43 @@
+/*
+ * This file is part of RefFS.
+ * 
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef lz_hpp
+#define lz_hpp
+
+#include <cstddef>
+#include <vector>
+
+/* A small LZ77 codec in the format of LZ4 blocks, for compressing stored
+ * states in memory. It favors speed over ratio, which is plenty for the
+ * very repetitive contents produced by model checkers. */
+
+/* Compress len bytes at src, appending them to out */
+void lz_compress(const char *src, size_t len, std::vector<char> &out);
+
+/* Decompress len bytes at src into exactly dstlen bytes at dst.
+ *
+ * @return true on success, false if the data is corrupted.
+ */
+bool lz_decompress(const char *src, size_t len, char *dst, size_t dstlen);
+
+#endif /* lz_hpp */
@@ -67,7 +67,17 @@ int main(int argc, const char * argv[]) {
     ramfs_parse_cmdline(args, options);
     // The core code for our filesystem.
     size_t nblocks = options.capacity / Inode::BufBlockSize;
-    FuseRamFs core(nblocks, options.inodes);
+    FuseRamFs core(nblocks, options.inodes, options.undo_journal, options.dedup_states);
+    if (options.state_budget > 0) {
+        const char *spill_dir = options.spill_dir ? options.spill_dir : "/tmp";
+        if (set_state_budget(options.state_budget, spill_dir) != 0) {
+            cerr << "Cannot create the spill file in " << spill_dir << endl;
+            return err;
+        }
+    }
+    if (options.compress_idle > 0) {
+        set_state_compression(options.compress_idle);
+    }
     
     if (options.subtype) {
         mountpoint = options.mountpoint;
@@ -82,7 +92,11 @@ int main(int argc, const char * argv[]) {
                 fuse_daemonize(options.deamonize == 0);
                 if (fuse_set_signal_handlers(se) != -1) {
                     fuse_session_add_chan(se, ch);
-                    err = fuse_session_loop(se);
+                    if (options.multithreaded) {
+                        err = fuse_session_loop_mt(se);
+                    } else {
+                        err = fuse_session_loop(se);
+                    }
                     fuse_remove_signal_handlers(se);
                     fuse_session_remove_chan(ch);
                 }
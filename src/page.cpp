@@ -0,0 +1,156 @@
+/*
+ * This file is part of RefFS.
+ * 
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include <string_view>
+#include <memory_resource>
+
+#include "page.hpp"
+
+static const char zero_page[Page::Size] = {};
+
+std::mutex PageStore::storeMutex;
+std::unordered_multimap<size_t, Page *> PageStore::pages;
+
+/* Never destroyed, as pages may outlive static destruction */
+static std::pmr::synchronized_pool_resource &page_pool() {
+    static std::pmr::synchronized_pool_resource *pool =
+        new std::pmr::synchronized_pool_resource(
+            std::pmr::pool_options{0, sizeof(Page)});
+    return *pool;
+}
+
+void *Page::operator new(size_t size, const std::nothrow_t &) noexcept {
+    try {
+        return page_pool().allocate(size, alignof(Page));
+    } catch (const std::bad_alloc &e) {
+        return nullptr;
+    }
+}
+
+void Page::operator delete(void *ptr) {
+    page_pool().deallocate(ptr, sizeof(Page), alignof(Page));
+}
+
+Page *Page::Alloc() {
+    Page *page = new (std::nothrow) Page();
+    if (page == nullptr) {
+        return nullptr;
+    }
+    memset(page->m_data, 0, Size);
+    return page;
+}
+
+Page *Page::Clone() {
+    Page *page = new (std::nothrow) Page();
+    if (page == nullptr) {
+        return nullptr;
+    }
+    memcpy(page->m_data, m_data, Size);
+    return page;
+}
+
+const char *Page::ZeroData() {
+    return zero_page;
+}
+
+void Page::PutRef(Page *page) {
+    if (page != nullptr && --page->m_refcount == 0) {
+        if (page->m_interned) {
+            PageStore::Remove(page);
+        } else {
+            delete page;
+        }
+    }
+}
+
+void PageStore::Remove(Page *page) {
+    std::lock_guard<std::mutex> lk(storeMutex);
+    auto range = pages.equal_range(page->m_hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == page) {
+            pages.erase(it);
+            break;
+        }
+    }
+    delete page;
+}
+
+Page *PageStore::Intern(Page *page) {
+    if (page == nullptr || page->m_interned) {
+        return page;
+    }
+    if (memcmp(page->m_data, zero_page, Page::Size) == 0) {
+        Page::PutRef(page);
+        return nullptr;
+    }
+    size_t hash = std::hash<std::string_view>()(std::string_view(page->m_data, Page::Size));
+
+    std::unique_lock<std::mutex> lk(storeMutex);
+    auto range = pages.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        Page *stored = it->second;
+        /* Pages with no references left are about to be removed */
+        if (memcmp(stored->m_data, page->m_data, Page::Size) == 0 &&
+            stored->TryGetRef()) {
+            lk.unlock();
+            Page::PutRef(page);
+            return stored;
+        }
+    }
+    page->m_hash = hash;
+    page->m_interned = true;
+    pages.insert({hash, page});
+    return page;
+}
+
+bool PageStore::Detach(Page *page) {
+    std::lock_guard<std::mutex> lk(storeMutex);
+    /* Nobody can take a new reference while we hold the lock */
+    if (page->IsShared()) {
+        return false;
+    }
+    auto range = pages.equal_range(page->m_hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == page) {
+            pages.erase(it);
+            break;
+        }
+    }
+    page->m_interned = false;
+    return true;
+}
+
+void PageStore::GetStats(uint64_t &npages, uint64_t &nrefs) {
+    std::lock_guard<std::mutex> lk(storeMutex);
+    npages = pages.size();
+    nrefs = 0;
+    for (auto &it : pages) {
+        nrefs += it.second->m_refcount;
+    }
+}
+
+size_t PageStore::NumPages() {
+    std::lock_guard<std::mutex> lk(storeMutex);
+    return pages.size();
+}
@@ -0,0 +1,129 @@
+/*
+ * This file is part of RefFS.
+ * 
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef page_hpp
+#define page_hpp
+
+#include "common.h"
+
+/* A fixed-size, reference counted page of file data.
+ *
+ * Files keep their contents in pages so that copies of a file (the
+ * checkpointed and the live one) share the pages, and a write after a
+ * checkpoint only clones the pages it touches. Like inodes, a page that
+ * IsShared() is immutable, and so is a page interned in the PageStore. */
+class Page {
+private:
+    std::atomic_ulong m_refcount;
+    /* Set while the page is in the PageStore, keyed by m_hash */
+    std::atomic_bool m_interned;
+    size_t m_hash;
+    char m_data[PAGE_SIZE];
+
+    Page() : m_refcount(1), m_interned(false), m_hash(0) {}
+
+    /* Pages are carved out of a pool instead of being malloc'ed one by
+     * one, so freeing the pages of a state just returns them to it */
+    static void *operator new(size_t size, const std::nothrow_t &) noexcept;
+    static void operator delete(void *ptr);
+
+    /* Take a reference unless the page is already being freed */
+    bool TryGetRef() {
+        unsigned long cnt = m_refcount;
+        while (cnt != 0) {
+            if (m_refcount.compare_exchange_weak(cnt, cnt + 1)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    static constexpr size_t Size = PAGE_SIZE;
+
+    /* Allocate a zero-filled page.
+     *
+     * @return The new page, or nullptr if out of memory.
+     */
+    static Page *Alloc();
+
+    /* Allocate a private copy of this page.
+     *
+     * @return The new page, or nullptr if out of memory.
+     */
+    Page *Clone();
+
+    void GetRef() { m_refcount++; }
+    static void PutRef(Page *page);
+    bool IsShared() { return m_refcount > 1; }
+    bool IsInterned() { return m_interned; }
+
+    char *Data() { return m_data; }
+
+    /* Read-only page of zeros that stands in for holes */
+    static const char *ZeroData();
+
+    friend class PageStore;
+};
+
+/* Content-addressed store of pages.
+ *
+ * Most files in the stored states are byte-identical to each other, so
+ * the pages of checkpointed files are interned here: a page whose content
+ * is already in the store is replaced by a reference to the stored one,
+ * and all of the states share a single copy of it. The store does not own
+ * the pages; a page leaves the store when its last reference is dropped. */
+class PageStore {
+private:
+    static std::mutex storeMutex;
+    static std::unordered_multimap<size_t, Page *> pages;
+
+    static void Remove(Page *page);
+
+public:
+    /* Intern a page, taking over the caller's reference on it.
+     *
+     * @return A reference to the stored page with the same content, which
+     * may be the page itself, or nullptr if the page is all zeros (i.e.
+     * it can be a hole).
+     */
+    static Page *Intern(Page *page);
+
+    /* Take an interned page out of the store if the caller holds the only
+     * reference on it, so that it can be modified in place.
+     *
+     * @return true if the page is now private to the caller.
+     */
+    static bool Detach(Page *page);
+
+    /* @param[out] npages The number of pages in the store
+     * @param[out] nrefs The number of references to them */
+    static void GetStats(uint64_t &npages, uint64_t &nrefs);
+
+    /* @return The number of pages in the store */
+    static size_t NumPages();
+
+    friend class Page;
+};
+
+#endif /* page_hpp */
@@ -162,17 +162,15 @@ int pickle_file_system(int fd, std::vector<Inode *> &inodes,
         }
 
         // start pickling checkpoint/restore pools
-        auto state_pool = get_state_pool();
+        auto state_pool = get_all_states();
 
         size_t num_state_pool = state_pool.size();
         write_and_hash(fd, hashctx, ctx, &num_state_pool, sizeof(num_state_pool));
         for (const auto &state: state_pool) {
             uint64_t key = state.first;
             write_and_hash(fd, hashctx, ctx, &key, sizeof(key));
-            std::tuple
-                    <std::vector<Inode *>, std::queue<fuse_ino_t>,
-                            struct statvfs> stored_states = state.second;
-            std::vector<Inode *> stored_files = std::get<0>(stored_states);
+            const verifs2_state stored_states = materialize_state(state.second);
+            const std::vector<Inode *> &stored_files = std::get<0>(stored_states);
             size_t num_stored_files = stored_files.size();
             write_and_hash(fd, hashctx, ctx, &num_stored_files, sizeof(num_stored_files));
 
@@ -247,6 +245,11 @@ int FuseRamFs::pickle_verifs2(void) {
     char *path = nullptr;
     int fd = -1;
     int res = 0;
+    std::unique_lock<std::shared_mutex> lk(crMutex);
+    /* The journaled checkpoint has to be pickled as a regular state */
+    res = flush_journal();
+    if (res != 0)
+        return res;
     try {
         path = fetch_filepath(VERIFS_PICKLE_CFG);
         fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
@@ -545,6 +548,8 @@ int FuseRamFs::load_verifs2(void) {
     void *mapped = nullptr;
     int fd = -1, res = 0;
     size_t content_size = 0;
+    std::unique_lock<std::shared_mutex> lk(crMutex);
+    std::unique_lock<std::shared_mutex> capturelk(captureRwSem);
     try {
         path = fetch_filepath(VERIFS_LOAD_CFG);
         fd = open(path, O_RDONLY);
@@ -570,13 +575,27 @@ int FuseRamFs::load_verifs2(void) {
         if (mapped == MAP_FAILED)
             throw pickle_error(errno, __func__, __LINE__);
         // load the file system
+        FuseRamFs::drop_journal();
         clear_states();
+        FuseRamFs::drop_snapshots(0, UINT64_MAX);
+        {
+            std::lock_guard<std::mutex> cleanlk(FuseRamFs::cleanMutex);
+            FuseRamFs::cleanState = nullptr;
+            FuseRamFs::liveParent = nullptr;
+        }
+        FuseRamFs::changedSlots.clear();
+        FuseRamFs::hashValid = false;
         FuseRamFs::Inodes.clear();
         while (!FuseRamFs::DeletedInodes.empty())
             FuseRamFs::DeletedInodes.pop();
         char *ptr = (char *) mapped + sizeof(state_file_header);
         load_file_system(ptr, FuseRamFs::Inodes, FuseRamFs::DeletedInodes,
                          FuseRamFs::m_stbuf);
+        for (auto &inode : FuseRamFs::Inodes) {
+            if (inode != nullptr && inode->m_fuseEntryParam.generation > FuseRamFs::lastFuseGeneration) {
+                FuseRamFs::lastFuseGeneration = inode->m_fuseEntryParam.generation;
+            }
+        }
     } catch (const pickle_error &e) {
         res = -e.get_errno();
     }
@@ -0,0 +1,422 @@
+/*
+ * This file is part of RefFS.
+ *
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ * Original Copyright (C) Peter Watkins
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+#include <sys/stat.h>
+
+#include "inode.hpp"
+#include "file.hpp"
+#include "directory.hpp"
+#include "symlink.hpp"
+#include "fuse_cpp_ramfs.hpp"
+
+/* Read-only views of the stored states.
+ *
+ * /.snapshots/<key> serves the tree of a state straight from its stored
+ * inodes, so it can be compared against the live tree with plain reads,
+ * without a restore. A view is built on the first lookup of its key and
+ * lives until the key is dropped or restored. The stored inodes are
+ * immutable, so nothing here modifies them, not even the access times.
+ */
+
+std::map<uint64_t, std::shared_ptr<snapshot_view>> FuseRamFs::snapshotKeys;
+std::unordered_map<uint32_t, std::shared_ptr<snapshot_view>> FuseRamFs::snapshotViews;
+uint32_t FuseRamFs::nextSnapshotId = 1;
+std::mutex FuseRamFs::snapshotMutex;
+
+/* The attributes are kept as stored, so that they compare equal to those
+ * of the live files; like on a read-only mount, writes fail with EROFS */
+static void view_attr(Inode *inode, fuse_ino_t ino, struct stat *attr) {
+    inode->GetAttr(attr);
+    attr->st_ino = ino;
+}
+
+/* The entries of /.snapshots are looked up again on every path walk, since
+ * a key may be dropped and checkpointed again with another state */
+static int reply_view_entry(fuse_req_t req, Inode *inode, fuse_ino_t ino, double entry_timeout) {
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = ino;
+    e.attr_timeout = 1.0;
+    e.entry_timeout = entry_timeout;
+    view_attr(inode, ino, &e.attr);
+    return fuse_reply_entry(req, &e);
+}
+
+/* Attributes of /.snapshots itself, after those of the root */
+static void snapshot_dir_attr(Inode *root, fuse_ino_t ino, struct stat *attr) {
+    if (root != nullptr) {
+        root->GetAttr(attr);
+    } else {
+        memset(attr, 0, sizeof(*attr));
+    }
+    attr->st_ino = ino;
+    attr->st_mode = S_IFDIR | 0555;
+    attr->st_nlink = 2;
+    attr->st_size = 0;
+    attr->st_blocks = 0;
+}
+
+/* find_snapshot: Resolve an inode number of a view.
+ *
+ * @param[out] inode The stored inode.
+ * @return The view, which keeps inode alive, or nullptr if the view or the
+ * inode no longer exists.
+ */
+std::shared_ptr<snapshot_view> FuseRamFs::find_snapshot(fuse_ino_t ino, Inode *&inode) {
+    uint32_t id = (uint32_t) ((ino & ~kSnapshotInoBit) >> 32);
+    fuse_ino_t stored = ino & UINT32_MAX;
+    std::shared_ptr<snapshot_view> view;
+    {
+        std::lock_guard<std::mutex> lk(snapshotMutex);
+        auto it = snapshotViews.find(id);
+        if (it == snapshotViews.end()) {
+            return nullptr;
+        }
+        view = it->second;
+    }
+    inode = (stored < view->inodes.size()) ? view->inodes[stored] : nullptr;
+    if (inode == nullptr || inode->HasNoLinks()) {
+        return nullptr;
+    }
+    return view;
+}
+
+/* open_snapshot: Get the view of a state, building it if needed.
+ *
+ * Runs under crMutex, so that a state cannot be dropped between reading
+ * its table and registering its view.
+ *
+ * @return The view, or nullptr if the state does not exist.
+ */
+std::shared_ptr<snapshot_view> FuseRamFs::open_snapshot(uint64_t key) {
+    wait_checkpoints();
+    std::unique_lock<std::shared_mutex> lk(crMutex);
+    {
+        std::lock_guard<std::mutex> snaplk(snapshotMutex);
+        auto it = snapshotKeys.find(key);
+        if (it != snapshotKeys.end()) {
+            return it->second;
+        }
+    }
+
+    auto view = std::make_shared<snapshot_view>();
+    view->key = key;
+    if (state_table(key, view->inodes, view->state) != 0 ||
+        view->inodes.size() > UINT32_MAX) {
+        view->inodes.clear();
+        return nullptr;
+    }
+    if (view->state == nullptr) {
+        for (auto &inode : view->inodes) {
+            if (inode != nullptr) {
+                inode->GetRef();
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> snaplk(snapshotMutex);
+    if (nextSnapshotId > (uint32_t) INT32_MAX) {
+        return nullptr;
+    }
+    view->base = kSnapshotInoBit | ((fuse_ino_t) nextSnapshotId << 32);
+    snapshotViews.insert({nextSnapshotId++, view});
+    snapshotKeys.insert({key, view});
+    return view;
+}
+
+/* drop_snapshots: Forget the views of the states with first <= key <= last.
+ * Files of the views still open keep working until they are released;
+ * other requests on them fail with ENOENT.
+ */
+void FuseRamFs::drop_snapshots(uint64_t first, uint64_t last) {
+    std::lock_guard<std::mutex> lk(snapshotMutex);
+    for (auto it = snapshotKeys.lower_bound(first);
+         it != snapshotKeys.end() && it->first <= last;) {
+        snapshotViews.erase((uint32_t) ((it->second->base & ~kSnapshotInoBit) >> 32));
+        it = snapshotKeys.erase(it);
+    }
+}
+
+/* Fail requests that would modify a view */
+bool FuseRamFs::RejectSnapshotWrite(fuse_req_t req, fuse_ino_t ino) {
+    if (!IsSnapshotIno(ino)) {
+        return false;
+    }
+    fuse_reply_err(req, EROFS);
+    return true;
+}
+
+void FuseRamFs::SnapshotLookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    if (parent == FUSE_ROOT_ID) {
+        /* Only reached if the root has no entry of that name */
+        struct fuse_entry_param e;
+        memset(&e, 0, sizeof(e));
+        e.ino = kSnapshotDirIno;
+        e.attr_timeout = 1.0;
+        e.entry_timeout = 1.0;
+        std::shared_lock<std::shared_mutex> lk(crMutex);
+        snapshot_dir_attr(GetInode(FUSE_ROOT_ID), e.ino, &e.attr);
+        fuse_reply_entry(req, &e);
+        return;
+    }
+
+    if (parent == kSnapshotDirIno) {
+        char *end;
+        errno = 0;
+        uint64_t key = strtoull(name, &end, 10);
+        /* Only the canonical spelling of a key */
+        if (errno != 0 || *end != '\0' || std::to_string(key) != name) {
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+        std::shared_ptr<snapshot_view> view = open_snapshot(key);
+        Inode *root = (view != nullptr && view->inodes.size() > FUSE_ROOT_ID) ?
+                      view->inodes[FUSE_ROOT_ID] : nullptr;
+        if (root == nullptr) {
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+        reply_view_entry(req, root, view->base | FUSE_ROOT_ID, 0.0);
+        return;
+    }
+
+    Inode *inode;
+    std::shared_ptr<snapshot_view> view = find_snapshot(parent, inode);
+    if (view == nullptr) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    auto *dir = dynamic_cast<Directory *>(inode);
+    if (dir == nullptr) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    fuse_ino_t ino = dir->ChildInodeNumberWithName(std::string(name));
+    Inode *child = (ino != INO_NOTFOUND && ino < view->inodes.size()) ? view->inodes[ino] : nullptr;
+    if (child == nullptr || child->HasNoLinks()) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    reply_view_entry(req, child, view->base | ino, 1.0);
+}
+
+void FuseRamFs::SnapshotGetAttr(fuse_req_t req, fuse_ino_t ino) {
+    struct stat attr;
+    if (ino == kSnapshotDirIno) {
+        std::shared_lock<std::shared_mutex> lk(crMutex);
+        snapshot_dir_attr(GetInode(FUSE_ROOT_ID), ino, &attr);
+        fuse_reply_attr(req, &attr, 1.0);
+        return;
+    }
+    Inode *inode;
+    std::shared_ptr<snapshot_view> view = find_snapshot(ino, inode);
+    if (view == nullptr) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    view_attr(inode, ino, &attr);
+    fuse_reply_attr(req, &attr, 1.0);
+}
+
+void FuseRamFs::SnapshotOpen(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, bool dir) {
+    bool isdir = true;
+    if (ino != kSnapshotDirIno) {
+        Inode *inode;
+        if (find_snapshot(ino, inode) == nullptr) {
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+        isdir = S_ISDIR(inode->GetMode());
+    }
+    if (dir && !isdir) {
+        fuse_reply_err(req, ENOTDIR);
+    } else if (!dir && isdir) {
+        fuse_reply_err(req, EISDIR);
+    } else if ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC)) {
+        fuse_reply_err(req, EROFS);
+    } else {
+        fuse_reply_open(req, fi);
+    }
+}
+
+/* Directory offsets are indexes into the list of entries */
+void FuseRamFs::SnapshotReadDir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off) {
+    std::vector<std::pair<std::string, struct stat>> entries;
+    struct stat stbuf;
+    memset(&stbuf, 0, sizeof(stbuf));
+    std::shared_ptr<snapshot_view> view;
+
+    if (ino == kSnapshotDirIno) {
+        /* One entry per key; they get their inode numbers on lookup */
+        std::vector<uint64_t> keys;
+        wait_checkpoints();
+        {
+            std::shared_lock<std::shared_mutex> lk(crMutex);
+            for (auto &it : get_state_pool()) {
+                keys.push_back(it.first);
+            }
+            for (auto &info : get_packed_states()) {
+                keys.push_back(info.key);
+            }
+            /* Only the key of the journal is read: it changes under
+             * crMutex held exclusively, unlike its saved objects */
+            if (Journal.active) {
+                keys.push_back(Journal.key);
+            }
+        }
+        std::sort(keys.begin(), keys.end());
+        stbuf.st_mode = S_IFDIR;
+        stbuf.st_ino = kSnapshotDirIno;
+        entries.push_back({".", stbuf});
+        stbuf.st_ino = FUSE_ROOT_ID;
+        entries.push_back({"..", stbuf});
+        stbuf.st_ino = kSnapshotDirIno;
+        for (uint64_t key : keys) {
+            entries.push_back({std::to_string(key), stbuf});
+        }
+    } else {
+        Inode *inode;
+        view = find_snapshot(ino, inode);
+        if (view == nullptr) {
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+        auto *dir = dynamic_cast<Directory *>(inode);
+        if (dir == nullptr) {
+            fuse_reply_err(req, ENOTDIR);
+            return;
+        }
+        for (auto &it : dir->Children()) {
+            Inode *child = (it.second < view->inodes.size()) ? view->inodes[it.second] : nullptr;
+            if (child == nullptr || child->HasNoLinks()) {
+                continue;
+            }
+            child->GetAttr(&stbuf);
+            stbuf.st_ino = view->base | it.second;
+            /* The root of a view is a child of /.snapshots */
+            if (it.first == ".." && stbuf.st_ino == (view->base | FUSE_ROOT_ID)) {
+                stbuf.st_ino = kSnapshotDirIno;
+            }
+            entries.push_back({it.first, stbuf});
+        }
+    }
+
+    char *buf = (char *) malloc(size);
+    if (buf == nullptr) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    size_t bytesAdded = 0;
+    for (size_t i = (off < 0) ? 0 : off; i < entries.size(); ++i) {
+        size_t len = fuse_add_direntry(req, buf + bytesAdded, size - bytesAdded,
+                                       entries[i].first.c_str(), &entries[i].second, i + 1);
+        if (bytesAdded + len > size) {
+            break;
+        }
+        bytesAdded += len;
+    }
+    fuse_reply_buf(req, buf, bytesAdded);
+    free(buf);
+}
+
+void FuseRamFs::SnapshotRead(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off) {
+    Inode *inode;
+    std::shared_ptr<snapshot_view> view = (ino != kSnapshotDirIno) ? find_snapshot(ino, inode) : nullptr;
+    if (view == nullptr) {
+        fuse_reply_err(req, (ino == kSnapshotDirIno) ? EISDIR : ENOENT);
+        return;
+    }
+    auto *file = dynamic_cast<File *>(inode);
+    if (file == nullptr) {
+        fuse_reply_err(req, S_ISDIR(inode->GetMode()) ? EISDIR : EINVAL);
+        return;
+    }
+    file->ReplyData(req, size, off);
+}
+
+void FuseRamFs::SnapshotReadLink(fuse_req_t req, fuse_ino_t ino) {
+    Inode *inode;
+    std::shared_ptr<snapshot_view> view = (ino != kSnapshotDirIno) ? find_snapshot(ino, inode) : nullptr;
+    auto *link = (view != nullptr) ? dynamic_cast<SymLink *>(inode) : nullptr;
+    if (link == nullptr) {
+        fuse_reply_err(req, (view == nullptr && ino != kSnapshotDirIno) ? ENOENT : EINVAL);
+        return;
+    }
+    fuse_reply_readlink(req, link->Link().c_str());
+}
+
+void FuseRamFs::SnapshotGetXAttr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+    if (ino == kSnapshotDirIno) {
+#ifdef __APPLE__
+        fuse_reply_err(req, ENOATTR);
+#else
+        fuse_reply_err(req, ENODATA);
+#endif
+        return;
+    }
+    Inode *inode;
+    std::shared_ptr<snapshot_view> view = find_snapshot(ino, inode);
+    if (view == nullptr) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    inode->GetXAttrAndReply(req, std::string(name), size, 0);
+}
+
+void FuseRamFs::SnapshotListXAttr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+    if (ino == kSnapshotDirIno) {
+        if (size == 0) {
+            fuse_reply_xattr(req, 0);
+        } else {
+            fuse_reply_buf(req, nullptr, 0);
+        }
+        return;
+    }
+    Inode *inode;
+    std::shared_ptr<snapshot_view> view = find_snapshot(ino, inode);
+    if (view == nullptr) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    inode->ListXAttrAndReply(req, size);
+}
+
+void FuseRamFs::SnapshotAccess(fuse_req_t req, fuse_ino_t ino, int mask) {
+    Inode *inode = nullptr;
+    std::shared_ptr<snapshot_view> view;
+    if (ino != kSnapshotDirIno && (view = find_snapshot(ino, inode)) == nullptr) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (mask & W_OK) {
+        fuse_reply_err(req, EROFS);
+    } else if (inode == nullptr) {
+        fuse_reply_err(req, 0);
+    } else {
+        const struct fuse_ctx *ctx_p = fuse_req_ctx(req);
+        inode->ReplyAccess(req, mask, ctx_p->gid, ctx_p->uid);
+    }
+}
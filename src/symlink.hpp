@@ -46,6 +46,7 @@ public:
     void Initialize(fuse_ino_t ino, mode_t mode, nlink_t nlink, gid_t gid, uid_t uid);
     
     const std::string &Link() { return m_link; }
+    void HashContent(const DigestSink &feed) { feed(m_link.data(), m_link.size()); }
 
     size_t GetPickledSize();
     size_t Pickle(void* &buf);
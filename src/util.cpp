@@ -100,6 +100,18 @@ size_t SizeStr2Number(const char *str)
  *              including k,m,g,t,p,e.
  *   - inodes   Inode slots of the file system. Also supports unit suffix.
  *   - subtype  Subtype name to be displayed in mount list.
+ *   - undo_journal  Keep the latest checkpoint as an undo journal, so that
+ *              restoring it only rolls back the changes made since.
+ *   - multithreaded  Serve requests from several threads, so that file
+ *              operations can run while a checkpoint is taken.
+ *   - dedup_states  Store a checkpoint of a state that is already stored
+ *              under another key as an alias of it.
+ *   - state_budget  Memory for checkpointed file data; past it the least
+ *              recently used states are spilled to disk. Supports unit
+ *              suffix.
+ *   - spill_dir  Directory of the spill file (default: /tmp).
+ *   - compress_idle  Compress the states that have not been used for this
+ *              many seconds in memory.
  * 
  * @return: The new string buffer containing the original option string
  *   with the parsed options excluded.
@@ -116,6 +128,7 @@ char *ramfs_parse_options(char *optstr, struct fuse_ramfs_options &opt) {
         }
         *(ptr++) = *(optstr++);
     }
+    char *options = ptr;
     kvtoken = strtok_r(optstr, ",", &ctx1);
     while (kvtoken) {
         char *ctx2;
@@ -137,6 +150,30 @@ char *ramfs_parse_options(char *optstr, struct fuse_ramfs_options &opt) {
                 opt.subtype = value;
                 printf("Custom subtype: %s\n", value);
             }
+        } else if (key && strncmp(key, "undo_journal", OPTION_MAX) == 0) {
+            opt.undo_journal = true;
+            printf("Undo journal enabled\n");
+        } else if (key && strncmp(key, "multithreaded", OPTION_MAX) == 0) {
+            opt.multithreaded = true;
+            printf("Multithreaded loop enabled\n");
+        } else if (key && strncmp(key, "dedup_states", OPTION_MAX) == 0) {
+            opt.dedup_states = true;
+            printf("State deduplication enabled\n");
+        } else if (key && strncmp(key, "state_budget", OPTION_MAX) == 0) {
+            if (value) {
+                opt.state_budget = SizeStr2Number(value);
+                printf("State pool budget: %zu bytes\n", opt.state_budget);
+            }
+        } else if (key && strncmp(key, "spill_dir", OPTION_MAX) == 0) {
+            if (value) {
+                opt.spill_dir = value;
+                printf("Spill directory: %s\n", value);
+            }
+        } else if (key && strncmp(key, "compress_idle", OPTION_MAX) == 0) {
+            if (value) {
+                opt.compress_idle = strtoul(value, nullptr, 10);
+                printf("Compress states idle for %zu seconds\n", opt.compress_idle);
+            }
         } else {
             if (key == nullptr) {
                 continue;
@@ -145,9 +182,8 @@ char *ramfs_parse_options(char *optstr, struct fuse_ramfs_options &opt) {
              * them into the newopt buffer for future use (e.g. fuse_mount)
              */
             size_t keylen = strnlen(key, OPTION_MAX);
-            /* If the cursor of newopt buffer is not at the beginning,
-             * add comma */
-            if (ptr > newopt)
+            /* If an option was copied already, add comma */
+            if (ptr > options)
               *(ptr++) = ',';
             strncpy(ptr, key, keylen);
             ptr += keylen;
@@ -171,12 +207,12 @@ char *ramfs_parse_options(char *optstr, struct fuse_ramfs_options &opt) {
     }
 
     /* Erase '-o' if no option string is left */
-    if (*(--ptr) == 'o') {
-        *ptr = 0;
-        if (*(--ptr) == '-') {
-            *ptr = 0;
+    if (ptr == options && ptr > newopt) {
+        if (*(--ptr) == 'o' && ptr > newopt && *(ptr - 1) == '-') {
+            --ptr;
         }
     }
+    *ptr = 0;
 
     return newopt;
 }
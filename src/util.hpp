@@ -43,6 +43,12 @@ struct fuse_ramfs_options {
     size_t capacity;
     size_t inodes;
     bool deamonize;
+    bool undo_journal;
+    bool multithreaded;
+    bool dedup_states;
+    size_t state_budget;
+    char *spill_dir;
+    size_t compress_idle;
     char *subtype;
     char *mountpoint;
     char *_optstr;
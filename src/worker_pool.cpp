@@ -0,0 +1,110 @@
+/*
+ * This file is part of RefFS.
+ * 
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "worker_pool.hpp"
+
+std::mutex WorkerPool::poolMutex;
+std::mutex WorkerPool::jobMutex;
+std::condition_variable WorkerPool::jobCv;
+std::condition_variable WorkerPool::doneCv;
+std::vector<std::thread> WorkerPool::workers;
+bool WorkerPool::stopping = false;
+
+const std::function<void(size_t, size_t)> *WorkerPool::jobFn = nullptr;
+size_t WorkerPool::jobCount = 0;
+uint64_t WorkerPool::jobSeq = 0;
+std::atomic<size_t> WorkerPool::jobNext(0);
+size_t WorkerPool::jobBusy = 0;
+
+void WorkerPool::RunRanges(const std::function<void(size_t, size_t)> &fn, size_t count) {
+    size_t begin;
+    while ((begin = jobNext.fetch_add(kRangeSize)) < count) {
+        fn(begin, std::min(begin + kRangeSize, count));
+    }
+}
+
+void WorkerPool::Worker() {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lk(poolMutex);
+    while (true) {
+        jobCv.wait(lk, [&seen] { return stopping || jobSeq != seen; });
+        if (stopping) {
+            return;
+        }
+        seen = jobSeq;
+        /* The walk may be over already */
+        if (jobFn == nullptr) {
+            continue;
+        }
+        const std::function<void(size_t, size_t)> *fn = jobFn;
+        size_t count = jobCount;
+        jobBusy++;
+        lk.unlock();
+        RunRanges(*fn, count);
+        lk.lock();
+        if (--jobBusy == 0) {
+            doneCv.notify_all();
+        }
+    }
+}
+
+void WorkerPool::ParallelFor(size_t count, const std::function<void(size_t, size_t)> &fn) {
+    std::unique_lock<std::mutex> joblk(jobMutex, std::try_to_lock);
+    if (count <= kRangeSize || !joblk.owns_lock()) {
+        fn(0, count);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lk(poolMutex);
+    if (workers.empty() && !stopping) {
+        unsigned int ncpus = std::thread::hardware_concurrency();
+        for (unsigned int i = 1; i < ncpus; i++) {
+            workers.emplace_back(Worker);
+        }
+    }
+    jobFn = &fn;
+    jobCount = count;
+    jobNext = 0;
+    jobSeq++;
+    lk.unlock();
+    jobCv.notify_all();
+
+    RunRanges(fn, count);
+
+    lk.lock();
+    doneCv.wait(lk, [] { return jobBusy == 0; });
+    jobFn = nullptr;
+}
+
+void WorkerPool::Shutdown() {
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard<std::mutex> lk(poolMutex);
+        stopping = true;
+        threads.swap(workers);
+    }
+    jobCv.notify_all();
+    for (auto &t : threads) {
+        t.join();
+    }
+}
@@ -0,0 +1,71 @@
+/*
+ * This file is part of RefFS.
+ * 
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef worker_pool_hpp
+#define worker_pool_hpp
+
+#include "common.h"
+
+#include <condition_variable>
+#include <functional>
+#include <thread>
+
+/* A pool of worker threads, one per CPU, for splitting the walks over the
+ * inode table done by checkpoint and restore.
+ *
+ * The table is cut into fixed-size ranges that the workers and the calling
+ * thread claim one at a time until none is left, so threads that get
+ * cheap ranges (holes, small files) take over the rest of the work. Only
+ * one walk uses the pool at a time; a concurrent one runs on its caller. */
+class WorkerPool {
+private:
+    /* Inode table slots per range */
+    static const size_t kRangeSize = 1024;
+
+    static std::mutex poolMutex;
+    static std::mutex jobMutex;
+    static std::condition_variable jobCv;
+    static std::condition_variable doneCv;
+    static std::vector<std::thread> workers;
+    static bool stopping;
+
+    /* The current walk */
+    static const std::function<void(size_t, size_t)> *jobFn;
+    static size_t jobCount;
+    static uint64_t jobSeq;
+    static std::atomic<size_t> jobNext;
+    static size_t jobBusy;
+
+    static void Worker();
+    static void RunRanges(const std::function<void(size_t, size_t)> &fn, size_t count);
+
+public:
+    /* Call fn(begin, end) on ranges covering [0, count) in parallel and
+     * return once all of them are done. fn must not throw. */
+    static void ParallelFor(size_t count, const std::function<void(size_t, size_t)> &fn);
+
+    /* Stop and join the workers */
+    static void Shutdown();
+};
+
+#endif /* worker_pool_hpp */
@@ -0,0 +1,68 @@
+#!/usr/bin/env python
+
+#
+# This file is part of RefFS.
+# 
+# Copyright (c) 2020-2024 Yifei Liu
+# Copyright (c) 2020-2024 Wei Su
+# Copyright (c) 2020-2024 Erez Zadok
+# Copyright (c) 2020-2024 Stony Brook University
+# Copyright (c) 2020-2024 The Research Foundation of SUNY
+# Original Copyright (C) Peter Watkins
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# RefFS is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+#
+
+
+# VERIFS_CHECKPOINT_ASYNC: states stored in the background are those the
+# file system was in when the ioctl returned, with and without the undo
+# journal.
+
+import errno
+import sys
+from verifs import *
+
+for options in [None, 'undo_journal']:
+    with RamFs(options) as fs:
+        # Changed right after each call, while the state may still be stored
+        keys = list(range(1, 11))
+        for key in keys:
+            fs.write('f', content(key, 64))
+            check(fs.checkpoint_async(key) == 0, 'checkpoint_async {}'.format(key))
+            fs.write('f', b'changed')
+            fs.write('g{}'.format(key), b'')
+            fs.unlink('g{}'.format(key))
+        expect_errno(errno.EEXIST, fs.checkpoint_async, keys[-1])
+        expect_errno(errno.EEXIST, fs.checkpoint, keys[-1])
+        check(sorted(fs.list_states()) == keys, 'states {}'.format(fs.list_states()))
+        for key in keys:
+            check(fs.restore_keep(key) == 0, 'restore_keep {}'.format(key))
+            check(fs.read('f') == content(key, 64) and fs.listdir() == ['f'],
+                  'state {} was not restored'.format(key))
+
+        # Mixed with the other ioctls, which wait for them
+        fs.write('f', content(20, 64))
+        check(fs.checkpoint_async(20) == 0, 'checkpoint_async 20')
+        expect_errno(errno.EEXIST, fs.checkpoint_async, 20)
+        fs.write('f', content(21, 64))
+        check(fs.checkpoint_async(21) == 0, 'checkpoint_async 21')
+        check(fs.drop(20) == 0, 'drop 20')
+        check(fs.restore(21) == 0, 'restore 21')
+        check(fs.read('f') == content(21, 64), 'state 21 was not restored')
+        check(fs.checkpoint_async(20) == 0, 'checkpoint_async 20 again')
+        check(fs.restore(20) == 0, 'restore 20')
+        check(fs.read('f') == content(21, 64), 'state 20 was not restored')
+        check(sorted(fs.list_states()) == keys, 'states {}'.format(fs.list_states()))
+
+sys.exit(0)
@@ -0,0 +1,81 @@
+#!/usr/bin/env python
+
+#
+# This file is part of RefFS.
+# 
+# Copyright (c) 2020-2024 Yifei Liu
+# Copyright (c) 2020-2024 Wei Su
+# Copyright (c) 2020-2024 Erez Zadok
+# Copyright (c) 2020-2024 Stony Brook University
+# Copyright (c) 2020-2024 The Research Foundation of SUNY
+# Original Copyright (C) Peter Watkins
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# RefFS is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+#
+
+
+# VERIFS_BATCH: sequences of checkpoints, restores and drops in one call,
+# with and without the undo journal.
+
+import errno
+import sys
+from verifs import *
+
+for options in [None, 'undo_journal']:
+    with RamFs(options) as fs:
+        fs.write('f', content(1))
+        check(fs.batch([(BATCH_CHECKPOINT, 1)]) == (1, [0]), 'checkpoint 1')
+        fs.write('f', content(2))
+
+        # "restore k1; checkpoint k2; drop k1" after changing the file
+        ret = fs.batch([(BATCH_CHECKPOINT, 2), (BATCH_RESTORE_KEEP, 1),
+                        (BATCH_CHECKPOINT, 3), (BATCH_DROP, 1)])
+        check(ret == (4, [0, 0, 0, 0]), 'batch {}'.format(ret))
+        check(fs.read('f') == content(1), 'state 1 was not restored')
+        check(sorted(fs.list_states()) == [2, 3], 'states {}'.format(fs.list_states()))
+        check(fs.batch([(BATCH_RESTORE, 2)]) == (1, [0]), 'restore 2')
+        check(fs.read('f') == content(2), 'state 2 was not restored')
+
+        # The commands after a failed one are canceled
+        ret = fs.batch([(BATCH_CHECKPOINT, 4), (BATCH_CHECKPOINT, 3),
+                        (BATCH_DROP, 4), (BATCH_RESTORE, 3)])
+        check(ret == (1, [0, -errno.EEXIST, -errno.ECANCELED, -errno.ECANCELED]),
+              'batch {}'.format(ret))
+        check(sorted(fs.list_states()) == [3, 4], 'states {}'.format(fs.list_states()))
+
+        # Unless told to go on
+        ret = fs.batch([(BATCH_RESTORE, 5), (BATCH_RESTORE_KEEP, 3), (0, 3),
+                        (BATCH_DROP, 5), (BATCH_DROP, 4)], BATCH_CONTINUE)
+        check(ret == (2, [-errno.ENOENT, 0, -errno.EINVAL, -errno.ENOENT, 0]),
+              'batch {}'.format(ret))
+        check(fs.read('f') == content(1), 'state 3 was not restored')
+        check(sorted(fs.list_states()) == [3], 'states {}'.format(fs.list_states()))
+
+        # As many commands as fit
+        fs.truncate('f', 0)
+        fs.write('f', b'live')
+        keys = list(range(10, 10 + BATCH_MAX // 2))
+        ret = fs.batch([(BATCH_CHECKPOINT, k) for k in keys] +
+                       [(BATCH_DROP, k) for k in keys])
+        check(ret == (BATCH_MAX, [0] * BATCH_MAX), 'batch {}'.format(ret))
+        check(fs.batch([]) == (0, []), 'empty batch')
+        check(fs.read('f') == b'live', 'file changed')
+
+        expect_errno(errno.EINVAL, fs.batch, [(BATCH_DROP, 3)], 2)
+        buf = bytearray(BATCH_SIZE)
+        BATCH.pack_into(buf, 0, BATCH_MAX + 1, 0)
+        expect_errno(errno.EINVAL, fs.ioctl, VERIFS_BATCH, buf)
+        check(sorted(fs.list_states()) == [3], 'states {}'.format(fs.list_states()))
+
+sys.exit(0)
@@ -0,0 +1,80 @@
+#!/usr/bin/env python
+
+#
+# This file is part of RefFS.
+# 
+# Copyright (c) 2020-2024 Yifei Liu
+# Copyright (c) 2020-2024 Wei Su
+# Copyright (c) 2020-2024 Erez Zadok
+# Copyright (c) 2020-2024 Stony Brook University
+# Copyright (c) 2020-2024 The Research Foundation of SUNY
+# Original Copyright (C) Peter Watkins
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# RefFS is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+#
+
+
+# What the kernel has cached of the live file system (attributes, data and
+# directory entries, present or missing) is invalidated by restores, with
+# and without the undo journal.
+
+import stat
+import sys
+from verifs import *
+
+def look(fs):
+    """Fill the kernel caches"""
+    res = {}
+    for name in ['f', 'g', 'd', 'd/h', 'l']:
+        try:
+            mode = fs.stat(name).st_mode
+        except (FileNotFoundError, NotADirectoryError):
+            res[name] = 'missing'
+            continue
+        if stat.S_ISDIR(mode):
+            res[name] = fs.listdir(name)
+        elif stat.S_ISLNK(mode):
+            res[name] = fs.readlink(name)
+        else:
+            res[name] = fs.read(name)
+    return res
+
+for options in [None, 'undo_journal']:
+    with RamFs(options) as fs:
+        fs.write('f', b'a' * 5000)
+        fs.mkdir('d')
+        fs.write('d/h', b'h')
+        fs.symlink('f', 'l')
+        first = look(fs)
+        check(fs.checkpoint(1) == 0, 'checkpoint 1')
+
+        fs.write('f', b'b' * 100, 4000)
+        fs.truncate('f', 4500)
+        fs.write('g', b'g')
+        fs.unlink('d/h')
+        fs.rmdir('d')
+        fs.write('d', b'now a file')
+        fs.unlink('l')
+        fs.symlink('g', 'l')
+        second = look(fs)
+        check(second != first, 'nothing changed')
+        check(fs.checkpoint(2) == 0, 'checkpoint 2')
+
+        for key, expected in [(1, first), (2, second), (1, first)]:
+            look(fs)
+            check(fs.restore_keep(key) == 0, 'restore_keep {}'.format(key))
+            check(look(fs) == expected, 'state {}: {}'.format(key, look(fs)))
+            check(fs.stat('f').st_size == len(expected['f']), 'size of f')
+
+sys.exit(0)
@@ -0,0 +1,86 @@
+#!/usr/bin/env python
+
+#
+# This file is part of RefFS.
+# 
+# Copyright (c) 2020-2024 Yifei Liu
+# Copyright (c) 2020-2024 Wei Su
+# Copyright (c) 2020-2024 Erez Zadok
+# Copyright (c) 2020-2024 Stony Brook University
+# Copyright (c) 2020-2024 The Research Foundation of SUNY
+# Original Copyright (C) Peter Watkins
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# RefFS is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+#
+
+
+# Checkpoint/restore round trips of VERIFS_CHECKPOINT and VERIFS_RESTORE.
+# The stored states share their inodes and pages with the live file
+# system until either side modifies them, so the modifications below must
+# not show up in the states taken before.
+
+import errno
+import sys
+from verifs import *
+
+with RamFs() as fs:
+    fs.mkdir('d')
+    fs.write('d/f', b'x' * 10000)
+    fs.write('g', b'hello')
+    fs.link('g', 'd/g2')
+    fs.symlink('d/f', 'l')
+    fs.setxattr('g', 'user.a', b'1')
+    t0 = fs.tree()
+    check(fs.checkpoint(1) == 0, 'checkpoint 1')
+
+    # In place, appended, through another link, then whole files
+    fs.write('d/f', b'y' * 100, 5000)
+    fs.write('g', b' world', 5)
+    fs.write('d/g2', b'J', 0)
+    fs.setxattr('g', 'user.a', b'2')
+    fs.truncate('d/f', 3000)
+    fs.rename('l', 'd/l')
+    fs.mkdir('e')
+    fs.write('e/h', b'new')
+    t1 = fs.tree()
+    check(t1 != t0, 'the tree did not change')
+    check(fs.checkpoint(2) == 0, 'checkpoint 2')
+
+    fs.unlink('d/g2')
+    fs.unlink('e/h')
+    fs.rmdir('e')
+    fs.write('g', b'z' * 9000)
+
+    check(fs.restore(1) == 0, 'restore 1')
+    check(fs.tree() == t0, 'state 1 was not restored')
+    check(fs.getxattr('g', 'user.a') == b'1', 'xattr of state 1')
+    check(fs.stat('g').st_nlink == 2, 'links of state 1')
+    # The hard link is still one file
+    fs.write('g', b'H', 0)
+    check(fs.read('d/g2') == b'Hello', 'hard link after restore')
+
+    check(fs.restore(2) == 0, 'restore 2')
+    check(fs.tree() == t1, 'state 2 was not restored')
+    check(fs.getxattr('g', 'user.a') == b'2', 'xattr of state 2')
+
+    # Restored states are gone, and keys are unique
+    expect_errno(errno.ENOENT, fs.restore, 1)
+    expect_errno(errno.ENOENT, fs.restore, 2)
+    expect_errno(errno.ENOENT, fs.restore, 12345)
+    check(fs.checkpoint(3) == 0, 'checkpoint 3')
+    expect_errno(errno.EEXIST, fs.checkpoint, 3)
+    check(fs.restore(3) == 0, 'restore 3')
+    check(fs.tree() == t1, 'state 3 was not restored')
+
+sys.exit(0)
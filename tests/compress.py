@@ -0,0 +1,79 @@
+#!/usr/bin/env python
+
+#
+# This file is part of RefFS.
+# 
+# Copyright (c) 2020-2024 Yifei Liu
+# Copyright (c) 2020-2024 Wei Su
+# Copyright (c) 2020-2024 Erez Zadok
+# Copyright (c) 2020-2024 Stony Brook University
+# Copyright (c) 2020-2024 The Research Foundation of SUNY
+# Original Copyright (C) Peter Watkins
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# RefFS is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+#
+
+
+# The compress_idle option: states unused for that many seconds are
+# compressed in memory, and decompressed when used.
+
+import errno
+import sys
+import time
+from verifs import *
+
+def wait_compressed(fs, count):
+    for _ in range(10):
+        time.sleep(1)
+        if fs.get_stats()['compressed_states'] == count:
+            return
+    fail('{} states compressed, {} expected'.format(
+        fs.get_stats()['compressed_states'], count))
+
+with RamFs('compress_idle=1') as fs:
+    # The last state checkpointed or restored is kept as it is, as the next
+    # checkpoint may alias it
+    keys = [1, 2, 3]
+    for key in keys + [4]:
+        fs.write('f', content(key, 8))
+        fs.mkdir('d{}'.format(key))
+        check(fs.checkpoint(key) == 0, 'checkpoint {}'.format(key))
+    wait_compressed(fs, len(keys))
+    states = fs.list_states()
+    check(sorted(states) == keys + [4], 'listed {}'.format(sorted(states)))
+    check(all(states[k][0] & STATE_COMPRESSED for k in keys), 'not compressed')
+    check(not states[4][0] & STATE_COMPRESSED, 'state 4 compressed')
+    check(fs.get_stats()['compressed_bytes'] > 0, 'compressed_bytes')
+
+    # Decompressed when used, and compressed again once idle
+    for key in keys:
+        check(fs.restore_keep(key) == 0, 'restore_keep {}'.format(key))
+        check(fs.read('f') == content(key, 8), 'state {} was not restored'.format(key))
+        check(sorted(fs.listdir()) == sorted(['f'] + ['d{}'.format(k) for k in keys if k <= key]),
+              'state {} has the wrong tree'.format(key))
+    check(fs.restore_keep(4) == 0, 'restore_keep 4')
+    wait_compressed(fs, len(keys))
+
+    # Compressed states can be dropped and restored like the others
+    check(fs.drop(1) == 0, 'drop 1')
+    expect_errno(errno.ENOENT, fs.restore, 1)
+    check(fs.get_stats()['compressed_states'] == 2, 'compressed states left')
+    for key in [3, 2]:
+        fs.write('f', b'live')
+        check(fs.restore(key) == 0, 'restore {}'.format(key))
+        check(fs.read('f') == content(key, 8), 'state {} was not restored'.format(key))
+    check(sorted(fs.list_states()) == [4], 'states left')
+    check(fs.get_stats()['compressed_states'] == 0, 'compressed states left')
+
+sys.exit(0)
@@ -0,0 +1,104 @@
+#!/usr/bin/env python
+
+#
+# This file is part of RefFS.
+#
+# Copyright (c) 2020-2024 Yifei Liu
+# Copyright (c) 2020-2024 Wei Su
+# Copyright (c) 2020-2024 Erez Zadok
+# Copyright (c) 2020-2024 Stony Brook University
+# Copyright (c) 2020-2024 The Research Foundation of SUNY
+# Original Copyright (C) Peter Watkins
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# RefFS is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+#
+
+# Checkpoints taken while another thread writes, creates and unlinks files
+# through a multithreaded mount. Each operation runs before or after the
+# capture of a checkpoint, never across it, so every state must be the
+# one left by some prefix of the writer's operations.
+
+import sys
+import threading
+from verifs import *
+
+FILES = 64
+KEYS = 200
+
+def counter(n):
+    return '{:08d}'.format(n).encode()
+
+def last_write(m, n):
+    """The step of the writer that last wrote f<m> by step n, or 0"""
+    return max(n - (n - m) % FILES, 0)
+
+def check_state(fs, key):
+    """One step of the writer writes a, f<a % FILES>, creates c<a>, unlinks
+    c<a - 1> and writes b, in that order"""
+    a = int(fs.read('a'))
+    b = int(fs.read('b'))
+    c = sorted(int(x[1:]) for x in fs.listdir() if x.startswith('c'))
+    if b == a:
+        check(c == [a], 'state {}: a={} b={} c={}'.format(key, a, b, c))
+    else:
+        check(b == a - 1 and c in ([b], [b, a], [a]),
+              'state {}: a={} b={} c={}'.format(key, a, b, c))
+    for m in range(FILES):
+        n = last_write(m, a - 1)
+        if a > 0 and a % FILES == m:
+            expected = [content(a, 2)]
+            if b != a and a not in c:
+                expected.append(content(n, 2))
+        else:
+            expected = [content(n, 2)]
+        check(fs.read('f{}'.format(m)) in expected,
+              'state {}: f{} is not from step {}'.format(key, m, a))
+
+with RamFs('multithreaded') as fs:
+    fs.write('a', counter(0))
+    for m in range(FILES):
+        fs.write('f{}'.format(m), content(0, 2))
+    fs.write('c0', b'')
+    fs.write('b', counter(0))
+
+    stop = threading.Event()
+    error = []
+    def writer():
+        try:
+            n = 1
+            while not stop.is_set():
+                fs.write('a', counter(n))
+                fs.write('f{}'.format(n % FILES), content(n, 2))
+                fs.write('c{}'.format(n), b'')
+                fs.unlink('c{}'.format(n - 1))
+                fs.write('b', counter(n))
+                n += 1
+        except OSError as e:
+            error.append(e)
+    thread = threading.Thread(target=writer)
+    thread.start()
+    try:
+        for key in range(1, KEYS + 1):
+            check(fs.checkpoint(key) == 0, 'checkpoint {}'.format(key))
+    finally:
+        stop.set()
+        thread.join()
+    check(not error, 'writer: {}'.format(error))
+
+    # The states do not change after their checkpoints either
+    for key in range(1, KEYS + 1):
+        check(fs.restore(key) == 0, 'restore {}'.format(key))
+        check_state(fs, key)
+
+sys.exit(0)
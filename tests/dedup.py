@@ -0,0 +1,80 @@
+#!/usr/bin/env python
+
+#
+# This file is part of RefFS.
+# 
+# Copyright (c) 2020-2024 Yifei Liu
+# Copyright (c) 2020-2024 Wei Su
+# Copyright (c) 2020-2024 Erez Zadok
+# Copyright (c) 2020-2024 Stony Brook University
+# Copyright (c) 2020-2024 The Research Foundation of SUNY
+# Original Copyright (C) Peter Watkins
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# RefFS is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+#
+
+
+# The dedup_states option: a checkpoint of a state that is already stored,
+# times aside, stores the same image again instead of a new one.
+
+import errno
+import sys
+from verifs import *
+
+def hash_of(fs, key, flags=0):
+    check(fs.restore_keep(key) == 0, 'restore_keep {}'.format(key))
+    return fs.state_hash(flags)
+
+# Not in undo_journal mode, where checkpoints are journaled
+for options in [None, 'dedup_states', 'dedup_states,undo_journal']:
+    dedup = options == 'dedup_states'
+    with RamFs(options) as fs:
+        fs.mkdir('d')
+        fs.write('f', content(1, 8))
+        check(fs.checkpoint(1) == 0, 'checkpoint 1')
+        fs.write('f', content(2, 8))
+        fs.mkdir('e')
+        check(fs.checkpoint(2) == 0, 'checkpoint 2')
+        # Back to state 1, then only the times change
+        check(fs.restore_keep(1) == 0, 'restore_keep 1')
+        fs.write('f', content(1, 8))
+        fs.truncate('f', 1)
+        fs.write('f', content(1, 8))
+        check(fs.checkpoint(3) == 0, 'checkpoint 3')
+        fs.write('f', content(3, 8))
+        check(fs.checkpoint(4) == 0, 'checkpoint 4')
+
+        # Only an alias keeps the times of state 1
+        check((hash_of(fs, 1) == hash_of(fs, 3)) == dedup, 'times of state 3')
+        check(hash_of(fs, 1, HASH_NO_TIMES) == hash_of(fs, 3, HASH_NO_TIMES),
+              'state 3 differs from state 1')
+        check(hash_of(fs, 1, HASH_NO_TIMES) != hash_of(fs, 2, HASH_NO_TIMES),
+              'state 2 aliased')
+        check(sorted(fs.list_states()) == [1, 2, 3, 4], 'states {}'.format(fs.list_states()))
+
+        # An alias is a state of its own for restores and drops
+        for key in [1, 3]:
+            check(fs.restore_keep(key) == 0, 'restore_keep {}'.format(key))
+            check(fs.read('f') == content(1, 8) and sorted(fs.listdir()) == ['d', 'f'],
+                  'state {} was not restored'.format(key))
+        check(fs.drop(1) == 0, 'drop 1')
+        expect_errno(errno.ENOENT, fs.restore, 1)
+        check(fs.restore(3) == 0, 'restore 3')
+        check(fs.read('f') == content(1, 8), 'state 3 was not restored')
+        check(fs.restore(2) == 0, 'restore 2')
+        check(fs.read('f') == content(2, 8), 'state 2 was not restored')
+        check(fs.restore(4) == 0, 'restore 4')
+        check(fs.read('f') == content(3, 8), 'state 4 was not restored')
+
+sys.exit(0)
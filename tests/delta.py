@@ -0,0 +1,88 @@
+#!/usr/bin/env python
+
+#
+# This file is part of RefFS.
+# 
+# Copyright (c) 2020-2024 Yifei Liu
+# Copyright (c) 2020-2024 Wei Su
+# Copyright (c) 2020-2024 Erez Zadok
+# Copyright (c) 2020-2024 Stony Brook University
+# Copyright (c) 2020-2024 The Research Foundation of SUNY
+# Original Copyright (C) Peter Watkins
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# RefFS is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+#
+
+
+# Delta checkpoints: states taken after a change are stored as the slots
+# changed since their parent, and long chains of them are compacted into
+# a new base in the background.
+
+import errno
+import sys
+import time
+from verifs import *
+
+def take_states(fs, keys):
+    for key in keys:
+        fs.write('f', content(key))
+        fs.mkdir('d{}'.format(key))
+        check(fs.checkpoint(key) == 0, 'checkpoint {}'.format(key))
+
+def restored(fs, key):
+    return fs.read('f') == content(key) and \
+        sorted(n for n in fs.listdir() if n != 'big') == \
+        sorted(['f'] + ['d{}'.format(k) for k in range(1, key + 1)])
+
+with RamFs() as fs:
+    fs.mkdir('big')
+    for n in range(100):
+        fs.write('big/{}'.format(n), b'x')
+    keys = list(range(1, 101))
+    take_states(fs, keys)
+    states = fs.list_states()
+    check(not states[1][0] & STATE_DELTA, 'state 1 is a delta')
+    check(all(states[k][0] & STATE_DELTA for k in range(2, 60)), 'states 2-59 are not deltas')
+    # Only the changes are counted: the root, f and the new directory
+    check(all(states[k][1] <= 3 for k in range(2, 60)), 'delta counts')
+    check(states[1][1] > 100, 'base counts')
+
+    # A chain of VERIFS_MAX_CHAIN_DEPTH deltas gets a new base
+    for _ in range(50):
+        states = fs.list_states()
+        if any(not states[k][0] & STATE_DELTA for k in keys[1:]):
+            break
+        time.sleep(0.1)
+    bases = [k for k in keys if not states[k][0] & STATE_DELTA]
+    check(len(bases) > 1, 'no chain was compacted')
+
+    # The chains do not depend on the keys of the states they were taken from
+    check(fs.drop_range(1, 50) == 50, 'drop 1-50')
+    for key in [100, 51, 75, bases[1], 99]:
+        check(fs.restore_keep(key) == 0, 'restore_keep {}'.format(key))
+        check(restored(fs, key), 'state {} was not restored'.format(key))
+    take_states(fs, [200])
+    check(fs.list_states()[200][0] & STATE_DELTA, 'state taken after a restore')
+    check(fs.restore(200) == 0, 'restore 200')
+    check(fs.read('f') == content(200), 'state 200 was not restored')
+    expect_errno(errno.ENOENT, fs.restore, 50)
+
+# Not with the states spilled or compressed
+with RamFs('compress_idle=100') as fs:
+    take_states(fs, [1, 2, 3])
+    check(all(not info[0] & STATE_DELTA for info in fs.list_states().values()),
+          'delta states with compress_idle')
+    check(fs.restore(2) == 0 and restored(fs, 2), 'state 2 was not restored')
+
+sys.exit(0)
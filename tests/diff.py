@@ -0,0 +1,105 @@
+#!/usr/bin/env python
+
+#
+# This file is part of RefFS.
+# 
+# Copyright (c) 2020-2024 Yifei Liu
+# Copyright (c) 2020-2024 Wei Su
+# Copyright (c) 2020-2024 Erez Zadok
+# Copyright (c) 2020-2024 Stony Brook University
+# Copyright (c) 2020-2024 The Research Foundation of SUNY
+# Original Copyright (C) Peter Watkins
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# RefFS is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+#
+
+
+# VERIFS_DIFF: the differences between stored states and the live file
+# system, by path, with and without the undo journal.
+
+import errno
+import sys
+from verifs import *
+
+NO_TIMES_INO = HASH_NO_TIMES | HASH_NO_INO
+
+def by_path(entries):
+    """The entries other than directories changed by their entries"""
+    return {e[4]: e[:4] for e in entries
+            if not (e[4] in ['/', '/d'] and e[:2] == (DIFF_CHANGED, DIFF_ATTR))}
+
+for options in [None, 'undo_journal']:
+    with RamFs(options) as fs:
+        fs.write('f', b'a' * 10000)
+        fs.mkdir('d')
+        fs.write('d/g', b'g')
+        fs.write('d/h', b'h')
+        fs.symlink('t', 'l')
+        fs.write('x', b'x')
+        check(fs.checkpoint(1) == 0, 'checkpoint 1')
+        check(fs.diff(1, DIFF_LIVE) == [], 'differences before any change')
+
+        fs.write('f', b'zz', 5000)
+        fs.write('d/new', b'new')
+        fs.unlink('d/h')
+        fs.setxattr('d/g', 'user.x', b'1')
+        fs.unlink('l')
+        fs.symlink('tt', 'l')
+        fs.unlink('x')
+        fs.mkdir('x')
+        expected = {
+            '/d/g': (DIFF_CHANGED, DIFF_XATTR, 0, 0),
+            '/d/h': (DIFF_REMOVED, 0, 0, 0),
+            '/d/new': (DIFF_ADDED, 0, 0, 0),
+            '/f': (DIFF_CHANGED, DIFF_CONTENT, 5000, 2),
+            '/l': (DIFF_CHANGED, DIFF_ATTR | DIFF_CONTENT, 0, 2),
+            '/x': (DIFF_CHANGED, DIFF_TYPE, 0, 0),
+        }
+        live = fs.diff(1, DIFF_LIVE, NO_TIMES_INO)
+        check([e[4] for e in live] == sorted(e[4] for e in live), 'not in path order')
+        check(by_path(live) == expected, 'differences {}'.format(live))
+
+        # The same against the stored state, and the other way round
+        check(fs.checkpoint(2) == 0, 'checkpoint 2')
+        check(fs.diff(1, 2, NO_TIMES_INO) == live, 'differences to state 2')
+        swapped = {DIFF_ADDED: DIFF_REMOVED, DIFF_REMOVED: DIFF_ADDED,
+                   DIFF_CHANGED: DIFF_CHANGED}
+        back = by_path(fs.diff(2, 1, NO_TIMES_INO))
+        check(back.keys() == expected.keys() and
+              all(back[p][0] == swapped[expected[p][0]] for p in back),
+              'differences from state 2 {}'.format(back))
+
+        # Times, and inode numbers unless left out
+        changed = by_path(fs.diff(1, 2))
+        check(changed['/f'] == (DIFF_CHANGED, DIFF_ATTR | DIFF_CONTENT, 5000, 2),
+              'times of /f')
+        check(changed['/l'][1] == DIFF_ATTR | DIFF_CONTENT, 'inode number of /l')
+        check(by_path(fs.diff(1, 2, HASH_NO_TIMES))['/l'][1] == DIFF_ATTR | DIFF_CONTENT,
+              'inode number of /l')
+
+        # More differences than one call returns
+        names = ['e{:02}'.format(n) for n in range(DIFF_MAX + 8)]
+        for name in names:
+            fs.write('d/' + name, name.encode())
+        added = fs.diff(2, DIFF_LIVE, NO_TIMES_INO)
+        check([e[4] for e in added if e[0] == DIFF_ADDED] == ['/d/' + n for n in names],
+              'added {}'.format(added))
+        check(fs.restore_keep(2) == 0, 'restore_keep 2')
+        check(fs.diff(2, DIFF_LIVE) == [], 'differences after the restore')
+
+        expect_errno(errno.ENOENT, fs.diff, 1, 3)
+        expect_errno(errno.ENOENT, fs.diff, 3, DIFF_LIVE)
+        expect_errno(errno.EINVAL, fs.diff, 1, DIFF_LIVE, 8)
+
+sys.exit(0)
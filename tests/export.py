@@ -0,0 +1,99 @@
+#!/usr/bin/env python
+
+#
+# This file is part of RefFS.
+# 
+# Copyright (c) 2020-2024 Yifei Liu
+# Copyright (c) 2020-2024 Wei Su
+# Copyright (c) 2020-2024 Erez Zadok
+# Copyright (c) 2020-2024 Stony Brook University
+# Copyright (c) 2020-2024 The Research Foundation of SUNY
+# Original Copyright (C) Peter Watkins
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# RefFS is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+#
+
+
+# VERIFS_EXPORT: the image of the tree of a stored state or of the live
+# file system, read in chunks, with and without the undo journal.
+
+import errno
+import stat
+import sys
+from verifs import *
+
+NAMES = ['f{:03}'.format(n) for n in range(300)]
+
+for options in [None, 'undo_journal']:
+    with RamFs(options) as fs:
+        fs.mkdir('d')
+        for n, name in enumerate(NAMES):
+            fs.write('d/' + name, b'x' * n)
+            fs.setxattr('d/' + name, 'user.a', b'1')
+            fs.setxattr('d/' + name, 'user.b', b'2')
+        fs.link('d/f001', 'hl')
+        fs.symlink('d/f000', 'l')
+
+        header, records = fs.export(EXPORT_LIVE)
+        check(header == (b'VFSTREE\0', 1, 0, EXPORT_LIVE, len(NAMES) + 4),
+              'header {}'.format(header))
+        paths = [r[0] for r in records]
+        check(paths == ['/', '/d'] + ['/d/' + n for n in NAMES] + ['/hl', '/l'],
+              'paths {}'.format(paths[:5]))
+        check(all(stat.S_ISDIR(r[1]) for r in records[:2]), 'directories')
+        files = records[2:2 + len(NAMES)]
+        check(all(stat.S_ISREG(r[1]) and r[2] == n and r[4] == [b'user.a', b'user.b']
+                  for n, r in enumerate(files)), 'files')
+        check(records[-2][1:5] == files[1][1:5], 'hard link')
+        check(stat.S_ISLNK(records[-1][1]) and records[-1][3] == b'd/f000', 'symlink')
+        check(all(r[5] == bytes(32) for r in records), 'hashes without EXPORT_HASHES')
+
+        # A stored state is exported as it was taken
+        check(fs.checkpoint(1) == 0, 'checkpoint 1')
+        fs.unlink('hl')
+        fs.write('d/f002', b'changed')
+        check(fs.export(1) == (header[:3] + (1,) + header[4:], records), 'state 1')
+        check(len(fs.export(EXPORT_LIVE)[1]) == len(records) - 1, 'live records')
+
+        # The hash of each subtree is the one VERIFS_STATE_HASH gives
+        check(fs.restore_keep(1) == 0, 'restore_keep 1')
+        for flags in range(4):
+            _, hashed = fs.export(1, EXPORT_HASHES | flags)
+            check([r[:5] for r in hashed] == [r[:5] for r in records], 'records')
+            check(hashed[0][5] == fs.state_hash(flags),
+                  'hash of the root with flags {}'.format(flags))
+            check(hashed[2][5] != hashed[3][5], 'hashes of the files')
+
+        # The later chunks are read with the cookie
+        cookie, count, nbytes, data = fs.export_chunk(1)
+        check(count == len(records) and nbytes > 2 * EXPORT_CHUNK and
+              len(data) == EXPORT_CHUNK, 'first chunk')
+        expect_errno(errno.ESTALE, fs.export_chunk, 1, 0, EXPORT_CHUNK, cookie + 1)
+        expect_errno(errno.EINVAL, fs.export_chunk, 1, 0, nbytes + 1, cookie)
+        # The image ends with the target of /l
+        check(fs.export_chunk(1, 0, nbytes - 1, cookie)[3] == b'0', 'last byte')
+        # Released once read to the end, or when too many newer exports start
+        expect_errno(errno.ESTALE, fs.export_chunk, 1, 0, EXPORT_CHUNK, cookie)
+        cookies = [fs.export_chunk(1)[0] for i in range(EXPORT_IMAGES)]
+        for cookie in cookies:
+            check(fs.export_chunk(1, 0, EXPORT_CHUNK, cookie)[2] == nbytes,
+                  'image {}'.format(cookie))
+        fs.export_chunk(EXPORT_LIVE)
+        expect_errno(errno.ESTALE, fs.export_chunk, 1, 0, EXPORT_CHUNK, cookies[0])
+        check(fs.export_chunk(1, 0, EXPORT_CHUNK, cookies[1])[2] == nbytes, 'newer image')
+
+        expect_errno(errno.ENOENT, fs.export, 2)
+        expect_errno(errno.EINVAL, fs.export, 1, 8)
+
+sys.exit(0)
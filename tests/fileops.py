@@ -0,0 +1,137 @@
+#!/usr/bin/env python
+
+#
+# This file is part of RefFS.
+# 
+# Copyright (c) 2020-2024 Yifei Liu
+# Copyright (c) 2020-2024 Wei Su
+# Copyright (c) 2020-2024 Erez Zadok
+# Copyright (c) 2020-2024 Stony Brook University
+# Copyright (c) 2020-2024 The Research Foundation of SUNY
+# Original Copyright (C) Peter Watkins
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# RefFS is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+#
+
+
+# VERIFS_FILEOPS: scripts of file operations run in one call, and their
+# results seen through the mount, with and without the undo journal.
+
+import errno
+import os
+import stat
+import sys
+from verifs import *
+
+def op(kind, path, **fields):
+    fields.update(op=kind, path=path.encode())
+    for name in ['name', 'value']:
+        if isinstance(fields.get(name), str):
+            fields[name] = fields[name].encode()
+    return fields
+
+script = [
+    op(FILEOP_MKDIR, 'd', mode=0o750),
+    op(FILEOP_CREATE, 'd/f', mode=0o640),
+    op(FILEOP_WRITE, 'd/f', value='ab', offset=3, length=7),
+    op(FILEOP_CREATE, '/g', mode=0o600),
+    op(FILEOP_WRITE, 'g', offset=0, length=10000),
+    op(FILEOP_TRUNCATE, 'g', offset=100),
+    op(FILEOP_SETXATTR, 'd/f', name='user.x', value='1'),
+    op(FILEOP_MKDIR, 'd/e', mode=0o755),
+    op(FILEOP_CREATE, 'd/e/h', mode=0o644),
+    op(FILEOP_RENAME, 'd/e/h', name='./d/h'),
+    op(FILEOP_RMDIR, 'd/e'),
+    op(FILEOP_UNLINK, 'g'),
+    op(FILEOP_CREATE, 'g', mode=0o644),
+]
+expected = {'d': None, 'd/f': b'\0\0\0abababa', 'd/h': b'', 'g': b''}
+
+for options in [None, 'undo_journal']:
+    with RamFs(options) as fs:
+        check(fs.checkpoint(1) == 0, 'checkpoint 1')
+        ret = fs.fileops(script)
+        check(ret == (len(script), [0] * len(script)), 'fileops {}'.format(ret))
+        check(fs.tree() == expected, 'tree {}'.format(fs.tree()))
+        check(stat.S_IMODE(fs.stat('d').st_mode) == 0o750, 'mode of d')
+        check(stat.S_IMODE(fs.stat('d/f').st_mode) == 0o640, 'mode of d/f')
+        check(fs.getxattr('d/f', 'user.x') == b'1', 'xattr of d/f')
+
+        # Scripts are undone by restores like any other change
+        check(fs.checkpoint(2) == 0, 'checkpoint 2')
+        check(fs.restore_keep(1) == 0, 'restore_keep 1')
+        check(fs.tree() == {}, 'tree {}'.format(fs.tree()))
+        check(fs.fileops(script) == (len(script), [0] * len(script)), 'fileops again')
+        check(fs.tree() == expected, 'tree {}'.format(fs.tree()))
+        fs.write('d/f', b'changed')
+        check(fs.restore(2) == 0, 'restore 2')
+        check(fs.tree() == expected, 'tree {}'.format(fs.tree()))
+
+        # Failures, and the operations canceled after them
+        ret = fs.fileops([op(FILEOP_CREATE, 'x', mode=0o644),
+                          op(FILEOP_MKDIR, 'd', mode=0o755),
+                          op(FILEOP_UNLINK, 'x')])
+        check(ret == (1, [0, -errno.EEXIST, -errno.ECANCELED]), 'fileops {}'.format(ret))
+        ret = fs.fileops([op(FILEOP_UNLINK, 'none'),
+                          op(FILEOP_WRITE, 'd', value='a', length=1),
+                          op(FILEOP_RMDIR, 'd'),
+                          op(FILEOP_RENAME, 'd', name='d/e'),
+                          op(FILEOP_CREATE, 'x/y', mode=0o644),
+                          op(FILEOP_SETXATTR, 'd/f', name='user.x', value='2', mode=1),
+                          op(0, 'x'),
+                          op(FILEOP_UNLINK, 'x')], FILEOPS_CONTINUE)
+        check(ret == (1, [-errno.ENOENT, -errno.EISDIR, -errno.ENOTEMPTY, -errno.EINVAL,
+                          -errno.ENOTDIR, -errno.EEXIST, -errno.EINVAL, 0]),
+              'fileops {}'.format(ret))
+        check(fs.tree() == expected, 'tree {}'.format(fs.tree()))
+        check(fs.getxattr('d/f', 'user.x') == b'1', 'xattr of d/f')
+
+        expect_errno(errno.EINVAL, fs.fileops, [], 2)
+        buf = bytearray(FILEOPS_SIZE)
+        FILEOPS.pack_into(buf, 0, FILEOPS_MAX + 1, 0)
+        expect_errno(errno.EINVAL, fs.ioctl, VERIFS_FILEOPS, buf)
+
+# Scripts run by other users get the permission checks of the system calls
+if os.getuid() == 0:
+    with RamFs() as fs:
+        ret = fs.fileops([op(FILEOP_MKDIR, 'top', mode=0o755),
+                          op(FILEOP_CREATE, 'top/ro', mode=0o644),
+                          op(FILEOP_MKDIR, 'pub', mode=0o777),
+                          op(FILEOP_MKDIR, 'tmp', mode=0o1777),
+                          op(FILEOP_CREATE, 'tmp/root', mode=0o666)])
+        check(ret == (5, [0] * 5), 'fileops {}'.format(ret))
+        pid = os.fork()
+        if pid == 0:
+            os.setgid(65534)
+            os.setuid(65534)
+            ret = fs.fileops([op(FILEOP_CREATE, 'top/x', mode=0o644),
+                              op(FILEOP_CREATE, 'pub/x', mode=0o644),
+                              op(FILEOP_WRITE, 'top/ro', value='a', length=1),
+                              op(FILEOP_SETXATTR, 'top/ro', name='user.x', value='1'),
+                              op(FILEOP_SETXATTR, 'pub/x', name='trusted.x', value='1'),
+                              op(FILEOP_UNLINK, 'top/ro'),
+                              op(FILEOP_UNLINK, 'tmp/root'),
+                              op(FILEOP_RENAME, 'pub/x', name='tmp/root'),
+                              op(FILEOP_RENAME, 'pub/x', name='tmp/x'),
+                              op(FILEOP_UNLINK, 'tmp/x')], FILEOPS_CONTINUE)
+            if ret != (3, [-errno.EACCES, 0, -errno.EACCES, -errno.EACCES, -errno.EPERM,
+                           -errno.EACCES, -errno.EPERM, -errno.EPERM, 0, 0]):
+                print('fileops as nobody {}'.format(ret), file=sys.stderr)
+                os._exit(1)
+            os._exit(0)
+        check(os.waitpid(pid, 0)[1] == 0, 'fileops as nobody')
+        check(fs.tree() == {'top': None, 'top/ro': b'', 'pub': None, 'tmp': None,
+                            'tmp/root': b''}, 'tree {}'.format(fs.tree()))
+
+sys.exit(0)
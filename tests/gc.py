@@ -0,0 +1,79 @@
+#!/usr/bin/env python
+
+#
+# This file is part of RefFS.
+# 
+# Copyright (c) 2020-2024 Yifei Liu
+# Copyright (c) 2020-2024 Wei Su
+# Copyright (c) 2020-2024 Erez Zadok
+# Copyright (c) 2020-2024 Stony Brook University
+# Copyright (c) 2020-2024 The Research Foundation of SUNY
+# Original Copyright (C) Peter Watkins
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# RefFS is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+#
+
+
+# The checkpoint tree: the parents listed by VERIFS_LIST, and VERIFS_GC,
+# with and without the undo journal.
+
+import errno
+import sys
+from verifs import *
+
+def parents(fs):
+    return {key: info[5] for key, info in fs.list_states().items()}
+
+for options in [None, 'undo_journal']:
+    with RamFs(options) as fs:
+        # 1 - 2 - 3
+        #   |   `- 6
+        #   `- 4 - 5
+        for key, base in [(1, None), (2, None), (3, None), (4, 1), (5, None), (6, 2)]:
+            if base is not None:
+                check(fs.restore_keep(base) == 0, 'restore_keep {}'.format(base))
+            fs.write('f', content(key))
+            check(fs.checkpoint(key) == 0, 'checkpoint {}'.format(key))
+        check(parents(fs) == {1: NO_PARENT, 2: 1, 3: 2, 4: 1, 5: 4, 6: 2},
+              'parents {}'.format(parents(fs)))
+
+        # Dropping a state moves its children up
+        check(fs.drop(2) == 0, 'drop 2')
+        check(parents(fs) == {1: NO_PARENT, 3: 1, 4: 1, 5: 4, 6: 1},
+              'parents {}'.format(parents(fs)))
+
+        # The roots and their ancestors are kept, unknown roots ignored
+        check(fs.gc([3, 42]) == 3, 'VERIFS_GC of 3')
+        check(parents(fs) == {1: NO_PARENT, 3: 1}, 'parents {}'.format(parents(fs)))
+        for key in [3, 1, 3]:
+            check(fs.restore_keep(key) == 0, 'restore_keep {}'.format(key))
+            check(fs.read('f') == content(key), 'state {} was not restored'.format(key))
+        check(fs.gc([1, 3]) == 0, 'VERIFS_GC kept')
+
+        # Taken after a restore, a state is a child of the restored one
+        fs.write('f', content(7))
+        check(fs.checkpoint(7) == 0, 'checkpoint 7')
+        check(parents(fs) == {1: NO_PARENT, 3: 1, 7: 3}, 'parents {}'.format(parents(fs)))
+        check(fs.gc([1]) == 2, 'VERIFS_GC of 1')
+        check(fs.restore(1) == 0, 'restore 1')
+        check(fs.read('f') == content(1), 'state 1 was not restored')
+        check(fs.gc([]) == 0, 'VERIFS_GC of nothing')
+
+        check(fs.checkpoint(8) == 0, 'checkpoint 8')
+        expect_errno(errno.EINVAL, fs.ioctl, VERIFS_GC,
+                     GC.pack(GC_MAX + 1, 0, *([0] * GC_MAX)))
+        check(fs.gc([]) == 1, 'VERIFS_GC of everything')
+        check(fs.list_states() == {}, 'states left')
+
+sys.exit(0)
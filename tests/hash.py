@@ -0,0 +1,90 @@
+#!/usr/bin/env python
+
+#
+# This file is part of RefFS.
+# 
+# Copyright (c) 2020-2024 Yifei Liu
+# Copyright (c) 2020-2024 Wei Su
+# Copyright (c) 2020-2024 Erez Zadok
+# Copyright (c) 2020-2024 Stony Brook University
+# Copyright (c) 2020-2024 The Research Foundation of SUNY
+# Original Copyright (C) Peter Watkins
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# RefFS is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+#
+
+
+# VERIFS_STATE_HASH: the hash of the live file system follows its changes,
+# comes back with a restore, and leaves out what its flags ask for.
+
+import errno
+import sys
+from verifs import *
+
+NO_TIMES_INO = HASH_NO_TIMES | HASH_NO_INO
+
+def build(fs, names):
+    fs.mkdir('d')
+    fs.mkdir('d/e')
+    for name in names:
+        fs.write('d/e/' + name, name.encode() * 1000)
+    fs.symlink('d/e/a', 'l')
+    fs.setxattr('d/e/b', 'user.x', b'value')
+
+for options in [None, 'undo_journal']:
+    with RamFs(options) as fs:
+        empty = {flags: fs.state_hash(flags) for flags in range(4)}
+        check(len(set(empty.values())) == 4, 'flags do not change the hash')
+        check(fs.checkpoint(1) == 0, 'checkpoint 1')
+        build(fs, ['a', 'b', 'c'])
+        built = {flags: fs.state_hash(flags) for flags in range(4)}
+        check(all(built[f] != empty[f] for f in built), 'hash did not change')
+        check(fs.state_hash() == built[0], 'hash is not stable')
+        check(fs.checkpoint(2) == 0, 'checkpoint 2')
+
+        # Every kind of change below the root changes it
+        changes = [lambda: fs.write('d/e/c', b'x', 10),
+                   lambda: fs.truncate('d/e/a', 10),
+                   lambda: fs.setxattr('d/e/c', 'user.y', b''),
+                   lambda: fs.rename('d/e/c', 'd/e/z'),
+                   lambda: fs.unlink('l'),
+                   lambda: fs.mkdir('d/e/f')]
+        for change in changes:
+            before = fs.state_hash(NO_TIMES_INO)
+            change()
+            check(fs.state_hash(NO_TIMES_INO) != before, 'hash did not change')
+
+        # Restores bring the hashes back
+        for key, hashes in [(2, built), (1, empty), (2, built)]:
+            check(fs.restore_keep(key) == 0, 'restore_keep {}'.format(key))
+            for flags in range(4):
+                check(fs.state_hash(flags) == hashes[flags],
+                      'state {} has another hash with flags {}'.format(key, flags))
+
+        # The same tree built again has other times, and inode numbers
+        # when built in another order
+        check(fs.restore_keep(1) == 0, 'restore_keep 1')
+        build(fs, ['a', 'b', 'c'])
+        check(fs.state_hash() != built[0], 'times are hashed')
+        check(fs.state_hash(HASH_NO_TIMES) == built[HASH_NO_TIMES], 'same tree')
+        check(fs.restore(1) == 0, 'restore 1')
+        build(fs, ['c', 'b', 'a'])
+        check(fs.state_hash(HASH_NO_TIMES) != built[HASH_NO_TIMES], 'inode numbers are hashed')
+        check(fs.state_hash(NO_TIMES_INO) == built[NO_TIMES_INO], 'same tree')
+        check(fs.restore(2) == 0, 'restore 2')
+        check(fs.state_hash() == built[0], 'state 2 has another hash')
+
+        expect_errno(errno.EINVAL, fs.state_hash, 8)
+
+sys.exit(0)
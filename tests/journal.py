@@ -0,0 +1,86 @@
+#!/usr/bin/env python
+
+#
+# This file is part of RefFS.
+# 
+# Copyright (c) 2020-2024 Yifei Liu
+# Copyright (c) 2020-2024 Wei Su
+# Copyright (c) 2020-2024 Erez Zadok
+# Copyright (c) 2020-2024 Stony Brook University
+# Copyright (c) 2020-2024 The Research Foundation of SUNY
+# Original Copyright (C) Peter Watkins
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# RefFS is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+#
+
+
+# Checkpoint/restore round trips with the undo_journal option, under which
+# the latest checkpoint is an undo journal of the live file system and
+# restoring it rolls back the changes made since. Older checkpoints are
+# stored as usual.
+
+import errno
+import sys
+from verifs import *
+
+with RamFs('undo_journal') as fs:
+    fs.mkdir('d')
+    fs.write('d/f', b'a' * 9000)
+    fs.write('g', b'one')
+    t1 = fs.tree()
+    check(fs.checkpoint(1) == 0, 'checkpoint 1')
+    check(fs.get_stats()['num_states'] == 1, 'journaled checkpoint not counted')
+    expect_errno(errno.EEXIST, fs.checkpoint, 1)
+
+    # Rolled back: changed, new and removed inodes
+    fs.write('d/f', b'b', 4096)
+    fs.write('new', b'x' * 5000)
+    fs.mkdir('d/e')
+    fs.unlink('g')
+    check(fs.restore(1) == 0, 'restore 1')
+    check(fs.tree() == t1, 'journal 1 was not rolled back')
+    expect_errno(errno.ENOENT, fs.restore, 1)
+
+    # A new checkpoint moves the previous one to the stored states
+    check(fs.checkpoint(1) == 0, 'checkpoint 1 again')
+    fs.write('g', b'two')
+    fs.link('g', 'd/g2')
+    t2 = fs.tree()
+    check(fs.checkpoint(2) == 0, 'checkpoint 2')
+    check(fs.get_stats()['num_states'] == 2, 'states after two checkpoints')
+    expect_errno(errno.EEXIST, fs.checkpoint, 1)
+    expect_errno(errno.EEXIST, fs.checkpoint, 2)
+
+    fs.truncate('d/f', 0)
+    fs.rename('d/g2', 'g3')
+    check(fs.restore(2) == 0, 'restore 2')
+    check(fs.tree() == t2, 'journal 2 was not rolled back')
+    check(fs.stat('g').st_nlink == 2, 'links of state 2')
+
+    # Restoring a stored state drops the journal
+    fs.write('g', b'three')
+    check(fs.checkpoint(3) == 0, 'checkpoint 3')
+    fs.unlink('g')
+    # Unless the state is missing
+    expect_errno(errno.ENOENT, fs.restore, 4)
+    check(fs.list_states()[3][0] & STATE_JOURNALED, 'journal 3 was flushed')
+    check(fs.restore(1) == 0, 'restore 1 from the stored states')
+    check(fs.tree() == t1, 'state 1 was not restored')
+    expect_errno(errno.ENOENT, fs.restore, 1)
+    expect_errno(errno.ENOENT, fs.restore, 2)
+    check(fs.restore(3) == 0, 'restore 3')
+    check(fs.read('g') == b'three', 'state 3 was not restored')
+    check(fs.get_stats()['num_states'] == 0, 'states left')
+
+sys.exit(0)
@@ -0,0 +1,80 @@
+#!/usr/bin/env python
+
+#
+# This file is part of RefFS.
+# 
+# Copyright (c) 2020-2024 Yifei Liu
+# Copyright (c) 2020-2024 Wei Su
+# Copyright (c) 2020-2024 Erez Zadok
+# Copyright (c) 2020-2024 Stony Brook University
+# Copyright (c) 2020-2024 The Research Foundation of SUNY
+# Original Copyright (C) Peter Watkins
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# RefFS is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+#
+
+
+# VERIFS_PREFETCH: hinting the next restore changes nothing but its speed,
+# whether the state is in memory, compressed or spilled.
+
+import errno
+import shutil
+import sys
+import tempfile
+import time
+from verifs import *
+
+spill_dir = tempfile.mkdtemp()
+try:
+    for options in [None, 'undo_journal', 'compress_idle=1',
+                    'state_budget=64k,spill_dir=' + spill_dir]:
+        with RamFs(options) as fs:
+            keys = list(range(1, 7))
+            for key in keys:
+                fs.write('f', content(key, 8))
+                fs.write('g{}'.format(key), b'')
+                check(fs.checkpoint(key) == 0, 'checkpoint {}'.format(key))
+            if options and options.startswith('compress_idle'):
+                time.sleep(3)
+
+            # Changes made after the hint are undone all the same
+            for key in [1, 6, 3]:
+                check(fs.prefetch(key) == 0, 'prefetch {}'.format(key))
+                fs.write('f', b'changed')
+                fs.write('h', b'')
+                check(fs.restore_keep(key) == 0, 'restore_keep {}'.format(key))
+                check(fs.read('f') == content(key, 8) and 'h' not in fs.listdir(),
+                      'state {} was not restored'.format(key))
+
+            # A restore of another key, then of the hinted one
+            check(fs.prefetch(2) == 0, 'prefetch 2')
+            check(fs.restore_keep(4) == 0, 'restore_keep 4')
+            check(fs.read('f') == content(4, 8), 'state 4 was not restored')
+            check(fs.restore(2) == 0, 'restore 2')
+            check(fs.read('f') == content(2, 8), 'state 2 was not restored')
+            check(sorted(fs.listdir()) == ['f', 'g1', 'g2'], 'tree of state 2')
+
+            # Dropped after the hint, or never there
+            check(fs.prefetch(5) == 0, 'prefetch 5')
+            check(fs.drop(5) == 0, 'drop 5')
+            expect_errno(errno.ENOENT, fs.restore, 5)
+            check(fs.prefetch(42) == 0, 'prefetch 42')
+            expect_errno(errno.ENOENT, fs.restore, 42)
+            check(fs.restore(3) == 0, 'restore 3')
+            check(fs.read('f') == content(3, 8), 'state 3 was not restored')
+            check(sorted(fs.list_states()) == [1, 4, 6], 'states left')
+finally:
+    shutil.rmtree(spill_dir)
+
+sys.exit(0)
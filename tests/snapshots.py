@@ -0,0 +1,90 @@
+#!/usr/bin/env python
+
+#
+# This file is part of RefFS.
+# 
+# Copyright (c) 2020-2024 Yifei Liu
+# Copyright (c) 2020-2024 Wei Su
+# Copyright (c) 2020-2024 Erez Zadok
+# Copyright (c) 2020-2024 Stony Brook University
+# Copyright (c) 2020-2024 The Research Foundation of SUNY
+# Original Copyright (C) Peter Watkins
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# RefFS is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+#
+
+
+# Read-only views of the stored states under /.snapshots/<key>, with and
+# without the undo journal.
+
+import errno
+import sys
+from verifs import *
+
+for options in [None, 'undo_journal']:
+    with RamFs(options) as fs:
+        fs.mkdir('d')
+        fs.write('d/f', b'state 1')
+        fs.symlink('d/f', 'l')
+        fs.setxattr('d/f', 'user.x', b'1')
+        first = fs.tree()
+        check(fs.checkpoint(1) == 0, 'checkpoint 1')
+        fs.write('d/f', b'STATE 2')
+        fs.unlink('l')
+        fs.mkdir('e')
+        second = fs.tree()
+        check(fs.checkpoint(2) == 0, 'checkpoint 2')
+        fs.write('g', b'live')
+
+        # Browsed without restoring, and not listed in the root
+        check('.snapshots' not in fs.listdir(), '/.snapshots listed')
+        check(sorted(fs.listdir('.snapshots')) == ['1', '2'], 'keys listed')
+        check(fs.tree('.snapshots/1') == {'.snapshots/1/' + p: v for p, v in first.items()},
+              'view of state 1 {}'.format(fs.tree('.snapshots/1')))
+        check(fs.tree('.snapshots/2') == {'.snapshots/2/' + p: v for p, v in second.items()},
+              'view of state 2 {}'.format(fs.tree('.snapshots/2')))
+        check(fs.getxattr('.snapshots/1/d/f', 'user.x') == b'1', 'xattr in view')
+        check(fs.stat('.snapshots/1/d/f').st_size == 7, 'size in view')
+        check('g' in fs.listdir(), 'live file system changed')
+
+        # Read-only
+        for func, args in [(fs.write, ('.snapshots/1/d/f', b'x')),
+                           (fs.write, ('.snapshots/1/d/new', b'x')),
+                           (fs.mkdir, ('.snapshots/1/new',)),
+                           (fs.mkdir, ('.snapshots/3',)),
+                           (fs.unlink, ('.snapshots/1/l',)),
+                           (fs.rmdir, ('.snapshots/1/d',)),
+                           (fs.truncate, ('.snapshots/1/d/f', 0)),
+                           (fs.setxattr, ('.snapshots/1/d/f', 'user.x', b'2'))]:
+            expect_errno(errno.EROFS, func, *args)
+        check(fs.tree('.snapshots/1') == {'.snapshots/1/' + p: v for p, v in first.items()},
+              'view of state 1 changed')
+
+        # Gone with the state
+        check(fs.restore(1) == 0, 'restore 1')
+        check(fs.tree() == first, 'state 1 was not restored')
+        check(fs.listdir('.snapshots') == ['2'], 'keys listed')
+        expect_errno(errno.ENOENT, fs.listdir, '.snapshots/1')
+        expect_errno(errno.ENOENT, fs.stat, '.snapshots/3')
+        check(fs.drop(2) == 0, 'drop 2')
+        check(fs.listdir('.snapshots') == [], 'keys listed')
+
+        # A real entry of the same name hides the views
+        check(fs.checkpoint(3) == 0, 'checkpoint 3')
+        fs.mkdir('.snapshots')
+        check(fs.listdir('.snapshots') == [], 'views not hidden')
+        fs.rmdir('.snapshots')
+        check(fs.listdir('.snapshots') == ['3'], 'keys listed')
+
+sys.exit(0)
@@ -0,0 +1,80 @@
+#!/usr/bin/env python
+
+#
+# This file is part of RefFS.
+# 
+# Copyright (c) 2020-2024 Yifei Liu
+# Copyright (c) 2020-2024 Wei Su
+# Copyright (c) 2020-2024 Erez Zadok
+# Copyright (c) 2020-2024 Stony Brook University
+# Copyright (c) 2020-2024 The Research Foundation of SUNY
+# Original Copyright (C) Peter Watkins
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# RefFS is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+#
+
+
+# The state_budget option: past the budget, the least recently used states
+# are spilled to a file in spill_dir, and loaded back when used.
+
+import errno
+import shutil
+import subprocess
+import sys
+import tempfile
+from verifs import *
+
+spill_dir = tempfile.mkdtemp()
+try:
+    with RamFs('state_budget=64k,spill_dir=' + spill_dir) as fs:
+        keys = list(range(1, 11))
+        for key in keys:
+            fs.write('f', content(key, 8))
+            check(fs.checkpoint(key) == 0, 'checkpoint {}'.format(key))
+        states = fs.list_states()
+        check(sorted(states) == keys, 'listed {}'.format(sorted(states)))
+        spilled = [k for k in keys if states[k][0] & STATE_SPILLED]
+        check(spilled and keys[-1] not in spilled, 'spilled {}'.format(spilled))
+        check(fs.get_stats()['spilled_states'] == len(spilled), 'spilled_states')
+
+        # Loaded back, oldest first, so that the others get spilled
+        for key in keys + keys:
+            check(fs.restore_keep(key) == 0, 'restore_keep {}'.format(key))
+            check(fs.read('f') == content(key, 8), 'state {} was not restored'.format(key))
+        check(sorted(fs.list_states()) == keys, 'states lost')
+
+        # Spilled states can be dropped and restored like the others
+        states = fs.list_states()
+        spilled = [k for k in keys if states[k][0] & STATE_SPILLED]
+        check(spilled, 'nothing spilled after the restores')
+        check(fs.drop(spilled[0]) == 0, 'drop {}'.format(spilled[0]))
+        expect_errno(errno.ENOENT, fs.restore, spilled[0])
+        keys.remove(spilled[0])
+        for key in keys:
+            fs.write('f', b'changed')
+            check(fs.restore(key) == 0, 'restore {}'.format(key))
+            check(fs.read('f') == content(key, 8), 'state {} was not restored'.format(key))
+            expect_errno(errno.ENOENT, fs.restore_keep, key)
+        check(fs.list_states() == {}, 'states left')
+        check(fs.get_stats()['spilled_states'] == 0, 'spilled states left')
+finally:
+    shutil.rmtree(spill_dir)
+
+# The spill file cannot be created
+bad = RamFs('state_budget=64k,spill_dir=' + spill_dir + '/none')
+check(subprocess.run(bad.command(), stdin=subprocess.DEVNULL,
+                     stdout=subprocess.DEVNULL).returncode != 0,
+      'mounted without a spill file')
+
+sys.exit(0)
@@ -0,0 +1,89 @@
+#!/usr/bin/env python
+
+#
+# This file is part of RefFS.
+# 
+# Copyright (c) 2020-2024 Yifei Liu
+# Copyright (c) 2020-2024 Wei Su
+# Copyright (c) 2020-2024 Erez Zadok
+# Copyright (c) 2020-2024 Stony Brook University
+# Copyright (c) 2020-2024 The Research Foundation of SUNY
+# Original Copyright (C) Peter Watkins
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# RefFS is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+#
+
+
+# Managing the stored states: VERIFS_RESTORE_KEEP, VERIFS_DROP,
+# VERIFS_DROP_RANGE and VERIFS_LIST, with and without the undo journal.
+
+import errno
+import sys
+from verifs import *
+
+def take_states(fs, keys):
+    for key in keys:
+        fs.write('f', content(key))
+        if key % 10 == 0:
+            fs.write('d{}'.format(key), b'')
+        check(fs.checkpoint(key) == 0, 'checkpoint {}'.format(key))
+
+def restored(fs, key):
+    return fs.read('f') == content(key) and \
+        ('d{}'.format(key - key % 10) in fs.listdir()) == (key >= 10)
+
+for options in [None, 'undo_journal']:
+    with RamFs(options) as fs:
+        # More states than one VERIFS_LIST call returns
+        keys = list(range(1, LIST_MAX + 37))
+        take_states(fs, keys)
+        states = fs.list_states()
+        check(sorted(states) == keys, 'listed {}'.format(sorted(states)))
+        last = keys[-1]
+        journaled = [k for k in states if states[k][0] & STATE_JOURNALED]
+        check(journaled == ([last] if options else []), 'journaled {}'.format(journaled))
+
+        # Restored and kept, the latest checkpoint too
+        for key in [50, 50, last, 1, last]:
+            fs.write('f', b'changed')
+            check(fs.restore_keep(key) == 0, 'restore_keep {}'.format(key))
+            check(restored(fs, key), 'state {} was not restored'.format(key))
+        check(sorted(fs.list_states()) == keys, 'states lost by restore_keep')
+
+        # Dropped one at a time and by range
+        check(fs.drop(50) == 0, 'drop 50')
+        expect_errno(errno.ENOENT, fs.drop, 50)
+        expect_errno(errno.ENOENT, fs.restore, 50)
+        expect_errno(errno.ENOENT, fs.restore_keep, 50)
+        check(fs.drop_range(10, 19) == 10, 'drop_range 10-19')
+        expect_errno(errno.ENOENT, fs.drop_range, 10, 19)
+        check(fs.drop_range(15, 25) == 6, 'drop_range 15-25')
+        expect_errno(errno.ENOENT, fs.drop_range, 9, 1)
+        expect_errno(errno.ENOENT, fs.drop_range, last + 1, 2 ** 64 - 1)
+        keys = [k for k in keys if k < 10 or (25 < k < 50) or k > 50]
+        check(sorted(fs.list_states()) == keys, 'states left after drops')
+
+        # The states next to the dropped ones are intact
+        for key in [9, 26, 49, 51]:
+            check(fs.restore_keep(key) == 0, 'restore_keep {}'.format(key))
+            check(restored(fs, key), 'state {} was not restored'.format(key))
+
+        # The latest checkpoint can be dropped as well
+        check(fs.drop(last) == 0, 'drop {}'.format(last))
+        expect_errno(errno.ENOENT, fs.restore, last)
+        check(fs.drop_range(0, 2 ** 64 - 1) == len(keys) - 1, 'drop_range all')
+        check(fs.list_states() == {}, 'states left after dropping all')
+        check(fs.checkpoint(1) == 0, 'checkpoint 1 after dropping it')
+
+sys.exit(0)
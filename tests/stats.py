@@ -0,0 +1,81 @@
+#!/usr/bin/env python
+
+#
+# This file is part of RefFS.
+# 
+# Copyright (c) 2020-2024 Yifei Liu
+# Copyright (c) 2020-2024 Wei Su
+# Copyright (c) 2020-2024 Erez Zadok
+# Copyright (c) 2020-2024 Stony Brook University
+# Copyright (c) 2020-2024 The Research Foundation of SUNY
+# Original Copyright (C) Peter Watkins
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# RefFS is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+#
+
+
+# VERIFS_GET_STATS: the state count and the sharing of file pages across
+# states by the content-addressed page store.
+
+import errno
+import sys
+from verifs import *
+
+def check_derived(s):
+    check(s['bytes_saved'] == (s['page_refs'] - s['unique_pages']) * s['page_size'],
+          'bytes_saved: {}'.format(s))
+    if s['unique_pages'] > 0:
+        check(s['dedup_ratio_milli'] == s['page_refs'] * 1000 // s['unique_pages'],
+              'dedup_ratio_milli: {}'.format(s))
+
+with RamFs() as fs:
+    s0 = fs.get_stats()
+    check(s0['num_states'] == 0, 'states of a new file system: {}'.format(s0))
+    check(s0['page_size'] > 0, 'page size: {}'.format(s0))
+    check_derived(s0)
+    page = s0['page_size']
+
+    # Eight copies of one page, and a page of its own
+    fs.write('a', b'p' * (4 * page))
+    fs.write('b', b'p' * (4 * page))
+    fs.write('c', b'q' * page)
+    check(fs.checkpoint(1) == 0, 'checkpoint 1')
+    s1 = fs.get_stats()
+    check(s1['num_states'] == 1, 'states after a checkpoint: {}'.format(s1))
+    check(s1['unique_pages'] - s0['unique_pages'] <= 2, 'pages not shared: {}'.format(s1))
+    check((s1['page_refs'] - s1['unique_pages']) - (s0['page_refs'] - s0['unique_pages']) >= 7,
+          'pages not shared: {}'.format(s1))
+    check_derived(s1)
+
+    # The same state again shares all its pages
+    check(fs.checkpoint(2) == 0, 'checkpoint 2')
+    s2 = fs.get_stats()
+    check(s2['num_states'] == 2, 'states after two checkpoints: {}'.format(s2))
+    check(s2['unique_pages'] == s1['unique_pages'], 'pages copied: {}'.format(s2))
+    check_derived(s2)
+
+    # Failed calls do not change the counts
+    expect_errno(errno.EEXIST, fs.checkpoint, 2)
+    expect_errno(errno.ENOENT, fs.restore, 3)
+    check(fs.get_stats() == s2, 'counts changed by failed calls')
+
+    # Restored states are no longer counted
+    check(fs.restore(2) == 0, 'restore 2')
+    check(fs.restore(1) == 0, 'restore 1')
+    s3 = fs.get_stats()
+    check(s3['num_states'] == 0, 'states after restoring them all: {}'.format(s3))
+    check(s3['unique_pages'] == s2['unique_pages'], 'pages of the live files: {}'.format(s3))
+    check_derived(s3)
+
+sys.exit(0)
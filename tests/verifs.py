@@ -0,0 +1,429 @@
+#!/usr/bin/env python
+
+#
+# This file is part of RefFS.
+#
+# Copyright (c) 2020-2024 Yifei Liu
+# Copyright (c) 2020-2024 Wei Su
+# Copyright (c) 2020-2024 Erez Zadok
+# Copyright (c) 2020-2024 Stony Brook University
+# Copyright (c) 2020-2024 The Research Foundation of SUNY
+# Original Copyright (C) Peter Watkins
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# RefFS is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+#
+
+# Helpers for the tests of the checkpoint/restore ioctls of src/cr.h. Like
+# the other tests, they run from the build directory and mount
+# src/fuse-cpp-ramfs on mnt/fuse-cpp-ramfs.
+
+import errno
+import fcntl
+import os
+import stat
+import struct
+import subprocess
+import sys
+import time
+
+MOUNTPOINT = 'mnt/fuse-cpp-ramfs'
+
+# Ioctl numbers, encoded as by <asm-generic/ioctl.h>
+_IOC_NONE = 0
+_IOC_WRITE = 1
+_IOC_READ = 2
+
+def _IOC(direction, n, size):
+    code = ord('1')
+    return (direction << 30) | (size << 16) | (code << 8) | (code + n)
+
+def _IO(n):
+    return _IOC(_IOC_NONE, n, 0)
+
+def _IOR(n, size):
+    return _IOC(_IOC_READ, n, size)
+
+def _IOW(n, size):
+    return _IOC(_IOC_WRITE, n, size)
+
+def _IOWR(n, size):
+    return _IOC(_IOC_READ | _IOC_WRITE, n, size)
+
+# Structures of src/cr.h, which have no padding
+STATS = struct.Struct('=9Q')
+KEY_RANGE = struct.Struct('=QQ')
+
+LIST_MAX = 64
+STATE_JOURNALED = 1
+STATE_SPILLED = 2
+STATE_COMPRESSED = 4
+STATE_DELTA = 8
+STATE_INFO = struct.Struct('=7Q')
+STATE_LIST = struct.Struct('=QQII')
+STATE_LIST_SIZE = STATE_LIST.size + LIST_MAX * STATE_INFO.size
+
+HASH_NO_TIMES = 1
+HASH_NO_INO = 2
+STATE_HASH = struct.Struct('=II32s')
+
+DIFF_LIVE = (1 << 64) - 1
+DIFF_MAX = 32
+DIFF_ADDED = 1
+DIFF_REMOVED = 2
+DIFF_CHANGED = 3
+DIFF_TYPE = 1
+DIFF_ATTR = 2
+DIFF_XATTR = 4
+DIFF_CONTENT = 8
+DIFF_ENTRY = struct.Struct('=IIQQ232s')
+DIFF = struct.Struct('=QQIIII')
+DIFF_SIZE = DIFF.size + DIFF_MAX * DIFF_ENTRY.size
+
+NO_PARENT = (1 << 64) - 1
+GC_MAX = 64
+GC = struct.Struct('=II%dQ' % GC_MAX)
+
+BATCH_MAX = 32
+BATCH_CHECKPOINT = 1
+BATCH_RESTORE = 2
+BATCH_RESTORE_KEEP = 3
+BATCH_DROP = 4
+BATCH_CONTINUE = 1
+BATCH_CMD = struct.Struct('=IiQ')
+BATCH = struct.Struct('=II')
+BATCH_SIZE = BATCH.size + BATCH_MAX * BATCH_CMD.size
+
+FILEOPS_MAX = 64
+FILEOPS_DATA = 8192
+FILEOP_CREATE = 1
+FILEOP_MKDIR = 2
+FILEOP_WRITE = 3
+FILEOP_TRUNCATE = 4
+FILEOP_UNLINK = 5
+FILEOP_RMDIR = 6
+FILEOP_RENAME = 7
+FILEOP_SETXATTR = 8
+FILEOPS_CONTINUE = 1
+FILEOP = struct.Struct('=IiIIIIIIQQ')
+FILEOPS = struct.Struct('=II')
+FILEOPS_SIZE = FILEOPS.size + FILEOPS_MAX * FILEOP.size + FILEOPS_DATA
+
+EXPORT_LIVE = (1 << 64) - 1
+EXPORT_CHUNK = 8192
+EXPORT_IMAGES = 4
+EXPORT_HASHES = 4
+EXPORT = struct.Struct('=QIIQQQQ')
+EXPORT_SIZE = EXPORT.size + EXPORT_CHUNK
+EXPORT_HEADER = struct.Struct('=8sIIQQ')
+# struct verifs_export_entry, with the struct stat of x86-64 Linux
+EXPORT_ENTRY = struct.Struct('=IIII' + 'QQQIIIIQqqq6q3q' + '32s')
+
+VERIFS_CHECKPOINT = _IO(1)
+VERIFS_RESTORE = _IO(2)
+VERIFS_GET_STATS = _IOR(5, STATS.size)
+VERIFS_DROP = _IO(6)
+VERIFS_DROP_RANGE = _IOW(7, KEY_RANGE.size)
+VERIFS_RESTORE_KEEP = _IO(8)
+VERIFS_LIST = _IOWR(9, STATE_LIST_SIZE)
+VERIFS_STATE_HASH = _IOWR(10, STATE_HASH.size)
+VERIFS_DIFF = _IOWR(11, DIFF_SIZE)
+VERIFS_GC = _IOW(12, GC.size)
+VERIFS_BATCH = _IOWR(13, BATCH_SIZE)
+VERIFS_FILEOPS = _IOWR(14, FILEOPS_SIZE)
+VERIFS_EXPORT = _IOWR(15, EXPORT_SIZE)
+VERIFS_PREFETCH = _IO(16)
+VERIFS_CHECKPOINT_ASYNC = _IO(17)
+
+
+def fail(msg):
+    sys.stderr.write(msg + '\n')
+    sys.exit(-1)
+
+def check(cond, msg):
+    if not cond:
+        fail(msg)
+
+def expect_errno(err, func, *args):
+    try:
+        func(*args)
+    except OSError as e:
+        if e.errno != err:
+            fail('{}{}: expected {} actual {}'.format(func.__name__, args,
+                 errno.errorcode[err], errno.errorcode.get(e.errno, e.errno)))
+        return
+    fail('{}{}: expected {}'.format(func.__name__, args, errno.errorcode[err]))
+
+def make_sure_path_exists(path):
+    try:
+        os.makedirs(path)
+    except OSError as exception:
+        if exception.errno != errno.EEXIST:
+            raise
+
+def content(key, pages=0):
+    """Data telling the state of key apart from the others: some text, or
+    that many pages, which differ so that the page store cannot share them"""
+    if pages == 0:
+        return 'state {}'.format(key).encode() * 100
+    return bytes((key * 7 + i) % 251 for i in range(pages * 4096))
+
+
+class RamFs:
+    """A fresh file system mounted with the -o options given for the
+    duration of a with block, and the ioctls issued on its root."""
+
+    def __init__(self, options=None):
+        self.options = options
+
+    def command(self):
+        args = ['src/fuse-cpp-ramfs']
+        if self.options:
+            args += ['-o', self.options]
+        return args + [MOUNTPOINT]
+
+    def __enter__(self):
+        make_sure_path_exists(MOUNTPOINT)
+        self.child = subprocess.Popen(self.command(), stdout=subprocess.DEVNULL)
+        for _ in range(100):
+            if os.path.ismount(MOUNTPOINT):
+                break
+            time.sleep(0.1)
+        else:
+            self.child.kill()
+            fail('{} was not mounted'.format(MOUNTPOINT))
+        self.fd = os.open(MOUNTPOINT, os.O_RDONLY)
+        return self
+
+    def __exit__(self, *exc):
+        os.close(self.fd)
+        if sys.platform == 'darwin':
+            subprocess.run(['umount', MOUNTPOINT])
+        else:
+            subprocess.run(['fusermount', '-u', MOUNTPOINT])
+        self.child.wait()
+        if exc[0] is None and self.child.returncode != 0:
+            fail('fuse-cpp-ramfs exited with {}'.format(self.child.returncode))
+
+    def path(self, name):
+        return os.path.join(MOUNTPOINT, name)
+
+    def write(self, name, data, offset=0):
+        fd = os.open(self.path(name), os.O_WRONLY | os.O_CREAT, 0o644)
+        try:
+            os.pwrite(fd, data, offset)
+        finally:
+            os.close(fd)
+
+    def read(self, name):
+        with open(self.path(name), 'rb') as f:
+            return f.read()
+
+    def mkdir(self, name):
+        os.mkdir(self.path(name))
+
+    def unlink(self, name):
+        os.unlink(self.path(name))
+
+    def rmdir(self, name):
+        os.rmdir(self.path(name))
+
+    def rename(self, old, new):
+        os.rename(self.path(old), self.path(new))
+
+    def link(self, old, new):
+        os.link(self.path(old), self.path(new))
+
+    def symlink(self, target, name):
+        os.symlink(target, self.path(name))
+
+    def readlink(self, name):
+        return os.readlink(self.path(name))
+
+    def truncate(self, name, size):
+        os.truncate(self.path(name), size)
+
+    def setxattr(self, name, attr, value):
+        os.setxattr(self.path(name), attr, value)
+
+    def getxattr(self, name, attr):
+        return os.getxattr(self.path(name), attr)
+
+    def stat(self, name):
+        return os.lstat(self.path(name))
+
+    def listdir(self, name=''):
+        return os.listdir(self.path(name))
+
+    def tree(self, name=''):
+        """Every path below name with its contents, None for a directory
+        and the target for a symlink, to compare states"""
+        res = {}
+        for entry in self.listdir(name):
+            path = os.path.join(name, entry)
+            mode = self.stat(path).st_mode
+            if stat.S_ISDIR(mode):
+                res[path] = None
+                res.update(self.tree(path))
+            elif stat.S_ISLNK(mode):
+                res[path] = self.readlink(path)
+            else:
+                res[path] = self.read(path)
+        return res
+
+    def ioctl(self, cmd, arg=0):
+        return fcntl.ioctl(self.fd, cmd, arg)
+
+    def checkpoint(self, key):
+        return self.ioctl(VERIFS_CHECKPOINT, key)
+
+    def checkpoint_async(self, key):
+        return self.ioctl(VERIFS_CHECKPOINT_ASYNC, key)
+
+    def restore(self, key):
+        return self.ioctl(VERIFS_RESTORE, key)
+
+    def restore_keep(self, key):
+        return self.ioctl(VERIFS_RESTORE_KEEP, key)
+
+    def drop(self, key):
+        return self.ioctl(VERIFS_DROP, key)
+
+    def drop_range(self, first, last):
+        return self.ioctl(VERIFS_DROP_RANGE, KEY_RANGE.pack(first, last))
+
+    def prefetch(self, key):
+        return self.ioctl(VERIFS_PREFETCH, key)
+
+    def get_stats(self):
+        buf = bytearray(STATS.size)
+        self.ioctl(VERIFS_GET_STATS, buf)
+        names = ['num_states', 'unique_pages', 'page_refs', 'page_size',
+                 'bytes_saved', 'dedup_ratio_milli', 'spilled_states',
+                 'compressed_states', 'compressed_bytes']
+        return dict(zip(names, STATS.unpack(buf)))
+
+    def list_states(self):
+        """The stored states, by key: (flags, num_inodes, num_pages,
+        private_inodes, private_pages, parent)"""
+        states = {}
+        start = 0
+        while True:
+            buf = bytearray(STATE_LIST_SIZE)
+            STATE_LIST.pack_into(buf, 0, start, 0, 0, 0)
+            self.ioctl(VERIFS_LIST, buf)
+            _, total, count, more = STATE_LIST.unpack_from(buf)
+            for n in range(count):
+                info = STATE_INFO.unpack_from(buf, STATE_LIST.size + n * STATE_INFO.size)
+                states[info[0]] = info[1:]
+                start = info[0] + 1
+            if not more:
+                check(len(states) == total,
+                      'VERIFS_LIST: {} states listed, {} in total'.format(len(states), total))
+                return states
+
+    def state_hash(self, flags=0):
+        buf = bytearray(STATE_HASH.pack(flags, 0, b''))
+        self.ioctl(VERIFS_STATE_HASH, buf)
+        return STATE_HASH.unpack(buf)[2]
+
+    def diff(self, key_a, key_b, flags=0):
+        """The differences as (kind, what, offset, length, path)"""
+        entries = []
+        while True:
+            buf = bytearray(DIFF_SIZE)
+            DIFF.pack_into(buf, 0, key_a, key_b, flags, len(entries), 0, 0)
+            self.ioctl(VERIFS_DIFF, buf)
+            count, more = DIFF.unpack_from(buf)[4:6]
+            for n in range(count):
+                kind, what, offset, length, path = \
+                    DIFF_ENTRY.unpack_from(buf, DIFF.size + n * DIFF_ENTRY.size)
+                entries.append((kind, what, offset, length,
+                                path.split(b'\0', 1)[0].decode()))
+            if not more:
+                return entries
+
+    def gc(self, roots):
+        roots = list(roots)
+        return self.ioctl(VERIFS_GC, GC.pack(len(roots), 0,
+                                             *(roots + [0] * (GC_MAX - len(roots)))))
+
+    def batch(self, cmds, flags=0):
+        """Run (op, key) commands; returns the result and their statuses"""
+        buf = bytearray(BATCH_SIZE)
+        BATCH.pack_into(buf, 0, len(cmds), flags)
+        for n, (op, key) in enumerate(cmds):
+            BATCH_CMD.pack_into(buf, BATCH.size + n * BATCH_CMD.size, op, 0, key)
+        ret = self.ioctl(VERIFS_BATCH, buf)
+        return ret, [BATCH_CMD.unpack_from(buf, BATCH.size + n * BATCH_CMD.size)[1]
+                     for n in range(len(cmds))]
+
+    def fileops(self, ops, flags=0):
+        """Run operations given as dicts with the fields of struct
+        verifs_fileop, path, name and value being bytes; returns the
+        result and their statuses"""
+        buf = bytearray(FILEOPS_SIZE)
+        data = bytearray()
+        def put(s):
+            offset = len(data)
+            data.extend(s + b'\0')
+            return offset
+        FILEOPS.pack_into(buf, 0, len(ops), flags)
+        for n, op in enumerate(ops):
+            path = put(op.get('path', b''))
+            name = put(op.get('name', b''))
+            value = op.get('value', b'')
+            value_off = len(data)
+            data.extend(value)
+            FILEOP.pack_into(buf, FILEOPS.size + n * FILEOP.size, op['op'], 0,
+                             path, name, value_off, len(value), op.get('mode', 0),
+                             0, op.get('offset', 0), op.get('length', 0))
+        data_off = FILEOPS.size + FILEOPS_MAX * FILEOP.size
+        buf[data_off:data_off + len(data)] = data
+        ret = self.ioctl(VERIFS_FILEOPS, buf)
+        return ret, [FILEOP.unpack_from(buf, FILEOPS.size + n * FILEOP.size)[1]
+                     for n in range(len(ops))]
+
+    def export_chunk(self, key, flags=0, offset=0, cookie=0):
+        """One call of VERIFS_EXPORT: (cookie, count, bytes, data)"""
+        buf = bytearray(EXPORT_SIZE)
+        EXPORT.pack_into(buf, 0, key, flags, 0, offset, cookie, 0, 0)
+        self.ioctl(VERIFS_EXPORT, buf)
+        _, _, length, _, cookie, count, nbytes = EXPORT.unpack_from(buf)
+        return cookie, count, nbytes, bytes(buf[EXPORT.size:EXPORT.size + length])
+
+    def export(self, key, flags=0):
+        """The image of a state: its header and records, each as (path,
+        mode, size, link, xattr names, hash)"""
+        cookie, count, nbytes, image = self.export_chunk(key, flags)
+        while len(image) < nbytes:
+            _, _, _, data = self.export_chunk(key, flags, len(image), cookie)
+            check(len(data) > 0, 'VERIFS_EXPORT: short image')
+            image += data
+        header = EXPORT_HEADER.unpack_from(image)
+        records = []
+        pos = EXPORT_HEADER.size
+        for _ in range(header[4]):
+            entry = EXPORT_ENTRY.unpack_from(image, pos)
+            path_len, link_len, num_xattrs, xattr_len = entry[:4]
+            mode, size, digest = entry[7], entry[12], entry[-1]
+            pos += EXPORT_ENTRY.size
+            path = image[pos:pos + path_len].decode()
+            pos += path_len
+            link = image[pos:pos + link_len]
+            pos += link_len
+            xattrs = [x for x in image[pos:pos + xattr_len].split(b'\0') if x]
+            pos += xattr_len
+            records.append((path, mode, size, link, xattrs, digest))
+        check(pos == nbytes and len(records) == count, 'VERIFS_EXPORT: bad image')
+        return header, records